@@ -0,0 +1,213 @@
+/************************************************************************//**
+ * \file
+ * \brief Finds the fastest reliable link settings for a programmer.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "autotune.h"
+#include "cmd.h"
+#include "linkcfg.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// SPI clock frequencies to test, in ascending order
+static const uint32_t atClk[] = {
+	100000, 200000, 400000, 750000, 1000000, 1500000, 2000000, 3000000
+};
+
+/// FTDI latency timer values to test, in milliseconds
+static const uint8_t atLatency[] = {1, 2, 4, 16};
+
+/// USB chunk sizes to test
+static const uint32_t atChunk[] = {4096, 16384, SC_USB_CHUNK};
+
+/// Number of elements of an array
+#define AT_ARRAY_LEN(a)	(sizeof(a)/sizeof(a[0]))
+
+/// Data used to test link settings
+typedef struct {
+	/// CHR and PRG flash data, read using the default settings
+	uint8_t ref[2][AT_READ_LEN];
+	/// Data read using the tested settings
+	uint8_t buf[AT_READ_LEN];
+	/// Patterns written to the loopback buffer
+	uint8_t pattern[AT_LOOP_ROUNDS][CMD_LOOP_LEN];
+	/// Programmer has a loopback buffer
+	int loop;
+} AtData;
+
+/************************************************************************//**
+ * Reads data from the beginning of a cartridge flash chip.
+ *
+ * \param[in]  command Read command code (CMD_CHR_READ or CMD_PRG_READ).
+ * \param[out] data    Data read.
+ *
+ * \return 0 on success, -1 on error.
+ ****************************************************************************/
+static int AtFlashRead(uint8_t command, uint8_t *data) {
+	CmdRep *rep;
+
+	return (CmdPipeRead(command, 0, data, AT_READ_LEN, &rep, NULL,
+				NULL) != CMD_OK)?-1:0;
+}
+
+/************************************************************************//**
+ * Writes a pattern to the programmer loopback buffer, and reads it back.
+ *
+ * \param[in] pattern Pattern to write, CMD_LOOP_LEN bytes long.
+ * \param[in] buf     Scratch buffer for the read pattern.
+ *
+ * \return 0 if the pattern was read back unchanged, -1 otherwise.
+ ****************************************************************************/
+static int AtLoop(const uint8_t *pattern, uint8_t *buf) {
+	const uint16_t len = CMD_LOOP_LEN;
+	Cmd cmd;
+	CmdRep *rep;
+
+	cmd.rdWr.cmd = CMD_LOOP_WRITE;
+	CMD_SET_ADDR(cmd.rdWr.addr, 0);
+	CMD_SET_LEN(cmd.rdWr.len, len);
+	if ((CmdSendLongCmd(&cmd, sizeof(CmdRdWrHdr), pattern, CMD_LOOP_LEN,
+			&rep) != CMD_OK) || (rep->command != CMD_REP_OK)) return -1;
+	cmd.rdWr.cmd = CMD_LOOP_READ;
+	memset(buf, ~pattern[0], CMD_LOOP_LEN);
+	if ((CmdSendLongRep(&cmd, sizeof(CmdRdWrHdr), &rep, buf,
+			CMD_LOOP_LEN) != CMD_LOOP_LEN) ||
+			(rep->command != CMD_REP_OK)) return -1;
+
+	return memcmp(pattern, buf, CMD_LOOP_LEN)?-1:0;
+}
+
+/************************************************************************//**
+ * Tests a link setting, reading the beginning of both flash chips, and
+ * writing and reading back the loopback buffer AT_LOOP_ROUNDS times.
+ *
+ * \param[in] cfg Link settings to test.
+ * \param[in] at  Test data.
+ *
+ * \return Time taken by the test in microseconds, or -1 if any of the
+ *         transfers failed, or needed damaged chunks to be transferred
+ *         again.
+ ****************************************************************************/
+static long AtTry(const ScLinkCfg *cfg, AtData *at) {
+	struct timespec start, end;
+	uint32_t crcErrors = CmdCrcErrorsGet();
+	int i, chip;
+
+	if (CmdLinkSet(cfg)) return -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (chip = 0; chip < 2; chip++) {
+		memset(at->buf, ~at->ref[chip][0], AT_READ_LEN);
+		if (AtFlashRead(CMD_CHR_READ + chip, at->buf) ||
+				memcmp(at->ref[chip], at->buf, AT_READ_LEN)) return -1;
+	}
+	for (i = 0; at->loop && (i < AT_LOOP_ROUNDS); i++)
+		if (AtLoop(at->pattern[i], at->buf)) return -1;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	// Transfers recovered by the CRC protection do not count as working
+	if (CmdCrcErrorsGet() != crcErrors) return -1;
+
+	return (end.tv_sec - start.tv_sec) * 1000000 +
+		(end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/************************************************************************//**
+ * Obtains the throughput of a test.
+ *
+ * \param[in] at Test data.
+ * \param[in] us Time taken by the test, in microseconds.
+ *
+ * \return Throughput in bytes per second.
+ ****************************************************************************/
+static long AtRate(const AtData *at, long us) {
+	long bytes = 2L * AT_READ_LEN;
+
+	if (at->loop) bytes += 2L * AT_LOOP_ROUNDS * CMD_LOOP_LEN;
+	return bytes * 1000000 / MAX(us, 1);
+}
+
+/************************************************************************//**
+ * Tests link settings with the connected programmer, applies the fastest
+ * reliable one and stores it for later runs. Must be called after
+ * CmdInit(). A cartridge must be inserted in the programmer.
+ *
+ * \return 0 if link settings were tuned, -1 on error.
+ ****************************************************************************/
+int AutoTune(void) {
+	const ScLinkCfg safe = {SC_SPI_CLK, SC_USB_CHUNK, SC_LATENCY_MS};
+	const char *serial = CmdSerialGet();
+	ScLinkCfg best, cfg = safe;
+	long bestTime = -1, t;
+	unsigned int c, l, k;
+	AtData *at;
+	int i, ret = -1;
+
+	if (!*serial) {
+		PrintErr("Programmer serial number unknown, cannot store settings!\n");
+		return -1;
+	}
+	if (!(at = malloc(sizeof(AtData)))) {
+		perror("Allocating autotune buffers");
+		return -1;
+	}
+	// Reference data, read using the default settings
+	if (CmdLinkSet(&safe) || AtFlashRead(CMD_CHR_READ, at->ref[0]) ||
+			AtFlashRead(CMD_PRG_READ, at->ref[1])) {
+		PrintErr("Link test failed with default settings!\n");
+		goto out;
+	}
+	at->loop = CmdProtoGet()->caps & CMD_CAP_LOOP;
+	if (!at->loop) {
+		printf("WARNING: Programmer has no loopback buffer, only reads "
+				"are tested.\n");
+	}
+	srand(time(NULL));
+	for (i = 0; i < AT_LOOP_ROUNDS * CMD_LOOP_LEN; i++)
+		at->pattern[0][i] = rand();
+
+	// Find the fastest clock working with the default latency and chunk
+	for (c = 0; c < AT_ARRAY_LEN(atClk); c++) {
+		printf("Testing SPI clock %7u Hz... ", atClk[c]); fflush(stdout);
+		cfg.clk = atClk[c];
+		// Higher clocks will not work if this one does not
+		if ((t = AtTry(&cfg, at)) < 0) {
+			printf("FAILED!\n");
+			break;
+		}
+		printf("%ld bytes/s\n", AtRate(at, t));
+		bestTime = t;
+		best = cfg;
+	}
+	if (bestTime < 0) {
+		CmdLinkSet(&safe);
+		PrintErr("No working link settings found!\n");
+		goto out;
+	}
+	// Find the fastest latency and chunk working with that clock
+	printf("Testing latency and USB chunk at %u Hz... ", best.clk);
+	fflush(stdout);
+	cfg.clk = best.clk;
+	for (l = 0; l < AT_ARRAY_LEN(atLatency); l++) {
+		cfg.latency = atLatency[l];
+		for (k = 0; k < AT_ARRAY_LEN(atChunk); k++) {
+			cfg.chunk = atChunk[k];
+			if (((t = AtTry(&cfg, at)) >= 0) && (t < bestTime)) {
+				bestTime = t;
+				best = cfg;
+			}
+		}
+	}
+	printf("%ld bytes/s\n", AtRate(at, bestTime));
+	printf("Using SPI clock %u Hz, latency %u ms, USB chunk %u bytes.\n",
+			best.clk, best.latency, best.chunk);
+	if (!CmdLinkSet(&best) && !LinkCfgSave(serial, &best)) ret = 0;
+
+out:
+	free(at);
+	return ret;
+}
+
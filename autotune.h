@@ -0,0 +1,49 @@
+/************************************************************************//**
+ * \file
+ * \brief Finds the fastest reliable link settings for a programmer.
+ *
+ * \defgroup autotune autotune
+ * \{
+ * \brief Finds the fastest reliable link settings for a programmer.
+ *
+ * Link settings (SPI clock, FTDI latency timer and USB chunk size) are
+ * tested by reading the beginning of the cartridge CHR and PRG flash chips,
+ * comparing the data with the one read using the default settings, and by
+ * writing random patterns to the programmer loopback buffer (CMD_CAP_LOOP)
+ * and reading them back, so both transfer directions are tested with long
+ * payloads. Nothing is written to the cartridge, so its contents (e.g. the
+ * battery backed SRAM saves) are safe even if tuning is interrupted. A
+ * setting works if all the transfers complete unchanged, without damaged
+ * chunks transferred again by the CRC protection.
+ *
+ * The fastest working SPI clock is searched first, using the default
+ * latency timer and USB chunk size, and then the fastest latency timer and
+ * USB chunk size combination working with that clock. The result is stored
+ * for the serial number of the programmer, so it is used by SCInit() from
+ * then on.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _AUTOTUNE_H_
+#define _AUTOTUNE_H_
+
+/// Length of the data read from each flash chip to test a setting
+#define AT_READ_LEN		(64 * 1024)
+/// Number of times the loopback buffer is written and read back to test a
+/// setting
+#define AT_LOOP_ROUNDS	2
+
+/************************************************************************//**
+ * Tests link settings with the connected programmer, applies the fastest
+ * reliable one and stores it for later runs. Must be called after
+ * CmdInit(). A cartridge must be inserted in the programmer.
+ *
+ * \return 0 if link settings were tuned, -1 on error.
+ ****************************************************************************/
+int AutoTune(void);
+
+#endif /*_AUTOTUNE_H_*/
+
+/** \} */
+
@@ -9,14 +9,170 @@
 #include <string.h>
 #include <stdio.h>		// Just for debugging
 #include <stdlib.h>
+#include <stddef.h>
+#include <glib.h>
 #include "spi-com.h"
+#include "rle.h"
+#include "stats.h"
 #include "util.h"
 
-/// MPSSE SPI handler for communications with programmer
-static struct mpsse_context *spi;
+/// Command context, holding the state of the communications with a
+/// programmer.
+struct CmdCtx {
+	ScCtx *spi;			///< SPI handler for communications with programmer
+	CmdRep repBuf;		///< Buffer holding the reply to the last command sent
+	CmdProto proto;		///< Protocol negotiated with the programmer
+	uint16_t page;		///< Flash page length write chunks are aligned to
+	uint32_t crcErrors;	///< Damaged payload chunks transferred again
+	/// Buffer for RLE compressed write payloads
+	uint8_t rleBuf[CMD_PIPE_CHUNK];
+};
+
+/// Command context bound to each thread
+static GPrivate cmdCtxKey = G_PRIVATE_INIT(NULL);
+
+/************************************************************************//**
+ * Obtains the command context bound to the calling thread.
+ *
+ * \return The command context.
+ ****************************************************************************/
+static inline CmdCtx *CmdCtxGet(void) {
+	return g_private_get(&cmdCtxKey);
+}
+
+/************************************************************************//**
+ * Adds a command round trip to the statistic of its opcode.
+ *
+ * \param[in] command Command code.
+ * \param[in] start   Round trip start time, obtained with StatsStart().
+ * \param[in] bytes   Payload bytes sent or received by the command.
+ ****************************************************************************/
+static void CmdStatsEnd(uint8_t command, uint64_t start, uint32_t bytes) {
+	command &= ~CMD_F_RLE;
+	if (command < STATS_CMD_OPCODES)
+		StatsEnd(STATS_CMD + command, start, bytes);
+}
+
+/************************************************************************//**
+ * Negotiates the protocol version with the programmer. The request announces
+ * the highest protocol version and the features supported by the host, and
+ * the reply the ones enabled by the firmware. Old firmware ignores them,
+ * and replies without the protocol fields, so the original framing is kept
+ * in that case.
+ *
+ * \return CMD_OK if the command completed successfully. CMD_ERROR otherwise.
+ ****************************************************************************/
+static int CmdProtoNegotiate(void) {
+	CmdCtx *cc = CmdCtxGet();
+	Cmd cmd;
+	CmdRep *rep;
+	int len;
+	uint16_t maxFrame;
+	uint8_t features;
+
+	cc->proto.proto = CMD_PROTO_V1;
+	cc->proto.features = 0;
+	cc->proto.maxFrame = SC_MAX_DATALEN;
+	cc->proto.window = 1;
+	cc->proto.caps = 0;
+
+	cmd.fwVer.cmd = CMD_FW_VER;
+	cmd.fwVer.proto = CMD_PROTO_V2;
+	cmd.fwVer.features = CMD_PROTO_F_BULK | CMD_PROTO_F_CRC |
+		CMD_PROTO_F_READY | CMD_PROTO_F_PIPE;
+	if (SCDuplexSupported(cc->spi)) cmd.fwVer.features |= CMD_PROTO_F_DUPLEX;
+	if ((len = CmdSend(&cmd, sizeof(CmdFwVer), &rep)) < 0) return CMD_ERROR;
+	if (rep->fwVer.code != CMD_REP_OK ||
+			len < (int)offsetof(CmdRepFwVer, window) ||
+			rep->fwVer.proto < CMD_PROTO_V2) return CMD_OK;
+
+	maxFrame = MIN((rep->fwVer.maxFrame[0]<<8) | rep->fwVer.maxFrame[1],
+			SC_V2_MAX_DATALEN);
+	if (maxFrame < CMD_PROTO_V2_MINFRAME) return CMD_OK;
+	// CRC protection is only available along with the bulk phase
+	features = rep->fwVer.features & CMD_PROTO_F_BULK;
+	if (features) features |= rep->fwVer.features & CMD_PROTO_F_CRC;
+	if (SCProtoSet(cc->spi, maxFrame, features)) return CMD_ERROR;
+	if (rep->fwVer.features & CMD_PROTO_F_DUPLEX) {
+		if (SCDuplexSet(cc->spi, TRUE)) return CMD_ERROR;
+		features |= CMD_PROTO_F_DUPLEX;
+	}
+	if (rep->fwVer.features & CMD_PROTO_F_READY) {
+		if (SCReadySet(cc->spi, TRUE)) return CMD_ERROR;
+		features |= CMD_PROTO_F_READY;
+	}
+	// Pipelining needs a window of at least 2 requests to be useful
+	if ((rep->fwVer.features & CMD_PROTO_F_PIPE) &&
+			(len >= (int)sizeof(CmdRepFwVer)) && (rep->fwVer.window > 1)) {
+		features |= CMD_PROTO_F_PIPE;
+		cc->proto.window = MIN(rep->fwVer.window, CMD_PIPE_MAXWIN);
+	}
+	cc->proto.proto = CMD_PROTO_V2;
+	cc->proto.features = features;
+	cc->proto.maxFrame = maxFrame;
+
+	return CMD_OK;
+}
+
+/************************************************************************//**
+ * Queries the programmer capabilities, and stores them along with the
+ * negotiated protocol. Only protocol v2 firmware is queried, older firmware
+ * might not reply to unknown commands. Pipelining firmware is assumed to
+ * accept batched commands, even if it does not support the query.
+ *
+ * \return CMD_OK if the command completed successfully. CMD_ERROR otherwise.
+ ****************************************************************************/
+static int CmdCapsQuery(void) {
+	CmdCtx *cc = CmdCtxGet();
+	Cmd cmd;
+	CmdRep *rep;
+	int len;
+
+	if (cc->proto.features & CMD_PROTO_F_PIPE) cc->proto.caps |= CMD_CAP_BATCH;
+	if (cc->proto.proto < CMD_PROTO_V2) return CMD_OK;
+
+	cmd.command = CMD_CAPS;
+	if ((len = CmdSend(&cmd, 1, &rep)) < 0) return CMD_ERROR;
+	if ((rep->caps.code != CMD_REP_OK) || (len < (int)sizeof(CmdRepCaps)))
+		return CMD_OK;
+	cc->proto.caps |= (rep->caps.caps[0]<<8) | rep->caps.caps[1];
+	// Batched commands are limited by the pipelining window
+	if (!(cc->proto.features & CMD_PROTO_F_PIPE))
+		cc->proto.caps &= ~CMD_CAP_BATCH;
+
+	return CMD_OK;
+}
 
 /************************************************************************//**
- * Module initialization. Call before using any other function.
+ * Negotiates the protocol again using the default link settings, after the
+ * negotiation failed. Stored link settings can stop working (e.g. with a
+ * different cable or cart), and the programmer must still be usable to
+ * tune them again.
+ *
+ * \return CMD_OK if the negotiation succeeded with the default settings.
+ *         CMD_ERROR if it failed, or stored settings were not in use.
+ ****************************************************************************/
+static int CmdLinkRecover(void) {
+	const ScLinkCfg safe = {SC_SPI_CLK, SC_USB_CHUNK, SC_LATENCY_MS};
+	CmdCtx *cc = CmdCtxGet();
+
+	if (!SCLinkStored(cc->spi)) return CMD_ERROR;
+	PrintErr("WARNING: Stored link settings failed, using the defaults. Run "
+			"--autotune to find new ones.\n");
+	// Start again from the original framing
+	if (SCLinkSet(cc->spi, &safe) || SCProtoSet(cc->spi, SC_MAX_DATALEN, 0) ||
+			SCDuplexSet(cc->spi, FALSE) || SCReadySet(cc->spi, FALSE))
+		return CMD_ERROR;
+	return CmdProtoNegotiate();
+}
+
+/************************************************************************//**
+ * Module initialization. Call before using any other function. Negotiates
+ * the protocol version with the programmer, falling back to the original
+ * framing if firmware does not support protocol v2, and queries the
+ * programmer capabilities. Transfer functions use the fastest modes
+ * supported by the programmer. If the negotiation fails with the link
+ * settings stored for the programmer, it is retried with the defaults.
  *
  * \param[in] channel Channel number of the FTX232H device to use for
  * 			  communications.
@@ -24,9 +180,136 @@ static struct mpsse_context *spi;
  * \return CMD_OK if the command completed successfully. CMD_ERROR otherwise.
  ****************************************************************************/
 int CmdInit(unsigned int channel) {
-	if (!(spi = SCInit(channel))) return CMD_ERROR;
+	return CmdInitSerial(channel, NULL);
+}
 
-	return CMD_OK;
+/************************************************************************//**
+ * Lists the USB serial numbers of the connected programmers.
+ *
+ * \param[out] serial Serial numbers of the found programmers.
+ * \param[in]  max    Maximum number of serial numbers to obtain.
+ *
+ * \return Number of programmers found, or CMD_ERROR.
+ ****************************************************************************/
+int CmdList(char serial[][SC_SERIAL_MAXLEN], int max) {
+	int count = SCList(serial, max);
+
+	return (count < 0)?CMD_ERROR:count;
+}
+
+/************************************************************************//**
+ * Initializes a command context for the programmer with the specified USB
+ * serial number, and binds it to the calling thread. Command functions
+ * called from the thread use this programmer. Several programmers can be
+ * used at once, each one from its own thread. See CmdInit().
+ *
+ * \param[in] channel Channel number of the FTX232H device to use for
+ * 			  communications.
+ * \param[in] serial  USB serial number of the programmer, or NULL to use
+ *            the first one found.
+ *
+ * \return CMD_OK if the command completed successfully. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdInitSerial(unsigned int channel, const char *serial) {
+	CmdCtx *cc;
+
+	if (!(cc = calloc(1, sizeof(CmdCtx)))) return CMD_ERROR;
+	if (!(cc->spi = SCInitSerial(channel, serial))) {
+		free(cc);
+		return CMD_ERROR;
+	}
+	g_private_set(&cmdCtxKey, cc);
+
+	if (CmdProtoNegotiate() && CmdLinkRecover()) return CMD_ERROR;
+	return CmdCapsQuery();
+}
+
+/************************************************************************//**
+ * Obtains the protocol negotiated with the programmer during CmdInit(),
+ * along with the programmer capabilities.
+ *
+ * \return The negotiated protocol.
+ ****************************************************************************/
+const CmdProto *CmdProtoGet(void) {
+	return &CmdCtxGet()->proto;
+}
+
+/************************************************************************//**
+ * Obtains the USB serial number of the programmer in use.
+ *
+ * \return The serial number string, empty if it could not be obtained.
+ ****************************************************************************/
+const char *CmdSerialGet(void) {
+	return SCSerialGet(CmdCtxGet()->spi);
+}
+
+/************************************************************************//**
+ * Obtains the link settings in use.
+ *
+ * \param[out] cfg Link settings in use.
+ ****************************************************************************/
+void CmdLinkGet(ScLinkCfg *cfg) {
+	SCLinkGet(CmdCtxGet()->spi, cfg);
+}
+
+/************************************************************************//**
+ * Applies the specified link settings.
+ *
+ * \param[in] cfg Link settings to apply.
+ *
+ * \return CMD_OK if settings were applied. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdLinkSet(const ScLinkCfg *cfg) {
+	return SCLinkSet(CmdCtxGet()->spi, cfg)?CMD_ERROR:CMD_OK;
+}
+
+/************************************************************************//**
+ * Obtains the number of payload chunks damaged in transit, and transferred
+ * again, since the programmer was opened. Only CRC protected chunks are
+ * counted, damage to unprotected ones cannot be detected.
+ *
+ * \return Number of damaged payload chunks.
+ ****************************************************************************/
+uint32_t CmdCrcErrorsGet(void) {
+	return CmdCtxGet()->crcErrors;
+}
+
+/************************************************************************//**
+ * Sets the number of USB transfers that can be in flight. Command functions
+ * keep blocking, but return as soon as their last transfer is submitted.
+ *
+ * \param[in] depth Number of transfers that can be in flight, from 1
+ *            (synchronous) to SC_QUEUE_MAX.
+ *
+ * \return CMD_OK if depth was applied. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdQueueSet(unsigned int depth) {
+	return SCQueueSet(CmdCtxGet()->spi, depth)?CMD_ERROR:CMD_OK;
+}
+
+/************************************************************************//**
+ * Sets the page length of the flash chip written next. Write chunks are
+ * aligned to page boundaries when possible, so the flash write buffer is
+ * filled by each chunk.
+ *
+ * \param[in] page Flash page length, 0 or 1 not to align write chunks.
+ ****************************************************************************/
+void CmdPageSet(uint16_t page) {
+	CmdCtxGet()->page = page;
+}
+
+/************************************************************************//**
+ * Closes the communications with the programmer used by the calling
+ * thread, waiting for transfers in flight to complete, and frees its
+ * command context. Does nothing if no programmer was opened.
+ ****************************************************************************/
+void CmdClose(void) {
+	CmdCtx *cc = CmdCtxGet();
+
+	if (!cc) return;
+	SCClose(cc->spi);
+	free(cc);
+	g_private_set(&cmdCtxKey, NULL);
 }
 
 /************************************************************************//**
@@ -41,12 +324,33 @@ int CmdInit(unsigned int channel) {
  * payloads. Use CmdSendLongCmd() or CmdSendLongRep() for long payloads.
  ****************************************************************************/
 int CmdSend(const Cmd *cmd, uint8_t cmdLen, CmdRep **rep) {
-	if (SCFrameSend(spi, (char*)cmd->data, cmdLen) != SC_OK)
+	CmdCtx *cc = CmdCtxGet();
+	uint64_t start = StatsStart();
+	int len;
+
+	SCRxDiscard(cc->spi);
+	if (SCFrameSend(cc->spi, (char*)cmd->data, cmdLen) != SC_OK)
 		return CMD_ERROR;
-	uint8_t maxLen = CMD_MAXLEN;
 
-	if (!(*rep = (CmdRep*)SCFrameRecv(spi, &maxLen))) return CMD_ERROR;
-	return maxLen;
+	if ((len = SCFrameRecv(cc->spi, (char*)cc->repBuf.data, CMD_MAXLEN)) < 0)
+		return CMD_ERROR;
+	CmdStatsEnd(cmd->command, start, 0);
+	*rep = &cc->repBuf;
+	return len;
+}
+
+/************************************************************************//**
+ * Receives the acknowledge of a CRC protected payload chunk.
+ *
+ * \return Acknowledge code (CMD_REP_OK or CMD_REP_CRC_ERROR), or CMD_ERROR
+ *         if reception failed.
+ ****************************************************************************/
+static int CmdAckRecv(void) {
+	CmdCtx *cc = CmdCtxGet();
+	CmdRep ack;
+
+	if (SCFrameRecv(cc->spi, (char*)ack.data, CMD_MAXLEN) < 1) return CMD_ERROR;
+	return ack.eRep.code;
 }
 
 /************************************************************************//**
@@ -59,29 +363,112 @@ int CmdSend(const Cmd *cmd, uint8_t cmdLen, CmdRep **rep) {
  * \param[out] rep Response to the sent command.
  *
  * \return CMD_OK if the command completed successfully. CMD_ERROR otherwise.
+ * \note If CRC protection was negotiated, each payload chunk is acknowledged
+ * by the programmer, and sent again if it arrived damaged.
  ****************************************************************************/
 int CmdSendLongCmd(const Cmd *cmd, uint8_t cmdLen, const uint8_t *data,
 				   int dataLen, CmdRep **rep) {
-	int sent;
-	int last;
+	CmdCtx *cc = CmdCtxGet();
+	int duplex = cc->proto.features & CMD_PROTO_F_DUPLEX;
+	int window = duplex?2:1;
+	int chunks = (dataLen + SC_BULK_MAXLEN - 1) / SC_BULK_MAXLEN;
+	int acked, next, sent, len, retry, code;
+	uint64_t start = StatsStart();
 
+	SCRxDiscard(cc->spi);
 	// Send command request
-	if (SC_OK != SCFrameSend(spi, (char*)cmd->data, cmdLen))
+	if (SC_OK != SCFrameSend(cc->spi, (char*)cmd->data, cmdLen))
 		return CMD_ERROR;
-	uint8_t maxLen = CMD_MAXLEN;
 
-	// Get command response
-	if (!(*rep = (CmdRep*)SCFrameRecv(spi, &maxLen))) return CMD_ERROR;
-	
-	// Send payload data
-	for (sent = 0; sent < dataLen; sent += last) {
-		last = MIN(dataLen - sent, CMD_MAXLEN);
-		if (SC_OK != SCFrameSend(spi, (char*)data + sent, last))
+	// Get command response. In duplex mode, it arrives while the first
+	// payload transfer goes out.
+	*rep = &cc->repBuf;
+	if (!duplex &&
+			(SCFrameRecv(cc->spi, (char*)cc->repBuf.data, CMD_MAXLEN) < 0))
+		return CMD_ERROR;
+
+	// Send payload data. SCPayloadSend() uses the bulk phase if available,
+	// or splits it in frames, sending as many as possible in each transfer.
+	if (!(cc->proto.features & CMD_PROTO_F_CRC)) {
+		if ((SC_OK != SCPayloadSend(cc->spi, (char*)data, dataLen)) ||
+				(duplex && (SCFrameRecv(cc->spi, (char*)cc->repBuf.data,
+				CMD_MAXLEN) < 0)))
 			return CMD_ERROR;
+		CmdStatsEnd(cmd->command, start, dataLen);
+		return CMD_OK;
 	}
+
+	// CRC protected chunks are acknowledged, and sent again if damaged. In
+	// duplex mode, a chunk is sent before the acknowledge of the previous
+	// one is read, so the acknowledge arrives while the chunk goes out.
+	for (acked = 0, next = 0, retry = 0; acked < chunks;) {
+		for (; (next < chunks) && (next - acked < window); next++) {
+			sent = next * SC_BULK_MAXLEN;
+			len = MIN(dataLen - sent, SC_BULK_MAXLEN);
+			if (SC_OK != SCChunkSend(cc->spi, (char*)data + sent, len, next))
+				return CMD_ERROR;
+		}
+		if (duplex && !acked && !retry &&
+				(SCFrameRecv(cc->spi, (char*)cc->repBuf.data, CMD_MAXLEN) < 0))
+			return CMD_ERROR;
+		if ((code = CmdAckRecv()) == CMD_REP_OK) {
+			acked++;
+			retry = 0;
+			continue;
+		}
+		if (code != CMD_REP_CRC_ERROR) return CMD_ERROR;
+		cc->crcErrors++;
+		if (++retry > CMD_CRC_RETRIES) return CMD_ERROR;
+		// Chunks sent after the damaged one are rejected by the programmer,
+		// skip their acknowledges and send again from the damaged one
+		for (; next - acked > 1; next--) {
+			if (CmdAckRecv() < 0) return CMD_ERROR;
+		}
+		next = acked;
+	}
+	if (duplex && !chunks &&
+			(SCFrameRecv(cc->spi, (char*)cc->repBuf.data, CMD_MAXLEN) < 0))
+		return CMD_ERROR;
+	CmdStatsEnd(cmd->command, start, dataLen);
 	return CMD_OK;
 }
 
+/************************************************************************//**
+ * Requests again a damaged chunk of a long reply, by sending the original
+ * read command with address and length restricted to the chunk.
+ *
+ * \param[in]  cmd Original read command.
+ * \param[in]  cmdLen Command length.
+ * \param[in]  offset Offset of the chunk from the start of the reply.
+ * \param[out] data Buffer where chunk data will be copied.
+ * \param[in]  len Chunk length.
+ *
+ * \return CMD_OK if the chunk was received. CMD_ERROR otherwise.
+ ****************************************************************************/
+static int CmdChunkReread(const Cmd *cmd, uint8_t cmdLen, uint32_t offset,
+		uint8_t *data, uint16_t len) {
+	CmdCtx *cc = CmdCtxGet();
+	Cmd chunkCmd = *cmd;
+	CmdRep chunkRep;
+	int retry, stat;
+
+	CMD_SET_ADDR(chunkCmd.rdWr.addr, CMD_GET_ADDR(cmd->rdWr.addr) + offset);
+	CMD_SET_LEN(chunkCmd.rdWr.len, len);
+	for (retry = 0; retry < CMD_CRC_RETRIES; retry++) {
+		SCRxDiscard(cc->spi);
+		if (SC_OK != SCFrameSend(cc->spi, (char*)chunkCmd.data, cmdLen))
+			return CMD_ERROR;
+		SCRecvExpect(cc->spi, len);
+		if ((SCFrameRecv(cc->spi, (char*)chunkRep.data, CMD_MAXLEN) < 0) ||
+				(chunkRep.eRep.code != CMD_REP_OK)) return CMD_ERROR;
+		stat = SCChunkRecv(cc->spi, (char*)data, len, 0);
+		if (SC_OK == stat) return CMD_OK;
+		if (SC_CRC_ERROR != stat) return CMD_ERROR;
+		cc->crcErrors++;
+	}
+	return CMD_ERROR;
+}
+
 /************************************************************************//**
  * Sends a command requiring a long response payload.
  *
@@ -92,30 +479,474 @@ int CmdSendLongCmd(const Cmd *cmd, uint8_t cmdLen, const uint8_t *data,
  * \param[in]  recvLen Length of payload to receive.
  *
  * \return Length of the received payload if OK, CMD_ERROR otherwise.
+ * \note If CRC protection was negotiated, damaged payload chunks are
+ * requested again on their own, using the same command with address and
+ * length restricted to the damaged chunk.
  ****************************************************************************/
 int CmdSendLongRep(const Cmd *cmd, uint8_t cmdLen, CmdRep **rep,
 				   uint8_t *data, int recvLen) {
-	char *tmp;
-	int recv;
-	uint8_t expected, last;
+	CmdCtx *cc = CmdCtxGet();
+	uint64_t start = StatsStart();
+	uint32_t damaged = 0;
+	int recv, len, stat;
+	uint8_t seq;
 
+	SCRxDiscard(cc->spi);
 	// Send command request
-	if (SC_OK != SCFrameSend(spi, (char*)cmd->data, cmdLen))
+	if (SC_OK != SCFrameSend(cc->spi, (char*)cmd->data, cmdLen))
 		return CMD_ERROR;
-	uint8_t maxCmdLen = CMD_MAXLEN;
 
+	// Announce the long payload, so it can be read along with the response
+	SCRecvExpect(cc->spi, recvLen);
 	// Get command response
-	if (!(*rep = (CmdRep*)SCFrameRecv(spi, &maxCmdLen))) return CMD_ERROR;
-
-	// Receive long data payload
-	for (recv = 0; recv < recvLen; recv += last) {
-		expected = last = MIN(recvLen - recv, CMD_MAXLEN);
-		if (!(tmp = SCFrameRecv(spi, &last))) return CMD_ERROR;
-		// Check we received requested data and copy to buffer.
-		if (expected != last) return CMD_ERROR;
-		memcpy(data + recv, tmp, last);
-		CmdRepFree(tmp);
-	}
-	return recv;
+	if (SCFrameRecv(cc->spi, (char*)cc->repBuf.data, CMD_MAXLEN) < 0)
+		return CMD_ERROR;
+	*rep = &cc->repBuf;
+
+	// Receive long data payload directly into the destination buffer. Most
+	// of it is already buffered.
+	if (!(cc->proto.features & CMD_PROTO_F_CRC)) {
+		if (SC_OK != SCPayloadRecv(cc->spi, (char*)data, recvLen))
+			return CMD_ERROR;
+		CmdStatsEnd(cmd->command, start, recvLen);
+		return recvLen;
+	}
+
+	// Receive all CRC protected chunks, and then request again the damaged
+	// ones. Command length field limits a reply to a few chunks.
+	for (recv = 0, seq = 0; recv < recvLen; recv += len, seq++) {
+		len = MIN(recvLen - recv, SC_BULK_MAXLEN);
+		stat = SCChunkRecv(cc->spi, (char*)data + recv, len, seq);
+		if (SC_CRC_ERROR == stat) {
+			damaged |= 1<<seq;
+			cc->crcErrors++;
+		} else if (SC_OK != stat) return CMD_ERROR;
+	}
+	for (recv = 0, seq = 0; damaged; recv += SC_BULK_MAXLEN, seq++) {
+		if (!(damaged & (1<<seq))) continue;
+		len = MIN(recvLen - recv, SC_BULK_MAXLEN);
+		if (CmdChunkReread(cmd, cmdLen, recv, data + recv, len) != CMD_OK)
+			return CMD_ERROR;
+		damaged &= ~(1<<seq);
+	}
+	CmdStatsEnd(cmd->command, start, recvLen);
+	return recvLen;
+}
+
+/************************************************************************//**
+ * Compresses the payload of a write command, if the programmer supports it
+ * and the compressed payload is shorter. The command code and length are
+ * updated accordingly.
+ *
+ * \param[inout] cmd Write command, with address and length set.
+ * \param[inout] data Payload to send. Points to the compressed payload on
+ *               return, if it was compressed.
+ * \param[inout] len Payload length, up to CMD_PIPE_CHUNK.
+ ****************************************************************************/
+static void CmdWritePack(Cmd *cmd, const uint8_t **data, uint16_t *len) {
+	CmdCtx *cc = CmdCtxGet();
+	int zLen;
+
+	if (!(cc->proto.caps & CMD_CAP_RLE) ||
+			((zLen = RleEncode(*data, *len, cc->rleBuf, *len - 1)) <= 0))
+		return;
+	cmd->rdWr.cmd |= CMD_F_RLE;
+	CMD_SET_LEN(cmd->rdWr.len, zLen);
+	*data = cc->rleBuf;
+	*len = zLen;
+}
+
+/// Pipelined request.
+typedef struct {
+	uint32_t off;		///< Offset of the chunk in the transfer
+	uint32_t skip;		///< Blank bytes skipped before the chunk
+	uint16_t len;		///< Chunk length
+	uint8_t tries;		///< Number of failed attempts
+	uint64_t start;		///< Time the request was sent, see StatsStart()
+} CmdPipeReq;
+
+/************************************************************************//**
+ * Obtains the next chunk of a transfer, up to CMD_PIPE_CHUNK bytes long.
+ * When writing erased flash, runs of at least blank 0xFF bytes are not
+ * written: they are skipped, and chunks end before them. Blank bytes at
+ * the end of the transfer are always skipped.
+ *
+ * With a page length, chunks are aligned to flash pages when possible, so
+ * the flash write buffer is always filled: chunks start and end at page
+ * boundaries, taking some of the blank bytes around them if needed.
+ *
+ * \param[in]    data  Data to write. Not used if blank is 0.
+ * \param[in]    addr  Address of the first byte of the transfer.
+ * \param[in]    len   Length of the transfer.
+ * \param[in]    blank Minimum length of the 0xFF runs skipped, 0 to split
+ *                     the transfer without skipping anything.
+ * \param[in]    page  Flash page length, 0 or 1 not to align chunks.
+ * \param[inout] pos   Transfer offset where the chunk search starts. Set
+ *                     to the end of the chunk on return.
+ * \param[out]   req   Chunk offset and length, and blank bytes skipped
+ *                     before it.
+ *
+ * \return TRUE if a chunk was obtained, FALSE if the rest of the transfer
+ *         was skipped.
+ ****************************************************************************/
+static int CmdChunkNext(const uint8_t *data, uint32_t addr, uint32_t len,
+		uint32_t blank, uint16_t page, uint32_t *pos, CmdPipeReq *req) {
+	uint32_t off = *pos, start, end, run = 0, tail = 0, align;
+
+	if (blank) {
+		for (end = off; (end < len) && (0xFF == data[end]); end++);
+		if ((end == len) || (end - off >= blank)) off = end;
+	}
+	if (off >= len) {
+		*pos = len;
+		return FALSE;
+	}
+	// Skipped bytes before the chunk are written up to the page start
+	start = off;
+	if (page > 1) off -= MIN((addr + off) % page, off - *pos);
+	for (end = start; (end < len) && (end - off < CMD_PIPE_CHUNK) &&
+			(!blank || (run < blank)); end++) {
+		run = (blank && (0xFF == data[end]))?run + 1:0;
+	}
+	// Blank bytes ending the chunk are not written, unless all are blank
+	if (run < end - start) {
+		end -= run;
+		tail = run;
+	}
+	// End the chunk at a page boundary, taking the blank bytes following
+	// it up to the boundary, or leaving the last page for the next chunk
+	if ((page > 1) && (end < len) && (align = (addr + end) % page)) {
+		if ((tail >= page - align) &&
+				(end - off + page - align <= CMD_PIPE_CHUNK)) {
+			end += page - align;
+		} else if (end > start + align) {
+			end -= align;
+		}
+	}
+	req->skip = off - *pos;
+	req->off = off;
+	req->len = end - off;
+	*pos = end;
+
+	return TRUE;
+}
+
+/************************************************************************//**
+ * Sends a pipelined read or write request, without waiting for its reply.
+ *
+ * \param[in] command Read or write command code.
+ * \param[in] addr Address of the chunk.
+ * \param[in] data Chunk data (for write requests).
+ * \param[in] len Chunk length.
+ * \param[in] write TRUE for write requests, FALSE for read requests.
+ *
+ * \return CMD_OK if the request was sent. CMD_ERROR otherwise.
+ ****************************************************************************/
+static int CmdPipeReqSend(uint8_t command, uint32_t addr, const uint8_t *data,
+		uint16_t len, int write) {
+	CmdCtx *cc = CmdCtxGet();
+	Cmd cmd;
+
+	cmd.rdWr.cmd = command;
+	CMD_SET_ADDR(cmd.rdWr.addr, addr);
+	CMD_SET_LEN(cmd.rdWr.len, len);
+	if (write) CmdWritePack(&cmd, &data, &len);
+	if (SC_OK != SCFrameSend(cc->spi, (char*)cmd.data, sizeof(CmdRdWrHdr)))
+		return CMD_ERROR;
+	if (write) return SCPayloadSend(cc->spi, (char*)data, len)?CMD_ERROR:CMD_OK;
+	// Read replies can be read along with the previous ones
+	SCRecvExpect(cc->spi, len);
+	return CMD_OK;
+}
+
+/************************************************************************//**
+ * Receives the reply to the oldest outstanding pipelined request, and the
+ * read data for read requests.
+ *
+ * \param[out] data Buffer for the chunk data (for read requests).
+ * \param[in]  len Chunk length.
+ * \param[in]  write TRUE for write requests, FALSE for read requests.
+ *
+ * \return Reply code (CMD_REP_CRC_ERROR if read data was damaged), or
+ *         CMD_ERROR if reception failed.
+ ****************************************************************************/
+static int CmdPipeRepRecv(uint8_t *data, uint16_t len, int write) {
+	CmdCtx *cc = CmdCtxGet();
+
+	if (SCFrameRecv(cc->spi, (char*)cc->repBuf.data, CMD_MAXLEN) < 1)
+		return CMD_ERROR;
+	if (write || (cc->repBuf.eRep.code != CMD_REP_OK))
+		return cc->repBuf.eRep.code;
+
+	switch (SCPayloadRecv(cc->spi, (char*)data, len)) {
+		case SC_OK: return CMD_REP_OK;
+		case SC_CRC_ERROR: return CMD_REP_CRC_ERROR;
+		default: return CMD_ERROR;
+	}
+}
+
+/************************************************************************//**
+ * Pipelined command engine. Keeps up to the negotiated window of read or
+ * write requests outstanding, and matches replies to requests in order.
+ * Chunks damaged in transit are requested again, after the outstanding
+ * ones.
+ *
+ * \param[in]    command Read or write command code.
+ * \param[in]    addr Address of the first byte.
+ * \param[inout] data Data to write, or buffer for the read data.
+ * \param[in]    len Length of the data.
+ * \param[in]    blank Minimum length of the 0xFF runs not written, see
+ *               CmdChunkNext(). Must be 0 for reads.
+ * \param[in]    write TRUE to write, FALSE to read.
+ * \param[in]    cb Function called each time a chunk completes, or NULL.
+ * \param[in]    ctx Context passed to cb.
+ *
+ * \return CMD_OK if all the chunks completed. CMD_ERROR otherwise.
+ ****************************************************************************/
+static int CmdPipe(uint8_t command, uint32_t addr, uint8_t *data,
+		uint32_t len, uint32_t blank, int write, CmdProgressCb cb,
+		void *ctx) {
+	CmdCtx *cc = CmdCtxGet();
+	CmdPipeReq out[CMD_PIPE_MAXWIN];
+	CmdPipeReq redo[CMD_PIPE_MAXWIN];
+	CmdPipeReq req;
+	uint32_t pos = 0;
+	uint32_t done = 0;
+	int head = 0, count = 0, nRedo = 0;
+	int window = cc->proto.window;
+	int code;
+
+	// In duplex mode, data clocked in while writing is buffered until the
+	// replies are read, so only two chunks fit in the receive buffer
+	if (write && (cc->proto.features & CMD_PROTO_F_DUPLEX))
+		window = MIN(window, 2);
+	SCRxDiscard(cc->spi);
+	while ((pos < len) || nRedo || count) {
+		// Fill the window, sending damaged chunks first
+		while ((count < window) && (nRedo || (pos < len))) {
+			if (nRedo) {
+				req = redo[--nRedo];
+			} else if (CmdChunkNext(data, addr, len, blank,
+						write?cc->page:0, &pos, &req)) {
+				req.tries = 0;
+			} else break;
+			req.start = StatsStart();
+			if (CmdPipeReqSend(command, addr + req.off, data + req.off,
+						req.len, write)) return CMD_ERROR;
+			out[(head + count++) % CMD_PIPE_MAXWIN] = req;
+		}
+		// Only blank bytes were left
+		if (!count) break;
+		// Replies arrive in request order
+		req = out[head];
+		head = (head + 1) % CMD_PIPE_MAXWIN;
+		count--;
+		code = CmdPipeRepRecv(data + req.off, req.len, write);
+		if (CMD_REP_OK == code) {
+			CmdStatsEnd(command, req.start, req.len);
+			done += req.skip + req.len;
+			if (cb) cb(done, ctx);
+		} else if ((CMD_REP_CRC_ERROR == code) &&
+				(++req.tries <= CMD_CRC_RETRIES)) {
+			cc->crcErrors++;
+			redo[nRedo++] = req;
+		} else {
+			return CMD_ERROR;
+		}
+	}
+	if (cb && (done < len)) cb(len, ctx);
+	return CMD_OK;
+}
+
+/************************************************************************//**
+ * Writes a memory range using commands with long payloads, split in chunks
+ * of up to CMD_PIPE_CHUNK bytes. If the programmer supports pipelining,
+ * up to the negotiated window of requests are kept outstanding, and
+ * replies are matched to requests in order. Otherwise, each chunk is sent
+ * using CmdSendLongCmd().
+ *
+ * \param[in]  command Write command code (e.g. CMD_CHR_WRITE).
+ * \param[in]  addr Address of the first byte to write.
+ * \param[in]  data Data to write.
+ * \param[in]  len Length of the data to write.
+ * \param[out] rep Reply to the last completed (or failed) request.
+ * \param[in]  cb Function called each time a chunk completes, NULL if not
+ *             needed.
+ * \param[in]  ctx Context passed to cb.
+ *
+ * \return CMD_OK if all the chunks were written. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdPipeWrite(uint8_t command, uint32_t addr, const uint8_t *data,
+		uint32_t len, CmdRep **rep, CmdProgressCb cb, void *ctx) {
+	return CmdPipeWriteSparse(command, addr, data, len, 0, rep, cb, ctx);
+}
+
+/************************************************************************//**
+ * Writes a memory range to erased flash, as CmdPipeWrite() does, but
+ * without writing runs of at least blank 0xFF bytes, that erased flash
+ * already holds. Each chunk is split in requests covering only the data
+ * around the skipped runs.
+ *
+ * \param[in]  command Write command code (e.g. CMD_CHR_WRITE).
+ * \param[in]  addr Address of the first byte to write.
+ * \param[in]  data Data to write.
+ * \param[in]  len Length of the data to write.
+ * \param[in]  blank Minimum length of the 0xFF runs not written. If 0, all
+ *             the data is written.
+ * \param[out] rep Reply to the last completed (or failed) request.
+ * \param[in]  cb Function called each time a chunk completes, NULL if not
+ *             needed. Skipped bytes are counted as transferred.
+ * \param[in]  ctx Context passed to cb.
+ *
+ * \return CMD_OK if all the chunks were written. CMD_ERROR otherwise.
+ *
+ * \warning Only use on flash known to be erased, skipped bytes keep their
+ *          previous contents.
+ ****************************************************************************/
+int CmdPipeWriteSparse(uint8_t command, uint32_t addr, const uint8_t *data,
+		uint32_t len, uint32_t blank, CmdRep **rep, CmdProgressCb cb,
+		void *ctx) {
+	CmdCtx *cc = CmdCtxGet();
+	Cmd cmd;
+	CmdPipeReq req;
+	uint32_t pos = 0, done = 0;
+	uint16_t sendLen;
+	const uint8_t *payload;
+
+	*rep = &cc->repBuf;
+	if (cc->proto.features & CMD_PROTO_F_PIPE)
+		return CmdPipe(command, addr, (uint8_t*)data, len, blank, TRUE, cb,
+				ctx);
+
+	while (CmdChunkNext(data, addr, len, blank, cc->page, &pos, &req)) {
+		cmd.rdWr.cmd = command;
+		CMD_SET_ADDR(cmd.rdWr.addr, addr + req.off);
+		CMD_SET_LEN(cmd.rdWr.len, req.len);
+		payload = data + req.off;
+		sendLen = req.len;
+		CmdWritePack(&cmd, &payload, &sendLen);
+		if ((CmdSendLongCmd(&cmd, sizeof(CmdRdWrHdr), payload, sendLen,
+						rep) != CMD_OK) || ((*rep)->command != CMD_REP_OK))
+			return CMD_ERROR;
+		done += req.skip + req.len;
+		if (cb) cb(done, ctx);
+	}
+	if (cb && (done < len)) cb(len, ctx);
+	return CMD_OK;
+}
+
+/************************************************************************//**
+ * Reads a memory range using commands with long replies, split in chunks
+ * of up to CMD_PIPE_CHUNK bytes. If the programmer supports pipelining,
+ * up to the negotiated window of requests are kept outstanding, and
+ * replies are matched to requests in order. Otherwise, each chunk is read
+ * using CmdSendLongRep().
+ *
+ * \param[in]  command Read command code (e.g. CMD_CHR_READ).
+ * \param[in]  addr Address of the first byte to read.
+ * \param[out] data Buffer for the read data.
+ * \param[in]  len Length of the data to read.
+ * \param[out] rep Reply to the last completed (or failed) request.
+ * \param[in]  cb Function called each time a chunk completes, NULL if not
+ *             needed.
+ * \param[in]  ctx Context passed to cb.
+ *
+ * \return CMD_OK if all the chunks were read. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdPipeRead(uint8_t command, uint32_t addr, uint8_t *data,
+		uint32_t len, CmdRep **rep, CmdProgressCb cb, void *ctx) {
+	CmdCtx *cc = CmdCtxGet();
+	Cmd cmd;
+	uint32_t done;
+	int chunkLen;
+
+	*rep = &cc->repBuf;
+	if (cc->proto.features & CMD_PROTO_F_PIPE)
+		return CmdPipe(command, addr, data, len, 0, FALSE, cb, ctx);
+
+	cmd.rdWr.cmd = command;
+	for (done = 0; done < len; done += chunkLen) {
+		chunkLen = MIN(len - done, CMD_PIPE_CHUNK);
+		CMD_SET_ADDR(cmd.rdWr.addr, addr + done);
+		CMD_SET_LEN(cmd.rdWr.len, chunkLen);
+		if ((CmdSendLongRep(&cmd, sizeof(CmdRdWrHdr), rep, data + done,
+						chunkLen) != chunkLen) ||
+				((*rep)->command != CMD_REP_OK)) return CMD_ERROR;
+		if (cb) cb(done + chunkLen, ctx);
+	}
+	return CMD_OK;
+}
+
+/************************************************************************//**
+ * Empties a command batch, so new commands can be queued.
+ *
+ * \param[out] batch Command batch to initialize.
+ ****************************************************************************/
+void CmdBatchInit(CmdBatch *batch) {
+	batch->count = 0;
+}
+
+/************************************************************************//**
+ * Queues a short command in a batch. Commands are not sent until
+ * CmdBatchRun() is called.
+ *
+ * \param[inout] batch Command batch.
+ * \param[in]    cmd Command to queue.
+ * \param[in]    cmdLen Command length.
+ *
+ * \return Index of the command (and its reply) in the batch, or CMD_ERROR
+ *         if the batch is full.
+ ****************************************************************************/
+int CmdBatchAdd(CmdBatch *batch, const Cmd *cmd, uint8_t cmdLen) {
+	if ((batch->count >= CMD_BATCH_MAX) || (cmdLen > CMD_MAXLEN))
+		return CMD_ERROR;
+	batch->cmd[batch->count] = *cmd;
+	batch->cmdLen[batch->count] = cmdLen;
+	return batch->count++;
+}
+
+/************************************************************************//**
+ * Sends the commands queued in a batch, and obtains their replies. If the
+ * programmer supports batched commands, up to the negotiated window of
+ * commands are sent in a single USB transfer, and their replies are read
+ * together. Otherwise, commands are sent one by one. Commands are processed
+ * in the order they were queued.
+ *
+ * \param[inout] batch Command batch to run.
+ * \param[out]   rep Array with the reply to each command, in queue order.
+ *               Reply codes must be checked by the caller.
+ *
+ * \return CMD_OK if all the replies were received. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdBatchRun(CmdBatch *batch, CmdRep **rep) {
+	CmdCtx *cc = CmdCtxGet();
+	ScFrame frame[CMD_BATCH_MAX];
+	unsigned int window, first, last, i;
+	uint64_t start;
+
+	*rep = batch->rep;
+	// Without batching, a command must be replied before sending the next
+	window = (cc->proto.caps & CMD_CAP_BATCH)?cc->proto.window:1;
+	for (i = 0; i < batch->count; i++) {
+		frame[i].data = (char*)batch->cmd[i].data;
+		frame[i].len = batch->cmdLen[i];
+	}
+
+	SCRxDiscard(cc->spi);
+	for (first = 0; first < batch->count; first = last) {
+		last = MIN(first + window, batch->count);
+		start = StatsStart();
+		if (SC_OK != SCFrameBatchSend(cc->spi, frame + first, last - first))
+			return CMD_ERROR;
+		// Each reply holds at least the reply code
+		SCFrameExpect(cc->spi, last - first, last - first);
+		for (i = first; i < last; i++) {
+			if ((batch->repLen[i] = SCFrameRecv(cc->spi,
+							(char*)batch->rep[i].data, CMD_MAXLEN)) < 1)
+				return CMD_ERROR;
+			CmdStatsEnd(batch->cmd[i].command, start, 0);
+		}
+	}
+	return CMD_OK;
 }
 
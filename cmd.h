@@ -6,6 +6,10 @@
  * \{
  * \brief Allows sending commands to the programmer, and receiving results.
  *
+ * Command functions use the programmer opened by the calling thread with
+ * CmdInit() or CmdInitSerial(). Several programmers can be driven at once,
+ * each one from its own thread.
+ *
  * \author Jesus Alonso (doragasu)
  * \date   2016
  ****************************************************************************/
@@ -13,6 +17,7 @@
 #define _CMD_H_
 
 #include <stdint.h>
+#include "spi-com.h"
 
 /** \addtogroup CmdRet
  *  \brief Return values for functions in this module and error codes.
@@ -42,9 +47,78 @@
 #define CMD_RAM_WRITE     9 ///< Write data to cartridge SRAM
 #define CMD_RAM_READ	 10 ///< Read data from cartridge SRAM
 #define CMD_MAPPER_SET	 11 ///< Configure cartridge mapper
+#define CMD_CAPS		 12 ///< Get programmer capabilities
+#define CMD_LOOP_WRITE	 13 ///< Write to the programmer loopback buffer
+#define CMD_LOOP_READ	 14 ///< Read from the programmer loopback buffer
+#define CMD_REP_CRC_ERROR 254 ///< Damaged payload chunk, send it again
 #define CMD_REP_ERROR	255	///< Error reply code
 /** \} */
 
+/// Flag for write command codes: payload is RLE compressed (see rle.h), and
+/// the length field holds the compressed length. Needs CMD_CAP_RLE.
+#define CMD_F_RLE		0x80
+
+/// Copies the specified address to a byte array field
+#define CMD_SET_ADDR(field, addr)	do{	\
+	(field)[0] = (addr)>>16;			\
+	(field)[1] = (addr)>>8;				\
+	(field)[2] = (addr);				\
+}while(0)
+
+/// Obtains the address from the specified byte array field
+#define CMD_GET_ADDR(field)	(((field)[0]<<16) | ((field)[1]<<8) | (field)[2])
+
+/// Copies the command length to the specified byte array field
+#define CMD_SET_LEN(field, len)	do{	\
+	(field)[0] = (len)>>8;			\
+	(field)[1] = (len);				\
+}while(0)
+
+/// Original protocol: 32-byte frames, 8-bit length
+#define CMD_PROTO_V1		1
+/// Protocol v2: long frames with 16-bit length
+#define CMD_PROTO_V2		2
+/// Protocol v2 feature flag: unframed bulk phase for long payloads
+#define CMD_PROTO_F_BULK	SC_PROTO_F_BULK
+/// Protocol v2 feature flag: sequence number and CRC on bulk chunks. Damaged
+/// chunks are transferred again on their own.
+#define CMD_PROTO_F_CRC		SC_PROTO_F_CRC
+/// Protocol v2 feature flag: programmer sends replies while receiving, and
+/// host reads them while sending (full duplex)
+#define CMD_PROTO_F_DUPLEX	SC_PROTO_F_DUPLEX
+/// Protocol v2 feature flag: programmer raises a ready line when a reply is
+/// available, so the host does not need to poll for it
+#define CMD_PROTO_F_READY	SC_PROTO_F_READY
+/// Protocol v2 feature flag: several requests can be sent before reading
+/// their replies. Write requests get a single reply, sent after the payload
+/// is processed.
+#define CMD_PROTO_F_PIPE	0x10
+/// Maximum number of outstanding pipelined requests
+#define CMD_PIPE_MAXWIN		16
+/// Payload length of each pipelined request
+#define CMD_PIPE_CHUNK		SC_BULK_MAXLEN
+/// Capability flag: short commands can be sent before reading the replies
+/// to the previous ones (see CmdBatchRun())
+#define CMD_CAP_BATCH		0x0001
+/// Capability flag: write commands accept RLE compressed payloads
+#define CMD_CAP_RLE			0x0002
+/// Capability flag: programmer has a loopback buffer, written and read with
+/// CMD_LOOP_WRITE and CMD_LOOP_READ, to test transfers without accessing
+/// the cart
+#define CMD_CAP_LOOP		0x0004
+/// Length of the programmer loopback buffer
+#define CMD_LOOP_LEN		CMD_PIPE_CHUNK
+/// Maximum number of commands in a batch
+#define CMD_BATCH_MAX		64
+/// Number of times a damaged chunk is transferred again before giving up
+#define CMD_CRC_RETRIES		3
+/// Minimum frame length accepted to use protocol v2
+#define CMD_PROTO_V2_MINFRAME	256
+
+/// Command context, holding the state of the communications with a
+/// programmer. Each thread has its own, see CmdInitSerial().
+typedef struct CmdCtx CmdCtx;
+
 /// Supported mappers.
 typedef enum {
 	CMD_MAPPER_MMC3X = 0,	///< MMC3X mapper
@@ -64,12 +138,20 @@ typedef struct {
 	uint8_t sectAddr[3];	///< Address to erase, Full chip if 0xFFFFFF
 } CmdErase;
 
+/// Firmware version request. Old firmware ignores the protocol fields.
+typedef struct {
+	uint8_t cmd;			///< Command code
+	uint8_t proto;			///< Highest protocol version supported by host
+	uint8_t features;		///< Protocol features supported by host
+} CmdFwVer;
+
 /// Generic command request.
 typedef union {
 	uint8_t data[CMD_MAXLEN];	///< Raw data (32 bytes max)
 	uint8_t command;			///< Command code
 	CmdRdWrHdr rdWr;			///< Read/write request
 	CmdErase erase;				///< Erase request
+	CmdFwVer fwVer;				///< Firmware version request
 } Cmd;
 
 /// Flash chip identification information.
@@ -88,8 +170,32 @@ typedef struct {
 	uint8_t code;			///< Response code (OK/ERROR)
 	uint8_t ver_major;		///< Major version number
 	uint8_t ver_minor;		///< Minor version number
+	/// Following fields are only sent by protocol v2 capable firmware
+	uint8_t proto;			///< Protocol version selected by firmware
+	uint8_t features;		///< Protocol features enabled (CMD_PROTO_F_*)
+	uint8_t maxFrame[2];	///< Maximum frame payload length (big endian)
+	uint8_t window;			///< Maximum number of outstanding requests
 } CmdRepFwVer;
 
+/// Capabilities command response, only sent by protocol v2 firmware.
+typedef struct {
+	uint8_t code;			///< Response code (OK/ERROR)
+	uint8_t caps[2];		///< Capability flags (CMD_CAP_*), big endian
+} CmdRepCaps;
+
+/// Protocol negotiated with the programmer.
+typedef struct {
+	uint8_t proto;			///< Protocol version in use
+	uint8_t features;		///< Protocol feature flags in use
+	uint16_t maxFrame;		///< Maximum frame payload length
+	uint8_t window;			///< Maximum number of outstanding requests
+	uint16_t caps;			///< Programmer capabilities (CMD_CAP_*)
+} CmdProto;
+
+/// Function called by CmdPipeWrite() and CmdPipeRead() each time a chunk
+/// completes, with the number of bytes completed so far.
+typedef void (*CmdProgressCb)(uint32_t done, void *ctx);
+
 /// Flash ID command response.
 typedef struct {
 	uint8_t code;			///< Command code
@@ -105,10 +211,16 @@ typedef union {
 	CmdRepEmpty eRep;		///< Empty command response
 	CmdRepFlashId fId;		///< Flash ID command response
 	CmdRepFwVer fwVer;		///< Firmware version command response
+	CmdRepCaps caps;		///< Capabilities command response
 } CmdRep;
 
 /************************************************************************//**
- * Module initialization. Call before using any other function.
+ * Module initialization. Call before using any other function. Negotiates
+ * the protocol version with the programmer, falling back to the original
+ * framing if firmware does not support protocol v2, and queries the
+ * programmer capabilities. Transfer functions use the fastest modes
+ * supported by the programmer. If the negotiation fails with the link
+ * settings stored for the programmer, it is retried with the defaults.
  *
  * \param[in] channel Channel number of the FTX232H device to use for
  * 			  communications.
@@ -117,12 +229,104 @@ typedef union {
  ****************************************************************************/
 int CmdInit(unsigned int channel);
 
+/************************************************************************//**
+ * Lists the USB serial numbers of the connected programmers.
+ *
+ * \param[out] serial Serial numbers of the found programmers.
+ * \param[in]  max    Maximum number of serial numbers to obtain.
+ *
+ * \return Number of programmers found, or CMD_ERROR.
+ ****************************************************************************/
+int CmdList(char serial[][SC_SERIAL_MAXLEN], int max);
+
+/************************************************************************//**
+ * Initializes a command context for the programmer with the specified USB
+ * serial number, and binds it to the calling thread. Command functions
+ * called from the thread use this programmer. Several programmers can be
+ * used at once, each one from its own thread. See CmdInit().
+ *
+ * \param[in] channel Channel number of the FTX232H device to use for
+ * 			  communications.
+ * \param[in] serial  USB serial number of the programmer, or NULL to use
+ *            the first one found.
+ *
+ * \return CMD_OK if the command completed successfully. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdInitSerial(unsigned int channel, const char *serial);
+
+/************************************************************************//**
+ * Obtains the protocol negotiated with the programmer during CmdInit(),
+ * along with the programmer capabilities.
+ *
+ * \return The negotiated protocol.
+ ****************************************************************************/
+const CmdProto *CmdProtoGet(void);
+
+/************************************************************************//**
+ * Obtains the USB serial number of the programmer in use.
+ *
+ * \return The serial number string, empty if it could not be obtained.
+ ****************************************************************************/
+const char *CmdSerialGet(void);
+
+/************************************************************************//**
+ * Obtains the link settings in use.
+ *
+ * \param[out] cfg Link settings in use.
+ ****************************************************************************/
+void CmdLinkGet(ScLinkCfg *cfg);
+
+/************************************************************************//**
+ * Applies the specified link settings.
+ *
+ * \param[in] cfg Link settings to apply.
+ *
+ * \return CMD_OK if settings were applied. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdLinkSet(const ScLinkCfg *cfg);
+
+/************************************************************************//**
+ * Obtains the number of payload chunks damaged in transit, and transferred
+ * again, since the programmer was opened. Only CRC protected chunks are
+ * counted, damage to unprotected ones cannot be detected.
+ *
+ * \return Number of damaged payload chunks.
+ ****************************************************************************/
+uint32_t CmdCrcErrorsGet(void);
+
+/************************************************************************//**
+ * Sets the number of USB transfers that can be in flight. Command functions
+ * keep blocking, but return as soon as their last transfer is submitted.
+ *
+ * \param[in] depth Number of transfers that can be in flight, from 1
+ *            (synchronous) to SC_QUEUE_MAX.
+ *
+ * \return CMD_OK if depth was applied. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdQueueSet(unsigned int depth);
+
+/************************************************************************//**
+ * Sets the page length of the flash chip written next. Write chunks are
+ * aligned to page boundaries when possible, so the flash write buffer is
+ * filled by each chunk.
+ *
+ * \param[in] page Flash page length, 0 or 1 not to align write chunks.
+ ****************************************************************************/
+void CmdPageSet(uint16_t page);
+
+/************************************************************************//**
+ * Closes the communications with the programmer used by the calling
+ * thread, waiting for transfers in flight to complete, and frees its
+ * command context. Does nothing if no programmer was opened.
+ ****************************************************************************/
+void CmdClose(void);
+
 /************************************************************************//**
  * Sends a command, and obtains the command response.
  *
  * \param[in]  cmd Command to send.
  * \param[in]  cmdLen Command length.
- * \param[out] rep Response to the sent command.
+ * \param[out] rep Response to the sent command. Valid until next command.
  *
  * \return CMD_OK if the command completed successfully. CMD_ERROR otherwise.
  * \note This function does not allow sending or receiving commands with long
@@ -158,10 +362,124 @@ int CmdSendLongCmd(const Cmd *cmd, uint8_t cmdLen, const uint8_t *data,
 int CmdSendLongRep(const Cmd *cmd, uint8_t cmdLen, CmdRep **rep,
 				   uint8_t *data, int recvLen);
 
-/// It looks like libmpsse does NOT free returned responses (it is at least
-/// NOT documented), so we must free the memory on our own. As this can change
-/// in the future, we must be extra careful with this "feature".
-#define CmdRepFree(pRep)	free(pRep)
+/************************************************************************//**
+ * Writes a memory range using commands with long payloads, split in chunks
+ * of up to CMD_PIPE_CHUNK bytes. If the programmer supports pipelining,
+ * up to the negotiated window of requests are kept outstanding, and
+ * replies are matched to requests in order. Otherwise, each chunk is sent
+ * using CmdSendLongCmd(). If the programmer supports it, chunks are RLE
+ * compressed when that makes them shorter.
+ *
+ * \param[in]  command Write command code (e.g. CMD_CHR_WRITE).
+ * \param[in]  addr Address of the first byte to write.
+ * \param[in]  data Data to write.
+ * \param[in]  len Length of the data to write.
+ * \param[out] rep Reply to the last completed (or failed) request.
+ * \param[in]  cb Function called each time a chunk completes, NULL if not
+ *             needed.
+ * \param[in]  ctx Context passed to cb.
+ *
+ * \return CMD_OK if all the chunks were written. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdPipeWrite(uint8_t command, uint32_t addr, const uint8_t *data,
+		uint32_t len, CmdRep **rep, CmdProgressCb cb, void *ctx);
+
+/************************************************************************//**
+ * Writes a memory range to erased flash, as CmdPipeWrite() does, but
+ * without writing runs of at least blank 0xFF bytes, that erased flash
+ * already holds. Each chunk is split in requests covering only the data
+ * around the skipped runs.
+ *
+ * \param[in]  command Write command code (e.g. CMD_CHR_WRITE).
+ * \param[in]  addr Address of the first byte to write.
+ * \param[in]  data Data to write.
+ * \param[in]  len Length of the data to write.
+ * \param[in]  blank Minimum length of the 0xFF runs not written. If 0, all
+ *             the data is written.
+ * \param[out] rep Reply to the last completed (or failed) request.
+ * \param[in]  cb Function called each time a chunk completes, NULL if not
+ *             needed. Skipped bytes are counted as transferred.
+ * \param[in]  ctx Context passed to cb.
+ *
+ * \return CMD_OK if all the chunks were written. CMD_ERROR otherwise.
+ *
+ * \warning Only use on flash known to be erased, skipped bytes keep their
+ *          previous contents.
+ ****************************************************************************/
+int CmdPipeWriteSparse(uint8_t command, uint32_t addr, const uint8_t *data,
+		uint32_t len, uint32_t blank, CmdRep **rep, CmdProgressCb cb,
+		void *ctx);
+
+/************************************************************************//**
+ * Reads a memory range using commands with long replies, split in chunks
+ * of up to CMD_PIPE_CHUNK bytes. If the programmer supports pipelining,
+ * up to the negotiated window of requests are kept outstanding, and
+ * replies are matched to requests in order. Otherwise, each chunk is read
+ * using CmdSendLongRep().
+ *
+ * \param[in]  command Read command code (e.g. CMD_CHR_READ).
+ * \param[in]  addr Address of the first byte to read.
+ * \param[out] data Buffer for the read data.
+ * \param[in]  len Length of the data to read.
+ * \param[out] rep Reply to the last completed (or failed) request.
+ * \param[in]  cb Function called each time a chunk completes, NULL if not
+ *             needed.
+ * \param[in]  ctx Context passed to cb.
+ *
+ * \return CMD_OK if all the chunks were read. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdPipeRead(uint8_t command, uint32_t addr, uint8_t *data,
+		uint32_t len, CmdRep **rep, CmdProgressCb cb, void *ctx);
+
+/// Batch of short commands, sent using as few transport transactions as
+/// possible. See CmdBatchRun().
+typedef struct {
+	Cmd cmd[CMD_BATCH_MAX];			///< Queued commands
+	uint8_t cmdLen[CMD_BATCH_MAX];	///< Length of each queued command
+	CmdRep rep[CMD_BATCH_MAX];		///< Reply to each command
+	int repLen[CMD_BATCH_MAX];		///< Length of each reply
+	unsigned int count;				///< Number of queued commands
+} CmdBatch;
+
+/************************************************************************//**
+ * Empties a command batch, so new commands can be queued.
+ *
+ * \param[out] batch Command batch to initialize.
+ ****************************************************************************/
+void CmdBatchInit(CmdBatch *batch);
+
+/************************************************************************//**
+ * Queues a short command in a batch. Commands are not sent until
+ * CmdBatchRun() is called.
+ *
+ * \param[inout] batch Command batch.
+ * \param[in]    cmd Command to queue.
+ * \param[in]    cmdLen Command length.
+ *
+ * \return Index of the command (and its reply) in the batch, or CMD_ERROR
+ *         if the batch is full.
+ ****************************************************************************/
+int CmdBatchAdd(CmdBatch *batch, const Cmd *cmd, uint8_t cmdLen);
+
+/************************************************************************//**
+ * Sends the commands queued in a batch, and obtains their replies. If the
+ * programmer supports batched commands, up to the negotiated window of
+ * commands are sent in a single USB transfer, and their replies are read
+ * together. Otherwise, commands are sent one by one. Commands are processed
+ * in the order they were queued.
+ *
+ * \param[inout] batch Command batch to run.
+ * \param[out]   rep Array with the reply to each command, in queue order.
+ *               Reply codes must be checked by the caller.
+ *
+ * \return CMD_OK if all the replies were received. CMD_ERROR otherwise.
+ ****************************************************************************/
+int CmdBatchRun(CmdBatch *batch, CmdRep **rep);
+
+/// Command replies are stored in a buffer owned by this module, that is
+/// valid until the next command is sent. Replies were allocated by libmpsse
+/// in the past, so callers still release them, but there is nothing to free.
+#define CmdRepFree(pRep)	((void)(pRep))
 
 #endif /*_CMD_H_*/
 
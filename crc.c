@@ -0,0 +1,56 @@
+/************************************************************************//**
+ * \file
+ * \brief CRC computation for link error detection.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "crc.h"
+
+/// CRC-16/CCITT polynomial
+#define CRC16_POLY		0x1021
+
+/// Lookup table with the CRC of each byte value, built on first use
+static uint16_t crcTab[256];
+/// Set to TRUE once crcTab has been built
+static int crcTabReady;
+
+/************************************************************************//**
+ * Builds the CRC lookup table.
+ ****************************************************************************/
+static void Crc16TabBuild(void) {
+	unsigned int i, j;
+	uint16_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i<<8;
+		for (j = 0; j < 8; j++) {
+			crc = (crc & 0x8000)?((crc<<1) ^ CRC16_POLY):(crc<<1);
+		}
+		crcTab[i] = crc;
+	}
+	crcTabReady = 1;
+}
+
+/************************************************************************//**
+ * Updates a CRC-16 with the specified data. To compute the CRC of several
+ * buffers, call this function for each of them, passing the value returned
+ * by the previous call. The first call must use CRC16_INIT.
+ *
+ * \param[in] crc  CRC value computed for the previous data.
+ * \param[in] data Data to add to the CRC computation.
+ * \param[in] len  Length of the data.
+ *
+ * \return The updated CRC value.
+ ****************************************************************************/
+uint16_t Crc16(uint16_t crc, const uint8_t *data, uint32_t len) {
+	uint32_t i;
+
+	if (!crcTabReady) Crc16TabBuild();
+	for (i = 0; i < len; i++) {
+		crc = (crc<<8) ^ crcTab[(crc>>8) ^ data[i]];
+	}
+
+	return crc;
+}
+
@@ -0,0 +1,39 @@
+/************************************************************************//**
+ * \file
+ * \brief CRC computation for link error detection.
+ *
+ * \defgroup crc crc
+ * \{
+ * \brief CRC computation for link error detection.
+ *
+ * Implements CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF,
+ * no reflection, no final XOR), cheap to compute on the programmer MCU.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stdint.h>
+
+/// Initial value for CRC-16 computation
+#define CRC16_INIT		0xFFFF
+
+/************************************************************************//**
+ * Updates a CRC-16 with the specified data. To compute the CRC of several
+ * buffers, call this function for each of them, passing the value returned
+ * by the previous call. The first call must use CRC16_INIT.
+ *
+ * \param[in] crc  CRC value computed for the previous data.
+ * \param[in] data Data to add to the CRC computation.
+ * \param[in] len  Length of the data.
+ *
+ * \return The updated CRC value.
+ ****************************************************************************/
+uint16_t Crc16(uint16_t crc, const uint8_t *data, uint32_t len);
+
+#endif /*_CRC_H_*/
+
+/** \} */
+
@@ -0,0 +1,250 @@
+/************************************************************************//**
+ * \file
+ * \brief Flash chip database, with the geometry and timing of each chip.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "flashdb.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+/// Built-in chips. Times are the typical ones from the datasheets.
+static const FlashChip flashDbChip[] = {
+	{"S29GL032N", 0x01, {0x7E, 0x1D, 0x00}, 3, {{64, 0x10000}},
+		32, 240, 500, 32000},
+	{"S29GL032N bottom", 0x01, {0x7E, 0x1A, 0x00}, 3,
+		{{8, 0x2000}, {63, 0x10000}}, 32, 240, 500, 32000},
+	{"S29GL032N top", 0x01, {0x7E, 0x1A, 0x01}, 3,
+		{{63, 0x10000}, {8, 0x2000}}, 32, 240, 500, 32000},
+	{"S29GL064N", 0x01, {0x7E, 0x0C, 0x01}, 3, {{128, 0x10000}},
+		32, 240, 500, 64000},
+	{"S29GL064N bottom", 0x01, {0x7E, 0x10, 0x00}, 3,
+		{{8, 0x2000}, {127, 0x10000}}, 32, 240, 500, 64000},
+	{"S29GL064N top", 0x01, {0x7E, 0x10, 0x01}, 3,
+		{{127, 0x10000}, {8, 0x2000}}, 32, 240, 500, 64000},
+	{"S29GL128P", 0x01, {0x7E, 0x21, 0x01}, 3, {{128, 0x20000}},
+		64, 480, 500, 64000},
+	{"S29GL256P", 0x01, {0x7E, 0x22, 0x01}, 3, {{256, 0x20000}},
+		64, 480, 500, 128000},
+	{"Am29F040B", 0x01, {0xA4}, 1, {{8, 0x10000}}, 1, 7, 1000, 8000},
+	{"SST39SF010A", 0xBF, {0xB5}, 1, {{32, 0x1000}}, 1, 14, 18, 70},
+	{"SST39SF020A", 0xBF, {0xB6}, 1, {{64, 0x1000}}, 1, 14, 18, 70},
+	{"SST39SF040", 0xBF, {0xB7}, 1, {{128, 0x1000}}, 1, 14, 18, 70}
+};
+
+/// Number of built-in chips
+#define FLASHDB_CHIPS	(sizeof(flashDbChip) / sizeof(FlashChip))
+
+/// Chips loaded from the configuration file
+static FlashChip flashDbUser[FLASHDB_USER_MAX];
+/// Number of chips loaded from the configuration file
+static unsigned int flashDbUsers;
+
+/************************************************************************//**
+ * Parses the IDs of a chip, as colon separated hexadecimal bytes: the
+ * manufacturer ID, followed by one to three device ID bytes.
+ *
+ * \param[in]  str  String to parse.
+ * \param[out] chip Chip to which the IDs are set.
+ *
+ * \return 0 on success, -1 if the string is not valid.
+ ****************************************************************************/
+static int FlashDbIdParse(const char *str, FlashChip *chip) {
+	unsigned long val[4];
+	char *end;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		val[i] = strtoul(str, &end, 16);
+		if ((end == str) || (val[i] > 0xFF)) return -1;
+		if (!*end) break;
+		if (*end != ':') return -1;
+		str = end + 1;
+	}
+	if (!i || (i == 4)) return -1;
+	chip->manId = val[0];
+	for (chip->devIdLen = 0; chip->devIdLen < i; chip->devIdLen++)
+		chip->devId[chip->devIdLen] = val[chip->devIdLen + 1];
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Parses the sector regions of a chip, as a comma separated list of
+ * <count>x<length> items, from the lowest address.
+ *
+ * \param[in]  str  String to parse.
+ * \param[out] chip Chip to which the regions are set.
+ *
+ * \return 0 on success, -1 if the string is not valid.
+ ****************************************************************************/
+static int FlashDbSectParse(const char *str, FlashChip *chip) {
+	FlashRegion *r;
+	char *end;
+	int i;
+
+	for (i = 0; i < FLASHDB_REGION_MAX; i++) {
+		r = chip->region + i;
+		r->count = strtoul(str, &end, 0);
+		if ((end == str) || (*end != 'x') || !r->count) return -1;
+		str = end + 1;
+		r->len = strtoul(str, &end, 0);
+		if ((end == str) || !r->len) return -1;
+		if (!*end) return 0;
+		if (*end != ',') return -1;
+		str = end + 1;
+	}
+
+	return -1;
+}
+
+/************************************************************************//**
+ * Loads the chips defined in a configuration file. Chips loaded replace
+ * the built-in ones with the same IDs.
+ *
+ * \param[in] file Configuration file.
+ *
+ * \return Number of chips loaded, or -1 if a chip definition is invalid.
+ ****************************************************************************/
+int FlashDbLoad(const char *file) {
+	GKeyFile *gkf = g_key_file_new();
+	gchar **group = NULL;
+	gchar *id = NULL, *sect = NULL;
+	FlashChip *chip;
+	int i, err = FALSE, ret = 0;
+
+	if (g_key_file_load_from_file(gkf, file, G_KEY_FILE_NONE, NULL))
+		group = g_key_file_get_groups(gkf, NULL);
+	for (i = 0; group && group[i] && (flashDbUsers < FLASHDB_USER_MAX);
+			i++) {
+		if (strncmp(group[i], FLASHDB_GROUP, sizeof(FLASHDB_GROUP) - 1))
+			continue;
+		chip = flashDbUser + flashDbUsers;
+		memset(chip, 0, sizeof(FlashChip));
+		strncpy(chip->name, group[i] + sizeof(FLASHDB_GROUP) - 1,
+				FLASHDB_NAME_MAX - 1);
+		id = g_key_file_get_string(gkf, group[i], "id", NULL);
+		sect = g_key_file_get_string(gkf, group[i], "sectors", NULL);
+		if (!id || !sect || FlashDbIdParse(id, chip) ||
+				FlashDbSectParse(sect, chip)) {
+			printf("WARNING: Invalid flash chip definition in %s: [%s]\n",
+					file, group[i]);
+			err = TRUE;
+		}
+		g_free(id);
+		g_free(sect);
+		if (err) break;
+		chip->page = MAX(g_key_file_get_integer(gkf, group[i], "page",
+					NULL), 1);
+		chip->pageUs = g_key_file_get_integer(gkf, group[i], "page_us",
+				NULL);
+		chip->sectMs = g_key_file_get_integer(gkf, group[i], "sect_ms",
+				NULL);
+		chip->chipMs = g_key_file_get_integer(gkf, group[i], "chip_ms",
+				NULL);
+		flashDbUsers++;
+		ret++;
+	}
+	g_strfreev(group);
+	g_key_file_free(gkf);
+
+	return err?-1:ret;
+}
+
+/************************************************************************//**
+ * Checks if a chip has the specified IDs.
+ *
+ * \param[in] chip Chip to check.
+ * \param[in] id   Manufacturer and device IDs.
+ *
+ * \return TRUE if the IDs match, FALSE otherwise.
+ ****************************************************************************/
+static int FlashDbMatch(const FlashChip *chip, const CmdFlashId *id) {
+	return (chip->manId == id->manId) &&
+		!memcmp(chip->devId, id->devId, chip->devIdLen);
+}
+
+/************************************************************************//**
+ * Searches the chip with the specified IDs.
+ *
+ * \param[in] id Manufacturer and device IDs, as returned by the flash ID
+ *            command.
+ *
+ * \return The chip found, or NULL if the chip is unknown.
+ ****************************************************************************/
+const FlashChip *FlashDbFind(const CmdFlashId *id) {
+	unsigned int i;
+
+	for (i = 0; i < flashDbUsers; i++)
+		if (FlashDbMatch(flashDbUser + i, id)) return flashDbUser + i;
+	for (i = 0; i < FLASHDB_CHIPS; i++)
+		if (FlashDbMatch(flashDbChip + i, id)) return flashDbChip + i;
+
+	return NULL;
+}
+
+/************************************************************************//**
+ * Obtains the capacity of a chip.
+ *
+ * \param[in] chip Flash chip.
+ *
+ * \return Chip capacity in bytes.
+ ****************************************************************************/
+uint32_t FlashDbLen(const FlashChip *chip) {
+	uint32_t len = 0;
+	int i;
+
+	for (i = 0; (i < FLASHDB_REGION_MAX) && chip->region[i].count; i++)
+		len += chip->region[i].count * chip->region[i].len;
+
+	return len;
+}
+
+/************************************************************************//**
+ * Obtains the sector holding an address.
+ *
+ * \param[in]  chip  Flash chip, or NULL for an unknown one.
+ * \param[in]  addr  Address in the chip.
+ * \param[out] start Address of the first byte of the sector.
+ *
+ * \return Length of the sector, or 0 if the chip is unknown or the address
+ *         is past the end of the chip.
+ ****************************************************************************/
+uint32_t FlashDbSect(const FlashChip *chip, uint32_t addr, uint32_t *start) {
+	const FlashRegion *r;
+	uint32_t base = 0;
+	int i;
+
+	// Sectors of unknown chips are never guessed
+	if (!chip) return 0;
+	for (i = 0; (i < FLASHDB_REGION_MAX) && chip->region[i].count; i++) {
+		r = chip->region + i;
+		if (addr < base + r->count * r->len) {
+			*start = base + (addr - base) / r->len * r->len;
+			return r->len;
+		}
+		base += r->count * r->len;
+	}
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Estimates the time taken to program data to a chip, not including the
+ * time taken to send it to the programmer.
+ *
+ * \param[in] chip Flash chip, or NULL for an unknown one.
+ * \param[in] len  Length of the data.
+ *
+ * \return Estimated time in milliseconds, 0 if the chip is unknown.
+ ****************************************************************************/
+uint32_t FlashDbProgMs(const FlashChip *chip, uint32_t len) {
+	if (!chip) return 0;
+	return ((uint64_t)(len + chip->page - 1) / chip->page * chip->pageUs +
+			999) / 1000;
+}
+
@@ -0,0 +1,118 @@
+/************************************************************************//**
+ * \file
+ * \brief Flash chip database, with the geometry and timing of each chip.
+ *
+ * \defgroup flashdb flashdb
+ * \{
+ * \brief Flash chip database, with the geometry and timing of each chip.
+ *
+ * Chips are identified by the manufacturer and device IDs returned by the
+ * flash ID command. Each chip entry holds its sector layout, described as
+ * CFI erase block regions (consecutive groups of sectors of the same
+ * length, from the lowest address), its program page (write buffer)
+ * length, and its typical program and erase times.
+ *
+ * The built-in chips can be extended (or overridden) in the configuration
+ * file, with a "CHIP <name>" group for each chip:
+ *
+ *     [CHIP S29GL032N bottom boot]
+ *     id = 01:7E:1A:00
+ *     sectors = 8x8192,63x65536
+ *     page = 32
+ *     page_us = 240
+ *     sect_ms = 500
+ *     chip_ms = 32000
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _FLASHDB_H_
+#define _FLASHDB_H_
+
+#include <stdint.h>
+#include "cmd.h"
+
+/// Maximum number of sector regions of a chip
+#define FLASHDB_REGION_MAX	4
+/// Maximum length of chip names, including the terminator
+#define FLASHDB_NAME_MAX	24
+/// Maximum number of chips loaded from the configuration file
+#define FLASHDB_USER_MAX	16
+/// Prefix of the configuration file groups defining chips
+#define FLASHDB_GROUP		"CHIP "
+
+/// Group of consecutive sectors of the same length.
+typedef struct {
+	uint16_t count;			///< Number of sectors, 0 ends the region list
+	uint32_t len;			///< Length of each sector
+} FlashRegion;
+
+/// Flash chip geometry and timing.
+typedef struct {
+	char name[FLASHDB_NAME_MAX];	///< Chip name
+	uint8_t manId;			///< Manufacturer ID
+	uint8_t devId[3];		///< Device ID
+	uint8_t devIdLen;		///< Number of device ID bytes to compare
+	/// Sector regions, from the lowest address
+	FlashRegion region[FLASHDB_REGION_MAX];
+	uint16_t page;			///< Program page (write buffer) length
+	uint32_t pageUs;		///< Typical page program time, microseconds
+	uint32_t sectMs;		///< Typical erase time of the largest sector, ms
+	uint32_t chipMs;		///< Typical chip erase time, milliseconds
+} FlashChip;
+
+/************************************************************************//**
+ * Loads the chips defined in a configuration file. Chips loaded replace
+ * the built-in ones with the same IDs.
+ *
+ * \param[in] file Configuration file.
+ *
+ * \return Number of chips loaded, or -1 if a chip definition is invalid.
+ ****************************************************************************/
+int FlashDbLoad(const char *file);
+
+/************************************************************************//**
+ * Searches the chip with the specified IDs.
+ *
+ * \param[in] id Manufacturer and device IDs, as returned by the flash ID
+ *            command.
+ *
+ * \return The chip found, or NULL if the chip is unknown.
+ ****************************************************************************/
+const FlashChip *FlashDbFind(const CmdFlashId *id);
+
+/************************************************************************//**
+ * Obtains the capacity of a chip.
+ *
+ * \param[in] chip Flash chip.
+ *
+ * \return Chip capacity in bytes.
+ ****************************************************************************/
+uint32_t FlashDbLen(const FlashChip *chip);
+
+/************************************************************************//**
+ * Obtains the sector holding an address.
+ *
+ * \param[in]  chip  Flash chip, or NULL for an unknown one.
+ * \param[in]  addr  Address in the chip.
+ * \param[out] start Address of the first byte of the sector.
+ *
+ * \return Length of the sector, or 0 if the chip is unknown or the address
+ *         is past the end of the chip.
+ ****************************************************************************/
+uint32_t FlashDbSect(const FlashChip *chip, uint32_t addr, uint32_t *start);
+
+/************************************************************************//**
+ * Estimates the time taken to program data to a chip, not including the
+ * time taken to send it to the programmer.
+ *
+ * \param[in] chip Flash chip, or NULL for an unknown one.
+ * \param[in] len  Length of the data.
+ *
+ * \return Estimated time in milliseconds, 0 if the chip is unknown.
+ ****************************************************************************/
+uint32_t FlashDbProgMs(const FlashChip *chip, uint32_t len);
+
+#endif /*_FLASHDB_H_*/
+
+/** \} */
@@ -0,0 +1,340 @@
+/************************************************************************//**
+ * \file
+ * \brief Flight recorder, keeping the last transfers with the programmers.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "flightrec.h"
+#include "sc-trace.h"
+#include "cmd.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib.h>
+
+/// Maximum length of a dump file line
+#define FLIGHTREC_LINE		160
+
+/// Flight recorder record.
+typedef struct {
+	/// Position of the record plus one, set when the record is complete
+	volatile gint seq;
+	uint64_t time;		///< Timestamp, in nanoseconds
+	int32_t ret;		///< Call result
+	uint32_t arg;		///< Call argument
+	uint32_t len;		///< Length of the data transferred
+	uint8_t type;		///< Record type (SC_TRACE_* or FLIGHTREC_*)
+	uint8_t port;		///< Identifier of the programmer
+	uint8_t data[FLIGHTREC_DATA];	///< First bytes of the data
+} FlightRecEntry;
+
+/// Record ring
+static FlightRecEntry flightRec[FLIGHTREC_LEN];
+/// Number of records added, the next one goes to this position
+static volatile gint flightRecPos;
+/// Number of dumps started
+static volatile gint flightRecDumps;
+#ifndef __OS_WIN
+/// File written from signal handlers
+static gchar *flightRecSigPath;
+#endif
+
+/// Names of the record types, indexed by type
+static const char *const flightRecName[] = {
+	[SC_TRACE_FRAME_SEND] = "frame send",
+	[SC_TRACE_FRAME_RECV] = "frame recv",
+	[SC_TRACE_BATCH_SEND] = "batch send",
+	[SC_TRACE_CHUNK_SEND] = "chunk send",
+	[SC_TRACE_CHUNK_RECV] = "chunk recv",
+	[SC_TRACE_PAYLOAD_SEND] = "payload send",
+	[SC_TRACE_PAYLOAD_RECV] = "payload recv",
+	[FLIGHTREC_OPEN] = "open",
+	[FLIGHTREC_CLOSE] = "close"
+};
+
+/************************************************************************//**
+ * Adds a record to the ring, overwriting the oldest one.
+ *
+ * \param[in] type Record type (SC_TRACE_* or FLIGHTREC_*).
+ * \param[in] port Identifier of the programmer.
+ * \param[in] ret  Call result.
+ * \param[in] arg  Call argument.
+ * \param[in] data Data transferred by the call, NULL if not available.
+ * \param[in] len  Length of the data. Only the first FLIGHTREC_DATA bytes
+ *            are kept.
+ ****************************************************************************/
+void FlightRecAdd(uint8_t type, uint8_t port, int32_t ret, uint32_t arg,
+		const void *data, uint32_t len) {
+	guint pos = g_atomic_int_add(&flightRecPos, 1);
+	FlightRecEntry *e = flightRec + (pos & (FLIGHTREC_LEN - 1));
+
+	// Mark the record as incomplete while it is written
+	g_atomic_int_set(&e->seq, 0);
+	e->time = SCTraceNow();
+	e->ret = ret;
+	e->arg = arg;
+	e->len = len;
+	e->type = type;
+	e->port = port;
+	if (data) memcpy(e->data, data, MIN(len, FLIGHTREC_DATA));
+	else e->len = 0;
+	g_atomic_int_set(&e->seq, pos + 1);
+}
+
+/************************************************************************//**
+ * Writes a buffer to a file, retrying partial writes.
+ *
+ * \param[in] fd  File descriptor.
+ * \param[in] buf Buffer to write.
+ * \param[in] len Length of the buffer.
+ *
+ * \return 0 on success, -1 on error.
+ ****************************************************************************/
+static int FlightRecOut(int fd, const char *buf, size_t len) {
+	ssize_t done;
+
+	for (; len; buf += done, len -= done)
+		if ((done = write(fd, buf, len)) <= 0) return -1;
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Appends a string to a line, left aligned.
+ *
+ * \param[out] p     Line position to append the string to.
+ * \param[in]  str   String to append.
+ * \param[in]  len   Length of the string.
+ * \param[in]  width Minimum width, padded with spaces.
+ *
+ * \return Line position following the appended string.
+ ****************************************************************************/
+static char *FlightRecStr(char *p, const char *str, size_t len, int width) {
+	for (; len; len--, width--) *p++ = *str++;
+	for (; width > 0; width--) *p++ = ' ';
+
+	return p;
+}
+
+/************************************************************************//**
+ * Appends a decimal number to a line, right aligned.
+ *
+ * \param[out] p     Line position to append the number to.
+ * \param[in]  val   Number to append.
+ * \param[in]  width Minimum width, padded with spaces.
+ * \param[in]  frac  Number of digits after the decimal point, 0 for none.
+ *
+ * \return Line position following the appended number.
+ ****************************************************************************/
+static char *FlightRecDec(char *p, int64_t val, int width, int frac) {
+	uint64_t u = (val < 0)?-(uint64_t)val:(uint64_t)val;
+	char digit[24];
+	int n = 0;
+
+	do {
+		digit[n++] = '0' + u % 10;
+		u /= 10;
+		if (n == frac) digit[n++] = '.';
+	} while (u || (frac && (n <= frac + 1)));
+	if (val < 0) digit[n++] = '-';
+	for (; width > n; width--) *p++ = ' ';
+	while (n) *p++ = digit[--n];
+
+	return p;
+}
+
+/************************************************************************//**
+ * Appends a hexadecimal number to a line.
+ *
+ * \param[out] p      Line position to append the number to.
+ * \param[in]  val    Number to append.
+ * \param[in]  digits Number of digits, zero padded.
+ *
+ * \return Line position following the appended number.
+ ****************************************************************************/
+static char *FlightRecHex(char *p, uint32_t val, int digits) {
+	while (digits--) *p++ = "0123456789ABCDEF"[(val >> (4 * digits)) & 0xF];
+
+	return p;
+}
+
+/************************************************************************//**
+ * Writes a record to a dump file.
+ *
+ * \param[in] fd     Dump file descriptor.
+ * \param[in] e      Record to write.
+ * \param[in] newest Timestamp of the newest record.
+ *
+ * \return 0 on success, -1 on error.
+ ****************************************************************************/
+static int FlightRecPrint(int fd, const FlightRecEntry *e, uint64_t newest) {
+	const char *name = "?";
+	unsigned int i, len = MIN(e->len, FLIGHTREC_DATA);
+	char line[FLIGHTREC_LINE], *p = line;
+
+	if ((e->type < sizeof(flightRecName) / sizeof(flightRecName[0])) &&
+			flightRecName[e->type]) name = flightRecName[e->type];
+	// Times in ms, with microsecond resolution
+	p = FlightRecDec(p, (int64_t)(e->time - newest) / 1000, 12, 3);
+	p = FlightRecDec(p, e->port, 5, 0);
+	p = FlightRecStr(p, "  ", 2, 0);
+	p = FlightRecStr(p, name, strlen(name), 12);
+	p = FlightRecDec(p, e->ret, 7, 0);
+	p = FlightRecDec(p, e->arg, 7, 0);
+	p = FlightRecDec(p, e->len, 7, 0);
+	p = FlightRecStr(p, " ", 1, 0);
+	for (i = 0; i < FLIGHTREC_DATA; i++) {
+		if (i < len) p = FlightRecHex(FlightRecStr(p, " ", 1, 0),
+				e->data[i], 2);
+		else p = FlightRecStr(p, "   ", 3, 0);
+	}
+	// Frames sent hold commands, decode the memory access ones
+	if ((SC_TRACE_FRAME_SEND == e->type) && len) {
+		p = FlightRecStr(p, "  cmd ", 6, 0);
+		p = FlightRecDec(p, e->data[0] & ~CMD_F_RLE, 0, 0);
+		if (sizeof(CmdRdWrHdr) == e->len) {
+			p = FlightRecStr(p, " addr 0x", 8, 0);
+			p = FlightRecHex(p, CMD_GET_ADDR(e->data + 1), 6);
+			p = FlightRecStr(p, " len ", 5, 0);
+			p = FlightRecDec(p, (e->data[4]<<8) | e->data[5], 0, 0);
+		}
+	} else if (FLIGHTREC_OPEN == e->type) {
+		p = FlightRecStr(FlightRecStr(p, "  ", 2, 0), (char*)e->data, len,
+				0);
+	}
+	*p++ = '\n';
+
+	return FlightRecOut(fd, line, p - line);
+}
+
+/************************************************************************//**
+ * Writes the records in the ring to a dump file.
+ *
+ * \param[in] fd     Dump file descriptor.
+ * \param[in] reason Why the records are written.
+ * \param[in] pos    Number of records added when the dump started.
+ *
+ * \return 0 on success, -1 on error.
+ ****************************************************************************/
+static int FlightRecWrite(int fd, const char *reason, guint pos) {
+	static const char cols[] = " records, times in ms from the newest "
+		"one\n\n        time port  record          ret    arg    len  "
+		"data\n";
+	guint first = pos - MIN(pos, FLIGHTREC_LEN);
+	const FlightRecEntry *e = flightRec + ((pos - 1) & (FLIGHTREC_LEN - 1));
+	char line[FLIGHTREC_LINE], *p;
+
+	p = FlightRecDec(FlightRecStr(line, "\n", 1, 0), pos - first, 0, 0);
+	if (FlightRecOut(fd, "Flight recorder: ", 17) ||
+			FlightRecOut(fd, reason, strlen(reason)) ||
+			FlightRecOut(fd, line, p - line) ||
+			FlightRecOut(fd, cols, sizeof(cols) - 1)) return -1;
+	for (; first != pos; first++) {
+		// Skip records being written, or overwritten since the dump started
+		if ((guint)g_atomic_int_get(&flightRec[first &
+					(FLIGHTREC_LEN - 1)].seq) != first + 1) continue;
+		if (FlightRecPrint(fd, flightRec + (first & (FLIGHTREC_LEN - 1)),
+					e->time)) return -1;
+	}
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Writes the records in the ring to a new file, in the FLIGHTREC_DIR
+ * directory of the user cache directory, named after the current date and
+ * time, the process ID and the number of dumps written before, so dumps
+ * never overwrite each other. Nothing is written if there are no records.
+ *
+ * \param[in] reason Why the records are written, printed in the file.
+ *
+ * \return 0 on success or if nothing had to be written, -1 on error.
+ ****************************************************************************/
+int FlightRecDump(const char *reason) {
+	guint pos = g_atomic_int_get(&flightRecPos);
+	GDateTime *now;
+	gchar *stamp, *name, *path, *dir;
+	int fd = -1, ret = -1;
+
+	if (!pos) return 0;
+	now = g_date_time_new_now_local();
+	stamp = g_date_time_format(now, "%Y%m%d-%H%M%S");
+	name = g_strdup_printf("flight-%s-%d-%d.log", stamp, (int)getpid(),
+			g_atomic_int_add(&flightRecDumps, 1));
+	path = g_build_filename(g_get_user_cache_dir(), FLIGHTREC_DIR, name,
+			NULL);
+	dir = g_path_get_dirname(path);
+	if (g_mkdir_with_parents(dir, 0755) || ((fd = open(path,
+				O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)) {
+		perror(path);
+	} else {
+		ret = FlightRecWrite(fd, reason, pos);
+		if (close(fd) || ret) {
+			perror(path);
+			ret = -1;
+		} else {
+			PrintErr("Flight recorder written to %s\n", path);
+		}
+	}
+	g_free(dir);
+	g_free(path);
+	g_free(name);
+	g_free(stamp);
+	g_date_time_unref(now);
+
+	return ret;
+}
+
+#ifndef __OS_WIN
+/************************************************************************//**
+ * Prepares the file written by FlightRecDumpSignal(), named after the
+ * current date and time and the process ID, and creates its directory, so
+ * the signal handler only has to open it. Must be called before signal
+ * handlers using FlightRecDumpSignal() are installed.
+ ****************************************************************************/
+void FlightRecInit(void) {
+	GDateTime *now = g_date_time_new_now_local();
+	gchar *stamp = g_date_time_format(now, "%Y%m%d-%H%M%S");
+	gchar *name = g_strdup_printf("flight-%s-%d-signal.log", stamp,
+			(int)getpid());
+	gchar *dir = g_build_filename(g_get_user_cache_dir(), FLIGHTREC_DIR,
+			NULL);
+
+	// Records cannot be written from signal handlers without the directory
+	if (g_mkdir_with_parents(dir, 0755)) perror(dir);
+	else flightRecSigPath = g_build_filename(dir, name, NULL);
+	g_free(dir);
+	g_free(name);
+	g_free(stamp);
+	g_date_time_unref(now);
+}
+
+/************************************************************************//**
+ * Writes the records in the ring to the file prepared by FlightRecInit().
+ * Only async-signal-safe functions are used, so it can be called from a
+ * signal handler. Nothing is written if there are no records, or if
+ * FlightRecInit() was not called or could not create the directory.
+ *
+ * \param[in] reason Why the records are written, printed in the file.
+ ****************************************************************************/
+void FlightRecDumpSignal(const char *reason) {
+	static const char done[] = "Flight recorder written to ";
+	guint pos = g_atomic_int_get(&flightRecPos);
+	int fd, err;
+
+	if (!pos || !flightRecSigPath) return;
+	if ((fd = open(flightRecSigPath, O_WRONLY | O_CREAT | O_EXCL,
+					0644)) < 0) return;
+	err = FlightRecWrite(fd, reason, pos);
+	if (!close(fd) && !err) {
+		FlightRecOut(STDERR_FILENO, done, sizeof(done) - 1);
+		FlightRecOut(STDERR_FILENO, flightRecSigPath,
+				strlen(flightRecSigPath));
+		FlightRecOut(STDERR_FILENO, "\n", 1);
+	}
+}
+#endif
+
@@ -0,0 +1,91 @@
+/************************************************************************//**
+ * \file
+ * \brief Flight recorder, keeping the last transfers with the programmers.
+ *
+ * \defgroup flightrec flightrec
+ * \{
+ * \brief Flight recorder, keeping the last transfers with the programmers.
+ *
+ * The flight recorder is always on. It keeps in a fixed size ring the last
+ * FLIGHTREC_LEN calls to the spi-com data functions, with their timestamp,
+ * the programmer they were sent to, their result and argument, and the
+ * first bytes of the data they transferred (that for frames sent hold the
+ * command code, address and length). When something fails, the ring is
+ * dumped to a file, so intermittent faults can be diagnosed after the
+ * fact, without having to run again with a different timing.
+ *
+ * Adding a record takes a single atomic increment to claim a ring slot,
+ * and no locks, so records can be added from several threads at once.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _FLIGHTREC_H_
+#define _FLIGHTREC_H_
+
+#include <stdint.h>
+
+/// Number of records kept, must be a power of two
+#define FLIGHTREC_LEN		4096
+/// Number of data bytes kept in each record
+#define FLIGHTREC_DATA		8
+/// Directory, relative to the user cache directory, for the dump files
+#define FLIGHTREC_DIR		"mk3-prog"
+
+/** \addtogroup FlightRecTypes
+ *  \brief Record types. The spi-com data functions use the SC_TRACE_*
+ *  record types, see sc-trace.h.
+ *  \{ */
+#define FLIGHTREC_OPEN		0x40	///< Programmer opened (data: serial)
+#define FLIGHTREC_CLOSE		0x41	///< Programmer closed
+/** \} */
+
+/************************************************************************//**
+ * Adds a record to the ring, overwriting the oldest one.
+ *
+ * \param[in] type Record type (SC_TRACE_* or FLIGHTREC_*).
+ * \param[in] port Identifier of the programmer.
+ * \param[in] ret  Call result.
+ * \param[in] arg  Call argument.
+ * \param[in] data Data transferred by the call, NULL if not available.
+ * \param[in] len  Length of the data. Only the first FLIGHTREC_DATA bytes
+ *            are kept.
+ ****************************************************************************/
+void FlightRecAdd(uint8_t type, uint8_t port, int32_t ret, uint32_t arg,
+		const void *data, uint32_t len);
+
+/************************************************************************//**
+ * Writes the records in the ring to a new file, in the FLIGHTREC_DIR
+ * directory of the user cache directory, named after the current date and
+ * time, the process ID and the number of dumps written before, so dumps
+ * never overwrite each other. Nothing is written if there are no records.
+ *
+ * \param[in] reason Why the records are written, printed in the file.
+ *
+ * \return 0 on success or if nothing had to be written, -1 on error.
+ ****************************************************************************/
+int FlightRecDump(const char *reason);
+
+#ifndef __OS_WIN
+/************************************************************************//**
+ * Prepares the file written by FlightRecDumpSignal(), named after the
+ * current date and time and the process ID, and creates its directory, so
+ * the signal handler only has to open it. Must be called before signal
+ * handlers using FlightRecDumpSignal() are installed.
+ ****************************************************************************/
+void FlightRecInit(void);
+
+/************************************************************************//**
+ * Writes the records in the ring to the file prepared by FlightRecInit().
+ * Only async-signal-safe functions are used, so it can be called from a
+ * signal handler. Nothing is written if there are no records, or if
+ * FlightRecInit() was not called or could not create the directory.
+ *
+ * \param[in] reason Why the records are written, printed in the file.
+ ****************************************************************************/
+void FlightRecDumpSignal(const char *reason);
+#endif
+
+#endif /*_FLIGHTREC_H_*/
+
+/** \} */
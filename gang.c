@@ -0,0 +1,355 @@
+/************************************************************************//**
+ * \file
+ * \brief Gang programming: programs carts on several programmers at once.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "gang.h"
+#include "util.h"
+#include "stats.h"
+#include "flightrec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <glib.h>
+
+/// Interval between cart presence checks, in milliseconds
+#define GANG_POLL_MS	250
+
+/// Programmer worker state.
+typedef struct {
+	char serial[SC_SERIAL_MAXLEN];	///< USB serial number of the programmer
+	const GangJob *job;		///< Operations performed on each cart
+	unsigned int channel;	///< Channel number of the FTX232H device
+	GAsyncQueue *jobs;		///< Queue of carts to program
+	int max;				///< Maximum number of carts to program, 0 for any
+	GThread *thread;		///< Worker thread
+	int done;				///< Carts programmed successfully
+	int failed;				///< Carts that could not be programmed
+	char error[80];			///< Last error, empty if none
+	gint64 usec;			///< Time spent programming carts
+} GangWorker;
+
+/// Serializes the output of the worker threads
+static GMutex gangOut;
+
+/************************************************************************//**
+ * Prints a message, prefixed by the programmer serial number.
+ *
+ * \param[in] w   Worker printing the message.
+ * \param[in] fmt printf-like format string, followed by its arguments.
+ ****************************************************************************/
+static void GangLog(GangWorker *w, const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	g_mutex_lock(&gangOut);
+	printf("[%s] ", w->serial);
+	vprintf(fmt, args);
+	putchar('\n');
+	fflush(stdout);
+	g_mutex_unlock(&gangOut);
+	va_end(args);
+}
+
+/************************************************************************//**
+ * Records and prints the error that made a cart fail, and writes the
+ * flight recorder records.
+ *
+ * \param[in] w   Worker where the error occurred.
+ * \param[in] fmt printf-like format string, followed by its arguments.
+ *
+ * \return -1, so it can be returned by the caller.
+ ****************************************************************************/
+static int GangFail(GangWorker *w, const char *fmt, ...) {
+	va_list args;
+	gchar *reason;
+
+	va_start(args, fmt);
+	vsnprintf(w->error, sizeof(w->error), fmt, args);
+	va_end(args);
+	GangLog(w, "ERROR: %s!", w->error);
+	reason = g_strdup_printf("[%s] %s", w->serial, w->error);
+	FlightRecDump(reason);
+	g_free(reason);
+
+	return -1;
+}
+
+/************************************************************************//**
+ * Runs a copy of a command batch, checking all the reply codes.
+ *
+ * \param[in] w    Worker running the batch.
+ * \param[in] tmpl Command batch to run.
+ * \param[in] what Description of the commands, for error messages.
+ *
+ * \return 0 on success, -1 on error.
+ ****************************************************************************/
+static int GangBatchRun(GangWorker *w, const CmdBatch *tmpl,
+		const char *what) {
+	CmdBatch batch = *tmpl;
+	CmdRep *rep;
+	unsigned int i;
+
+	if (CmdBatchRun(&batch, &rep)) return GangFail(w, "%s failed", what);
+	for (i = 0; i < batch.count; i++) {
+		if (rep[i].command != CMD_REP_OK)
+			return GangFail(w, "%s command %d failed", what, i);
+	}
+	return 0;
+}
+
+/************************************************************************//**
+ * Compares data read from a cart with the written image.
+ *
+ * \param[in] w    Worker performing the verification.
+ * \param[in] img  Written image.
+ * \param[in] buf  Data read from the cart.
+ * \param[in] name Name of the verified memory, for error messages.
+ *
+ * \return 0 if data matches, -1 otherwise.
+ ****************************************************************************/
+static int GangCompare(GangWorker *w, const GangImage *img,
+		const uint8_t *buf, const char *name) {
+	uint32_t i;
+
+	for (i = 0; (i < img->len) && (buf[i] == img->data[i]); i++);
+	if (i < img->len)
+		return GangFail(w, "%s verify failed at 0x%06X", name, img->addr + i);
+	return 0;
+}
+
+/************************************************************************//**
+ * Writes an image to cart SRAM, and verifies it if requested.
+ *
+ * \param[in] w   Worker writing the image.
+ * \param[in] img Image to write.
+ *
+ * \return 0 on success, -1 on error.
+ ****************************************************************************/
+static int GangRamWrite(GangWorker *w, const GangImage *img) {
+	Cmd cmd;
+	CmdRep *rep;
+	uint8_t *buf;
+	int err;
+
+	GangLog(w, "Writing SRAM...");
+	cmd.rdWr.cmd = CMD_RAM_WRITE;
+	CMD_SET_ADDR(cmd.rdWr.addr, img->addr);
+	CMD_SET_LEN(cmd.rdWr.len, img->len);
+	if ((CmdSendLongCmd(&cmd, sizeof(CmdRdWrHdr), img->data, img->len,
+					&rep) != CMD_OK) || (rep->command != CMD_REP_OK))
+		return GangFail(w, "SRAM write failed");
+	if (!w->job->verify) return 0;
+
+	if (!(buf = malloc(img->len))) return GangFail(w, "out of memory");
+	cmd.rdWr.cmd = CMD_RAM_READ;
+	if ((CmdSendLongRep(&cmd, sizeof(CmdRdWrHdr), &rep, buf,
+					img->len) != (int)img->len) ||
+			(rep->command != CMD_REP_OK)) {
+		err = GangFail(w, "SRAM read failed");
+	} else {
+		err = GangCompare(w, img, buf, "SRAM");
+	}
+	free(buf);
+	return err;
+}
+
+/************************************************************************//**
+ * Writes an image to a flash chip, and verifies it if requested.
+ *
+ * \param[in] w    Worker writing the image.
+ * \param[in] chip Flash chip to write (0 for CHR, 1 for PRG).
+ * \param[in] img  Image to write.
+ *
+ * \return 0 on success, -1 on error.
+ ****************************************************************************/
+static int GangFlash(GangWorker *w, uint8_t chip, const GangImage *img) {
+	const char *name = chip?"PRG":"CHR";
+	CmdRep *rep;
+	uint8_t *buf;
+	int err;
+
+	GangLog(w, "Flashing %s...", name);
+	if (CmdPipeWriteSparse(CMD_CHR_WRITE + chip, img->addr, img->data,
+				img->len, img->blank, &rep, NULL, NULL) != CMD_OK)
+		return GangFail(w, "%s flash failed", name);
+	if (!w->job->verify) return 0;
+
+	if (!(buf = malloc(img->len))) return GangFail(w, "out of memory");
+	if (CmdPipeRead(CMD_CHR_READ + chip, img->addr, buf, img->len, &rep,
+				NULL, NULL) != CMD_OK) {
+		err = GangFail(w, "%s read failed", name);
+	} else {
+		err = GangCompare(w, img, buf, name);
+	}
+	free(buf);
+	return err;
+}
+
+/************************************************************************//**
+ * Performs the job operations on the cart inserted in the programmer.
+ *
+ * \param[in] w Worker programming the cart.
+ *
+ * \return 0 on success, -1 on error.
+ ****************************************************************************/
+static int GangCart(GangWorker *w) {
+	const GangJob *job = w->job;
+
+	if (job->setup && GangBatchRun(w, job->setup, "setup")) return -1;
+	if (job->ram.data && GangRamWrite(w, &job->ram)) return -1;
+	if (job->erase) {
+		GangLog(w, "Erasing...");
+		if (GangBatchRun(w, job->erase, "erase")) return -1;
+	}
+	if (job->chr.data && GangFlash(w, 0, &job->chr)) return -1;
+	if (job->prg.data && GangFlash(w, 1, &job->prg)) return -1;
+
+	GangLog(w, "Cart OK!");
+	return 0;
+}
+
+/************************************************************************//**
+ * Checks if a cart is inserted in the programmer, by querying the flash
+ * chip identifiers. Without a cart, the manufacturer ID reads as all zeros
+ * or all ones.
+ *
+ * \return TRUE if a cart is inserted, FALSE if not, -1 on error.
+ ****************************************************************************/
+static int GangCartPresent(void) {
+	Cmd cmd;
+	CmdRep *rep;
+
+	cmd.command = CMD_FLASH_ID;
+	if ((CmdSend(&cmd, 1, &rep) < 0) || (rep->fId.code != CMD_REP_OK))
+		return -1;
+	return (rep->fId.prg.manId != 0x00) && (rep->fId.prg.manId != 0xFF);
+}
+
+/************************************************************************//**
+ * Waits until the cart in the programmer is removed, and another one is
+ * inserted.
+ *
+ * \param[in] w Worker waiting for the cart.
+ *
+ * \return 0 when the new cart is inserted, -1 on error.
+ ****************************************************************************/
+static int GangCartSwap(GangWorker *w) {
+	int present;
+
+	GangLog(w, "Insert next cart.");
+	while ((present = GangCartPresent()) == TRUE) DelayMs(GANG_POLL_MS);
+	while (!present) {
+		DelayMs(GANG_POLL_MS);
+		present = GangCartPresent();
+	}
+	if (present < 0) return GangFail(w, "cart detection failed");
+	// Let the cart settle after insertion
+	DelayMs(GANG_POLL_MS);
+	return 0;
+}
+
+/************************************************************************//**
+ * Worker thread. Opens its programmer, and programs carts while there are
+ * jobs left in the queue.
+ *
+ * \param[in] data Worker state.
+ *
+ * \return NULL.
+ ****************************************************************************/
+static gpointer GangWorkerRun(gpointer data) {
+	GangWorker *w = data;
+	gpointer cart;
+	gint64 start;
+	uint64_t phase;
+	int carts = 0;
+
+	if (CmdInitSerial(w->channel, w->serial)) {
+		GangFail(w, "could not open programmer");
+		CmdClose();
+		return NULL;
+	}
+	while ((!w->max || carts < w->max) &&
+			(cart = g_async_queue_try_pop(w->jobs))) {
+		// Give the job back if the cart cannot be replaced
+		if (carts++ && GangCartSwap(w)) {
+			g_async_queue_push(w->jobs, cart);
+			break;
+		}
+		start = g_get_monotonic_time();
+		phase = StatsStart();
+		if (GangCart(w)) w->failed++;
+		else w->done++;
+		StatsSpan("Cart", phase, StatsNow());
+		w->usec += g_get_monotonic_time() - start;
+	}
+	CmdClose();
+
+	return NULL;
+}
+
+/************************************************************************//**
+ * Programs carts using all the connected programmers at once, and prints a
+ * summary for each programmer when done.
+ *
+ * \param[in] job     Operations to perform on each cart.
+ * \param[in] channel Channel number of the FTX232H devices.
+ * \param[in] carts   Number of carts to program, 0 to program one cart on
+ *                    each programmer.
+ *
+ * \return Number of carts that could not be programmed, or -1 if no
+ *         programmer was found.
+ ****************************************************************************/
+int GangRun(const GangJob *job, unsigned int channel, unsigned int carts) {
+	char serial[GANG_MAX][SC_SERIAL_MAXLEN];
+	GangWorker *w;
+	GAsyncQueue *jobs;
+	int count, total, i;
+	int done = 0;
+
+	if ((count = CmdList(serial, GANG_MAX)) <= 0) {
+		PrintErr("No programmers found!\n");
+		return -1;
+	}
+	if (!(w = calloc(count, sizeof(GangWorker)))) {
+		perror("Allocating gang workers");
+		return -1;
+	}
+	// Each job is a cart to program, identified by a non-NULL token
+	jobs = g_async_queue_new();
+	total = carts?(int)carts:count;
+	for (i = 0; i < total; i++)
+		g_async_queue_push(jobs, GINT_TO_POINTER(i + 1));
+	printf("Programming %d carts using %d programmers...\n", total, count);
+
+	g_mutex_init(&gangOut);
+	for (i = 0; i < count; i++) {
+		strcpy(w[i].serial, serial[i]);
+		w[i].job = job;
+		w[i].channel = channel;
+		w[i].jobs = jobs;
+		// Without a cart count, each programmer programs its own cart
+		w[i].max = carts?0:1;
+		w[i].thread = g_thread_new(w[i].serial, GangWorkerRun, &w[i]);
+	}
+	for (i = 0; i < count; i++) g_thread_join(w[i].thread);
+	g_mutex_clear(&gangOut);
+
+	printf("\nProgrammer        Carts OK  Failed  Time (s)\n");
+	for (i = 0; i < count; i++) {
+		printf("%-16s  %8d  %6d  %8.1f%s%s\n", w[i].serial, w[i].done,
+				w[i].failed, w[i].usec / (double)G_USEC_PER_SEC,
+				w[i].error[0]?"  ":"", w[i].error);
+		done += w[i].done;
+	}
+	// Carts not programmed are counted as failed
+	printf("%d carts programmed, %d failed.\n", done, total - done);
+	g_async_queue_unref(jobs);
+	free(w);
+
+	return total - done;
+}
+
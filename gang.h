@@ -0,0 +1,65 @@
+/************************************************************************//**
+ * \file
+ * \brief Gang programming: programs carts on several programmers at once.
+ *
+ * \defgroup gang gang
+ * \{
+ * \brief Gang programming: programs carts on several programmers at once.
+ *
+ * Each connected programmer is opened with its own command context, and
+ * driven by its own worker thread. Carts to program are jobs in a queue,
+ * taken by whichever programmer is free. When a programmer takes another
+ * job after completing one, it waits until its cart is replaced (cart
+ * presence is detected by querying the flash chip identifiers).
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _GANG_H_
+#define _GANG_H_
+
+#include <stdint.h>
+#include "cmd.h"
+
+/// Maximum number of programmers driven at once
+#define GANG_MAX		16
+
+/// Image to write to a cart memory.
+typedef struct {
+	const uint8_t *data;	///< Image data, NULL if none
+	uint32_t addr;			///< Command address to write the image to
+	uint32_t len;			///< Image length
+	/// Minimum length of the 0xFF runs not written, if the flash sectors
+	/// covered by the image are erased. 0 to write all the image.
+	uint32_t blank;
+} GangImage;
+
+/// Operations performed on each cart, in order: setup commands, SRAM
+/// write, erases, CHR flash and PRG flash. Written images are verified if
+/// requested.
+typedef struct {
+	const CmdBatch *setup;	///< Setup commands (e.g. mapper), or NULL
+	const CmdBatch *erase;	///< Erase commands, or NULL
+	GangImage ram;			///< Image to write to cart SRAM
+	GangImage chr;			///< Image to write to CHR flash
+	GangImage prg;			///< Image to write to PRG flash
+	uint8_t verify;			///< Read back and compare written images
+} GangJob;
+
+/************************************************************************//**
+ * Programs carts using all the connected programmers at once, and prints a
+ * summary for each programmer when done.
+ *
+ * \param[in] job     Operations to perform on each cart.
+ * \param[in] channel Channel number of the FTX232H devices.
+ * \param[in] carts   Number of carts to program, 0 to program one cart on
+ *                    each programmer.
+ *
+ * \return Number of carts that could not be programmed, or -1 if no
+ *         programmer was found.
+ ****************************************************************************/
+int GangRun(const GangJob *job, unsigned int channel, unsigned int carts);
+
+#endif /*_GANG_H_*/
+
+/** \} */
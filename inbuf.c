@@ -0,0 +1,118 @@
+/************************************************************************//**
+ * \file
+ * \brief Input buffers for data written to the cartridge.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "inbuf.h"
+#include "util.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef __OS_WIN
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifndef __OS_WIN
+/************************************************************************//**
+ * Maps the input file to memory. Only regular files holding the requested
+ * length are mapped.
+ *
+ * \param[inout] ib   Input buffer, with len field set.
+ * \param[in]    file Input file.
+ *
+ * \return 0 if OK, -1 if error.
+ ****************************************************************************/
+static int InBufMap(InBuf *ib, const char *file) {
+	struct stat st;
+	void *map = MAP_FAILED;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0) return -1;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+			(st.st_size <= UINT32_MAX)) {
+		if (!ib->len) ib->len = st.st_size;
+		if (ib->len && ((off_t)ib->len <= st.st_size))
+			map = mmap(NULL, ib->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	// The mapping holds its own reference to the file
+	close(fd);
+	if (MAP_FAILED == map) return -1;
+	// Pages are read ahead as data is sent
+	madvise(map, ib->len, MADV_SEQUENTIAL);
+	ib->data = map;
+	ib->mapped = TRUE;
+
+	return 0;
+}
+#endif
+
+/************************************************************************//**
+ * Loads a file to an input buffer, mapping it to memory if possible.
+ *
+ * \param[out] ib   Input buffer to load.
+ * \param[in]  file Input file.
+ * \param[in]  len  Number of bytes to load from the start of the file, 0
+ *                  to load the entire file.
+ *
+ * \return Pointer to the buffer data, or NULL if error occurred.
+ ****************************************************************************/
+uint8_t *InBufLoad(InBuf *ib, const char *file, uint32_t len) {
+	FILE *img;
+	uint64_t start = StatsStart();
+
+	ib->data = NULL;
+	ib->len = len;
+	ib->mapped = FALSE;
+#ifndef __OS_WIN
+	// Fall back to heap memory if file cannot be mapped
+	if (!InBufMap(ib, file)) return ib->data;
+	ib->len = len;
+#endif
+	if (!(img = fopen(file, "rb"))) {
+		perror(file);
+		return NULL;
+	}
+	// Obtain length if not specified
+	if (!ib->len) {
+		fseek(img, 0, SEEK_END);
+		ib->len = ftell(img);
+		fseek(img, 0, SEEK_SET);
+	}
+	if (!(ib->data = malloc(ib->len))) {
+		perror("Allocating write buffer");
+	} else if (1 > fread(ib->data, ib->len, 1, img)) {
+		PrintErr("%s: could not read %u bytes!\n", file, ib->len);
+		free(ib->data);
+		ib->data = NULL;
+	} else {
+		StatsEnd(STATS_FILE_READ, start, ib->len);
+	}
+	fclose(img);
+
+	return ib->data;
+}
+
+/************************************************************************//**
+ * Frees an input buffer, unmapping its file if mapped.
+ *
+ * \param[in] ib Input buffer to free.
+ ****************************************************************************/
+void InBufFree(InBuf *ib) {
+	if (!ib->data) return;
+#ifndef __OS_WIN
+	if (ib->mapped) {
+		munmap(ib->data, ib->len);
+		ib->mapped = FALSE;
+		ib->data = NULL;
+		return;
+	}
+#endif
+	free(ib->data);
+	ib->data = NULL;
+}
+
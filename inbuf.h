@@ -0,0 +1,54 @@
+/************************************************************************//**
+ * \file
+ * \brief Input buffers for data written to the cartridge.
+ *
+ * \defgroup inbuf inbuf
+ * \{
+ * \brief Input buffers for data written to the cartridge.
+ *
+ * The buffer is the input file itself, mapped read-only in memory, so the
+ * file is not loaded before writing it: its pages are read as they are
+ * sent, and belong to the page cache instead of the program heap. If the
+ * file cannot be mapped (e.g. it is a pipe, or on Windows), it is read to
+ * a heap buffer.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _INBUF_H_
+#define _INBUF_H_
+
+#include <stdint.h>
+
+/// Input buffer
+typedef struct {
+	uint8_t *data;		///< Buffer data
+	uint32_t len;		///< Buffer length
+	int mapped;			///< TRUE if the file is mapped, FALSE if in heap
+} InBuf;
+
+/// Initializer for InBuf variables
+#define INBUF_INIT	{NULL, 0, 0}
+
+/************************************************************************//**
+ * Loads a file to an input buffer, mapping it to memory if possible.
+ *
+ * \param[out] ib   Input buffer to load.
+ * \param[in]  file Input file.
+ * \param[in]  len  Number of bytes to load from the start of the file, 0
+ *                  to load the entire file.
+ *
+ * \return Pointer to the buffer data, or NULL if error occurred.
+ ****************************************************************************/
+uint8_t *InBufLoad(InBuf *ib, const char *file, uint32_t len);
+
+/************************************************************************//**
+ * Frees an input buffer, unmapping its file if mapped.
+ *
+ * \param[in] ib Input buffer to free.
+ ****************************************************************************/
+void InBufFree(InBuf *ib);
+
+#endif /*_INBUF_H_*/
+
+/** \} */
@@ -0,0 +1,116 @@
+/************************************************************************//**
+ * \file
+ * \brief Storage of link settings for each programmer.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "linkcfg.h"
+#include "util.h"
+#include <stdio.h>
+#include <glib.h>
+
+/// Name of the key file group for the specified serial number
+#define LINKCFG_GROUP(serial)	g_strdup_printf("LINK %s", serial)
+
+/************************************************************************//**
+ * Obtains the path of the per-user cache file.
+ *
+ * \return Path of the cache file. Must be freed using g_free().
+ ****************************************************************************/
+static gchar *LinkCfgUserFile(void) {
+	return g_build_filename(g_get_user_cache_dir(), LINKCFG_USER_DIR,
+			LINKCFG_USER_FILE, NULL);
+}
+
+/************************************************************************//**
+ * Loads link settings from the specified key file group.
+ *
+ * \param[in]  file  Key file to read.
+ * \param[in]  group Key file group holding the settings.
+ * \param[out] cfg   Loaded link settings.
+ *
+ * \return 0 if settings were found and loaded, -1 otherwise.
+ ****************************************************************************/
+static int LinkCfgFileLoad(const char *file, const char *group,
+		ScLinkCfg *cfg) {
+	GKeyFile *gkf = g_key_file_new();
+	GError *err = NULL;
+	int ret = -1;
+
+	if (g_key_file_load_from_file(gkf, file, G_KEY_FILE_NONE, NULL) &&
+			g_key_file_has_group(gkf, group)) {
+		cfg->clk = g_key_file_get_integer(gkf, group, "spi_clk", &err);
+		if (!err) cfg->chunk = g_key_file_get_integer(gkf, group, "chunk",
+				&err);
+		if (!err) cfg->latency = g_key_file_get_integer(gkf, group,
+				"latency", &err);
+		if (!err) ret = 0;
+		else {
+			printf("WARNING: Invalid link settings in %s: %s\n", file,
+					err->message);
+			g_error_free(err);
+		}
+	}
+	g_key_file_free(gkf);
+
+	return ret;
+}
+
+/************************************************************************//**
+ * Loads link settings stored for the specified programmer.
+ *
+ * \param[in]  serial USB serial number of the programmer.
+ * \param[out] cfg    Loaded link settings.
+ *
+ * \return 0 if settings were found and loaded, -1 otherwise.
+ ****************************************************************************/
+int LinkCfgLoad(const char *serial, ScLinkCfg *cfg) {
+	gchar *group = LINKCFG_GROUP(serial);
+	gchar *userFile = LinkCfgUserFile();
+	int ret;
+
+	if ((ret = LinkCfgFileLoad(userFile, group, cfg)))
+		ret = LinkCfgFileLoad(LINKCFG_SYS_FILE, group, cfg);
+	g_free(userFile);
+	g_free(group);
+
+	return ret;
+}
+
+/************************************************************************//**
+ * Saves link settings for the specified programmer to the per-user cache
+ * file.
+ *
+ * \param[in] serial USB serial number of the programmer.
+ * \param[in] cfg    Link settings to save.
+ *
+ * \return 0 if settings were saved, -1 otherwise.
+ ****************************************************************************/
+int LinkCfgSave(const char *serial, const ScLinkCfg *cfg) {
+	gchar *group = LINKCFG_GROUP(serial);
+	gchar *userFile = LinkCfgUserFile();
+	gchar *userDir = g_path_get_dirname(userFile);
+	GKeyFile *gkf = g_key_file_new();
+	GError *err = NULL;
+	int ret = -1;
+
+	// Keep settings of other programmers, if the file already exists
+	g_key_file_load_from_file(gkf, userFile, G_KEY_FILE_KEEP_COMMENTS, NULL);
+	g_key_file_set_integer(gkf, group, "spi_clk", cfg->clk);
+	g_key_file_set_integer(gkf, group, "chunk", cfg->chunk);
+	g_key_file_set_integer(gkf, group, "latency", cfg->latency);
+	if (g_mkdir_with_parents(userDir, 0755)) perror(userDir);
+	else if (!g_key_file_save_to_file(gkf, userFile, &err)) {
+		PrintErr("%s: %s\n", userFile, err->message);
+		g_error_free(err);
+	} else ret = 0;
+
+	g_key_file_free(gkf);
+	g_free(userDir);
+	g_free(userFile);
+	g_free(group);
+
+	return ret;
+}
+
@@ -0,0 +1,53 @@
+/************************************************************************//**
+ * \file
+ * \brief Storage of link settings for each programmer.
+ *
+ * \defgroup linkcfg linkcfg
+ * \{
+ * \brief Storage of link settings for each programmer.
+ *
+ * Link settings are stored in a "LINK <serial>" group, one for each
+ * programmer USB serial number. Settings are first searched in the
+ * per-user cache file, and then in the system wide configuration file.
+ * Settings are always saved to the per-user cache file.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _LINKCFG_H_
+#define _LINKCFG_H_
+
+#include "spi-com.h"
+
+/// System wide configuration file
+#define LINKCFG_SYS_FILE	"/etc/mk3-prog.cfg"
+/// Directory, relative to the user cache directory, for the cache file
+#define LINKCFG_USER_DIR	"mk3-prog"
+/// Name of the per-user cache file
+#define LINKCFG_USER_FILE	"link.cfg"
+
+/************************************************************************//**
+ * Loads link settings stored for the specified programmer.
+ *
+ * \param[in]  serial USB serial number of the programmer.
+ * \param[out] cfg    Loaded link settings.
+ *
+ * \return 0 if settings were found and loaded, -1 otherwise.
+ ****************************************************************************/
+int LinkCfgLoad(const char *serial, ScLinkCfg *cfg);
+
+/************************************************************************//**
+ * Saves link settings for the specified programmer to the per-user cache
+ * file.
+ *
+ * \param[in] serial USB serial number of the programmer.
+ * \param[in] cfg    Link settings to save.
+ *
+ * \return 0 if settings were saved, -1 otherwise.
+ ****************************************************************************/
+int LinkCfgSave(const char *serial, const ScLinkCfg *cfg);
+
+#endif /*_LINKCFG_H_*/
+
+/** \} */
+
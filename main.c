@@ -20,6 +20,7 @@
 #else
 #include <sys/ioctl.h>
 #include <signal.h>
+#include <unistd.h>
 #endif
 
 #include <stdint.h>
@@ -28,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <string.h>
 
 #include <glib.h>
 
@@ -35,6 +37,16 @@
 #include "cmd.h"
 #include "avrflash.h"
 #include "latticeflash.h"
+#include "autotune.h"
+#include "gang.h"
+#include "outbuf.h"
+#include "inbuf.h"
+#include "stats.h"
+#include "flightrec.h"
+#include "flashdb.h"
+#ifdef SC_SIM
+#include "progsim.h"
+#endif
 
 /// Major version of the program
 #define VERSION_MAJOR	0x00
@@ -58,6 +70,28 @@
 /// Return value for Erase operation error
 #define PROG_ERASE_FULL	0xFFFFFF
 
+/// Maximum number of sectors to erase on each flash chip
+#define PROG_SECT_MAX	(CMD_BATCH_MAX / 2)
+
+/// CHR flash read length when not specified, if the chip is unknown
+#define PROG_CHR_LEN	(256 * 1024)
+/// PRG flash read length when not specified, if the chip is unknown
+#define PROG_PRG_LEN	(512 * 1024)
+
+/** \addtogroup FlashModes
+ *  \brief How images are flashed.
+ *  \{ */
+/// Flash the image, the flash must have been erased
+#define PROG_FLASH_ERASED	0
+/// Erase the sectors covered by the image, and flash it
+#define PROG_FLASH_SECT		1
+/// Only erase and flash the sectors that differ from the image
+#define PROG_FLASH_DELTA	2
+/** \} */
+
+/// Default minimum length of the 0xFF runs not written to erased flash
+#define PROG_BLANK_RUN	64
+
 /// SRAM base address
 #define PROG_SRAM_BASE	0x6000
 /// SRAM length
@@ -79,19 +113,6 @@
 /// Path to the FPGA programmer program/script
 #define LATT_PROG_PATH		"/usr/local/diamond/3.7_x64/bin/lin64/pgrcmd"
 
-/// Copies the specified address to a byte array field
-#define CMD_SET_ADDR(field, addr)	do{	\
-	(field)[0] = (addr)>>16;			\
-	(field)[1] = (addr)>>8;				\
-	(field)[2] = (addr);				\
-}while(0)
-
-/// Copies the command length to the specified byte array field
-#define CMD_SET_LEN(field, len)	do{	\
-	(field)[0] = (len)>>8;			\
-	(field)[1] = (len);				\
-}while(0)
-
 /// Printf-like macro that prints only if condition is TRUE.
 #define CondPrintf(cond, ...)	do{if(cond) printf(__VA_ARGS__);}while(0)
 
@@ -106,6 +127,19 @@ typedef struct {
 	uint32_t len;	///< Length of the memory image
 } MemImage;
 
+/// Progress bar state for memory transfers
+typedef struct {
+	uint32_t addr;		///< Transfer start address
+	uint32_t len;		///< Transfer length
+	unsigned int cols;	///< Terminal columns
+} ProgState;
+
+/// List of flash sectors to erase
+typedef struct {
+	uint32_t addr[PROG_SECT_MAX];	///< Address of each sector
+	int count;						///< Number of sectors in the list
+} SectList;
+
 /// Supported option flags
 typedef union {
 	uint32_t all;				///< Access to all flags
@@ -117,6 +151,11 @@ typedef union {
 		uint8_t chrErase:1;		///< Erase CHR flash
 		uint8_t prgErase:1;		///< Erase PRG flash
 		uint8_t dry:1;			///< Dry run
+		uint8_t autotune:1;		///< Tune link settings
+		uint8_t gang:1;			///< Program carts on all programmers
+		uint8_t stats:1;		///< Print performance statistics at exit
+		uint8_t delta:1;		///< Only rewrite flash sectors that differ
+		uint8_t sectErase:1;	///< Only erase flash sectors to write
 	};
 } Flags;
 
@@ -144,6 +183,15 @@ const static struct option opt[] = {
         {"firm-flash",  required_argument,  NULL,   'F'},
         {"mpsse-if",    required_argument,  NULL,   'm'},
         {"mapper",      required_argument,  NULL,   'M'},
+        {"autotune",    no_argument,        NULL,   'A'},
+        {"gang",        required_argument,  NULL,   'g'},
+        {"trace-out",   required_argument,  NULL,   't'},
+        {"replay",      required_argument,  NULL,   'y'},
+        {"replay-fast", required_argument,  NULL,   'Y'},
+        {"stats",       no_argument,        NULL,   'T'},
+        {"trace-json",  required_argument,  NULL,   'j'},
+        {"delta",       no_argument,        NULL,   'D'},
+        {"erase-auto",  no_argument,        NULL,   'k'},
 		{"dry-run",     no_argument,		NULL,   'd'},
         {"version",     no_argument,        NULL,   'r'},
         {"verbose",     no_argument,        NULL,   'v'},
@@ -160,8 +208,8 @@ const static char *description[] = {
 	"Read PRG ROM to file",
 	"Erase CHR Flash",
 	"Erase PRG Flash",
-	"Erase CHR flash sector",
-	"Erase PRG flash sector",
+	"Erase CHR flash sectors (comma separated list)",
+	"Erase PRG flash sectors (comma separated list)",
 	"Verify flash after writing file",
 	"Obtain flash chips identifiers",
 	"Read data from RAM chip",
@@ -171,27 +219,57 @@ const static char *description[] = {
 	"Flash programmer firmware",
 	"Set MPSSE interface number",
 	"Set mapper: 1-NOROM, 2-MMC3, 3-NFROM",
+	"Find and store fastest link settings (cart needed)",
+	"Gang mode: program carts using all programmers (arg: number of "
+		"carts, 0 for one per programmer)",
+	"Record programmer traffic to a trace file",
+	"Replay a trace file instead of using a programmer, with recorded timing",
+	"Replay a trace file instead of using a programmer, as fast as possible",
+	"Print latency histograms and throughput counters at exit",
+	"Write a timeline of the session, in Chrome trace event format",
+	"Only erase and flash the sectors that differ from the cart contents",
+	"Erase only the flash sectors covered by the flashed files",
 	"Dry run: don't actually do anything",
 	"Show program version",
 	"Show additional information",
 	"Print help screen and exit"
 };
 
+/// Flash chips of the cart, NULL if not detected or unknown
+static const FlashChip *progFlash[PROG_CHIP_MAX + 1];
+
 /*
  * PRIVATE FUNCTIONS
  */
 
 #ifndef __OS_WIN
 /************************************************************************//**
- * Signal handler that restores cursor and aborts program.
+ * Writes a string from a signal handler, where stdio cannot be used.
+ *
+ * \param[in] fd  File descriptor to write to.
+ * \param[in] str String to write.
+ ****************************************************************************/
+static void SigPuts(int fd, const char *str) {
+	ssize_t ret = write(fd, str, strlen(str));
+
+	(void)ret;
+}
+
+/************************************************************************//**
+ * Signal handler that writes the flight recorder records, restores cursor
+ * and aborts program. Only async-signal-safe functions are used.
  * 
  * \param[in] sig Received signal causing abortion.
  ****************************************************************************/
 static void Terminate(int sig) {
-	PrintErr("Caught signal %d, aborting...\n", sig);
+	int term = (SIGTERM == sig);
+
+	SigPuts(STDERR_FILENO, term?"Caught SIGTERM, aborting...\n":
+			"Caught SIGINT, aborting...\n");
+	FlightRecDumpSignal(term?"caught SIGTERM":"caught SIGINT");
 	// Restore default cursor
-	printf("\e[?25h");
-	exit(1);
+	SigPuts(STDOUT_FILENO, "\e[?25h");
+	_exit(1);
 }
 #endif
 
@@ -311,263 +389,682 @@ static void PrintMemError(int code) {
 }
 
 /************************************************************************//**
- * Obtain programmer firmware version:
+ * Draws the progress bar of a memory transfer. Called each time a chunk
+ * completes.
  *
- * \return 0 on success, less than 0 on error.
+ * \param[in] done Number of bytes transferred.
+ * \param[in] ctx  Progress bar state (ProgState).
+ ****************************************************************************/
+static void ProgDraw(uint32_t done, void *ctx) {
+	ProgState *prog = (ProgState*)ctx;
+	// Address string, e.g.: 0x123456
+	char addrStr[9];
+
+	sprintf(addrStr, "0x%06X", prog->addr + done);
+	ProgBarDraw(done, prog->len, prog->cols, addrStr);
+	fflush(stdout);
+}
+
+/************************************************************************//**
+ * Queues the request of the programmer firmware version.
+ *
+ * \param[inout] batch Command batch to which the request is added.
+ *
+ * \return Index of the request in the batch, less than 0 on error.
  ****************************************************************************/
-static int ProgFwGet(void) {
+static int ProgFwAdd(CmdBatch *batch) {
 	Cmd cmd;
-	CmdRep *rep;
+	const CmdProto *proto = CmdProtoGet();
 
-	cmd.command = CMD_FW_VER;
+	// Request the already negotiated protocol, to keep it in use
+	cmd.fwVer.cmd = CMD_FW_VER;
+	cmd.fwVer.proto = proto->proto;
+	cmd.fwVer.features = proto->features;
+
+	return CmdBatchAdd(batch, &cmd, sizeof(CmdFwVer));
+}
 
-	if (CmdSend(&cmd, 1, &rep) < 0) return -1;
+/************************************************************************//**
+ * Prints programmer firmware version and negotiated protocol.
+ *
+ * \param[in] rep Reply to the request queued with ProgFwAdd().
+ *
+ * \return 0 on success, less than 0 on error.
+ ****************************************************************************/
+static int ProgFwPrint(const CmdRep *rep) {
+	const CmdProto *proto = CmdProtoGet();
 
+	if (rep->fwVer.code != CMD_REP_OK) return -1;
 	printf("Awesome MOJO-NES programmer firmware: %d.%d\n",
 			rep->fwVer.ver_major, rep->fwVer.ver_minor);
-	CmdRepFree(rep);
+	printf("Protocol v%d, %d byte frames%s%s%s%s.\n", proto->proto,
+			proto->maxFrame, (proto->features & CMD_PROTO_F_BULK)?
+			", bulk transfers":"", (proto->features & CMD_PROTO_F_CRC)?
+			", CRC protected":"", (proto->features & CMD_PROTO_F_DUPLEX)?
+			", full duplex":"", (proto->features & CMD_PROTO_F_READY)?
+			", ready line":"");
+	if (proto->features & CMD_PROTO_F_PIPE)
+		printf("Up to %d pipelined requests.\n", proto->window);
+	if (proto->caps) {
+		printf("Capabilities:");
+		if (proto->caps & CMD_CAP_BATCH) printf(" batched commands");
+		if (proto->caps & CMD_CAP_RLE) printf("%s compressed writes",
+				(proto->caps & CMD_CAP_BATCH)?",":"");
+		if (proto->caps & CMD_CAP_LOOP) printf("%s loopback",
+				(proto->caps & (CMD_CAP_BATCH | CMD_CAP_RLE))?",":"");
+		printf(".\n");
+	}
 	return 0;
 }
 
 /************************************************************************//**
- * Obtain flash chip identifiers of the inserted cart.
+ * Queues the request of the flash chip identifiers of the inserted cart.
  *
- * \return 0 on success, less than 0 on error.
+ * \param[inout] batch Command batch to which the request is added.
+ *
+ * \return Index of the request in the batch, less than 0 on error.
  ****************************************************************************/
-static int ProgFIdGet(void) {
+static int ProgFIdAdd(CmdBatch *batch) {
 	Cmd cmd;
-	CmdRep *rep;
 
 	cmd.command = CMD_FLASH_ID;
 
-	if (CmdSend(&cmd, 1, &rep) < 0) return -1;
+	return CmdBatchAdd(batch, &cmd, 1);
+}
 
+/************************************************************************//**
+ * Prints flash chip identifiers of the inserted cart.
+ *
+ * \param[in] rep Reply to the request queued with ProgFIdAdd().
+ *
+ * \return 0 on success, less than 0 on error.
+ ****************************************************************************/
+static int ProgFIdPrint(const CmdRep *rep) {
+	if (rep->fId.code != CMD_REP_OK) return -1;
 	printf("CHR --> ManID: 0x%02X. DevID: 0x%02X:%02X:%02X\n", rep->fId.chr.manId,
 			rep->fId.chr.devId[0], rep->fId.chr.devId[1],
 			rep->fId.chr.devId[2]);
 	printf("PRG --> ManID: 0x%02X. DevID: 0x%02X:%02X:%02X\n", rep->fId.prg.manId,
 			rep->fId.prg.devId[0], rep->fId.prg.devId[1],
 			rep->fId.prg.devId[2]);
-	CmdRepFree(rep);
 	return 0;
 }
 
 /************************************************************************//**
- * Erases specified flash.
+ * Looks up the flash chips of the inserted cart in the flash chip database,
+ * so their geometry and timing are used to plan erases, set default read
+ * lengths and estimate operation times. The geometry of unknown chips is
+ * not guessed: erase planning and delta flashing are not supported on them,
+ * and blank runs are only skipped if the entire chip is erased.
  *
- * \param[in] chip Flash chip to erase.
- * \param[in] addr Address of the sector to erase.
+ * \param[in] rep   Reply to the request queued with ProgFIdAdd().
+ * \param[in] print Print the chips found.
+ ****************************************************************************/
+static void ProgFlashDetect(const CmdRep *rep, int print) {
+	const CmdFlashId *id[PROG_CHIP_MAX + 1] = {&rep->fId.chr, &rep->fId.prg};
+	const FlashChip *fc;
+	int chip;
+
+	if (rep->fId.code != CMD_REP_OK) {
+		printf("WARNING: Couldn't get flash IDs, flash chips unknown!\n");
+		return;
+	}
+	for (chip = 0; chip <= PROG_CHIP_MAX; chip++) {
+		fc = progFlash[chip] = FlashDbFind(id[chip]);
+		if (!print) continue;
+		if (fc) printf("%s flash: %s, %u KiB, %u byte pages.\n",
+				chip?"PRG":"CHR", fc->name, FlashDbLen(fc) / 1024, fc->page);
+		else printf("%s flash: unknown.\n", chip?"PRG":"CHR");
+	}
+}
+
+/************************************************************************//**
+ * Sets the length of a flash read not specifying it, to read up to the end
+ * of the flash chip.
  *
- * \return 0 on success, less than 0 on error.
+ * \param[in]    chip Flash chip to read.
+ * \param[inout] f    Memory image with the range to read.
  ****************************************************************************/
-static int ProgFlashErase(uint8_t chip, uint32_t addr) {
-	Cmd cmd;
-	CmdRep *rep;
+static void ProgReadLen(uint8_t chip, MemImage *f) {
+	uint32_t len = chip?PROG_PRG_LEN:PROG_CHR_LEN;
 
-	cmd.rdWr.cmd = CMD_CHR_ERASE + chip;
-	CMD_SET_ADDR(cmd.rdWr.addr, addr);
+	if (f->len) return;
+	if (progFlash[chip]) len = FlashDbLen(progFlash[chip]);
+	if (f->addr < len) f->len = len - f->addr;
+}
 
-	if (CmdSend(&cmd, 4, &rep) < 0) return -1;
-	CmdRepFree(rep);
-	return 0;
+/************************************************************************//**
+ * Prints the estimated time of an operation, if known.
+ *
+ * \param[in] ms Estimated time in milliseconds, 0 if unknown.
+ ****************************************************************************/
+static void ProgEtaPrint(uint32_t ms) {
+	if (ms) printf(" (about %.1f s)", ms / 1000.0);
 }
 
 /************************************************************************//**
- * Allocates a RAM buffer, reads the specified MemImage file, and writes it
- * to the specified flash chip.
+ * Estimates the time taken to flash data, from the typical program time of
+ * the flash chip and the time taken to send the data to the programmer.
+ * Pipelined requests send the next chunks while the previous ones are
+ * being programmed, so the slowest of both is taken.
  *
  * \param[in] chip Flash chip to program.
- * \param[in] f    Memory image to program to specified chip.
- * \param[in] cols Number of columns of the terminal, used to draw the
- *                 status bar.
+ * \param[in] len  Length of the data.
  *
- * \return Pointer to the raw data of the allocated and flashed image file,
- *         or NULL if error occurred.
+ * \return Estimated time in milliseconds, 0 if the chip is unknown.
+ ****************************************************************************/
+static uint32_t ProgFlashMs(uint8_t chip, uint32_t len) {
+	ScLinkCfg link;
+	uint32_t ms;
+
+	if (!(ms = FlashDbProgMs(progFlash[chip], len))) return 0;
+	CmdLinkGet(&link);
+	if (link.clk) ms = MAX(ms, (uint64_t)len * 8 * 1000 / link.clk);
+	return ms;
+}
+
+/************************************************************************//**
+ * Queues the erase of a flash chip or sector.
  *
- * \warning Buffer must be externally deallocated when no longer needed,
- *          using free().
+ * \param[inout] batch Command batch to which the request is added.
+ * \param[in]    chip Flash chip to erase.
+ * \param[in]    addr Address of the sector to erase, or PROG_ERASE_FULL to
+ *               erase the entire chip.
+ *
+ * \return Index of the request in the batch, less than 0 on error.
  ****************************************************************************/
-static uint8_t *AllocAndFlash(uint8_t chip, MemImage *f, unsigned int cols) {
-    FILE *rom;
-	uint8_t *writeBuf;
-	uint32_t addr;
-	int toWrite;
-	uint32_t i;
+static int ProgEraseAdd(CmdBatch *batch, uint8_t chip, uint32_t addr) {
 	Cmd cmd;
-	CmdRep *rep = NULL;
 
-	// Address string, e.g.: 0x123456
-	char addrStr[9];
+	cmd.erase.cmd = CMD_CHR_ERASE + chip;
+	CMD_SET_ADDR(cmd.erase.sectAddr, addr);
 
-	if (chip > PROG_CHIP_MAX) return NULL;
+	return CmdBatchAdd(batch, &cmd, sizeof(CmdErase));
+}
 
-	if (!(rom = fopen(f->file, "rb"))) {
-		perror(f->file);
-		return NULL;
+/************************************************************************//**
+ * Runs a batch of erase requests queued with ProgEraseAdd(), and reports
+ * the failed ones.
+ *
+ * \param[inout] batch Command batch with the erase requests.
+ *
+ * \return 0 on success, less than 0 on error.
+ ****************************************************************************/
+static int ProgEraseRun(CmdBatch *batch) {
+	const FlashChip *fc;
+	CmdRep *rep;
+	uint32_t addr, ms = 0;
+	unsigned int i;
+	int err = 0;
+
+	// Estimate the erase time, unless a chip is unknown
+	for (i = 0; i < batch->count; i++) {
+		if (!(fc = progFlash[batch->cmd[i].command - CMD_CHR_ERASE])) {
+			ms = 0;
+			break;
+		}
+		addr = CMD_GET_ADDR(batch->cmd[i].erase.sectAddr);
+		ms += (PROG_ERASE_FULL == addr)?fc->chipMs:fc->sectMs;
+	}
+	printf("Erasing %d flash %s", batch->count,
+			batch->count > 1?"regions":"region");
+	ProgEtaPrint(ms);
+	printf("... ");
+	fflush(stdout);
+	if (CmdBatchRun(batch, &rep) != CMD_OK) {
+		putchar('\n');
+		return -1;
 	}
+	for (i = 0; i < batch->count; i++) {
+		if (rep[i].command == CMD_REP_OK) continue;
+		if (!err) putchar('\n');
+		addr = CMD_GET_ADDR(batch->cmd[i].erase.sectAddr);
+		if (addr == PROG_ERASE_FULL) {
+			PrintErr("%s chip erase ERROR!\n", (batch->cmd[i].command ==
+						CMD_CHR_ERASE)?"CHR":"PRG");
+		} else {
+			PrintErr("%s sector erase at 0x%06X ERROR!\n",
+					(batch->cmd[i].command == CMD_CHR_ERASE)?"CHR":"PRG",
+					addr);
+		}
+		err = -1;
+	}
+	if (!err) printf("OK!\n");
+	return err;
+}
 
-	// Obtain length if not specified
-	if (!f->len) {
+/************************************************************************//**
+ * Parses a comma separated list of sector addresses, and appends them to
+ * a sector list.
+ *
+ * \param[in]    arg List of sector addresses, in hexadecimal.
+ * \param[inout] list Sector list to which addresses are appended.
+ *
+ * \return 0 if success, non-zero on error.
+ ****************************************************************************/
+static int ParseSectList(const char *arg, SectList *list) {
+	char *endPtr;
 
-	    fseek(rom, 0, SEEK_END);
-	    f->len = ftell(rom);
-	    fseek(rom, 0, SEEK_SET);
+	while (*arg) {
+		if (list->count >= PROG_SECT_MAX) return 1;
+		list->addr[list->count++] = strtoul(arg, &endPtr, 16);
+		if (endPtr == arg) return 2;
+		if (*endPtr == ',') endPtr++;
+		else if (*endPtr) return 2;
+		arg = endPtr;
 	}
 
-    writeBuf = malloc(f->len);
-	if (!writeBuf) {
-		perror("Allocating write buffer");
-		fclose(rom);
-		return NULL;
+	return 0;
+}
+
+/************************************************************************//**
+ * Queues the erase of a flash chip, or of a list of its sectors.
+ *
+ * \param[inout] batch Command batch to which the requests are added.
+ * \param[in]    chip  Flash chip to erase.
+ * \param[in]    full  Erase the entire chip. If TRUE, sect is ignored.
+ * \param[in]    sect  List of sectors to erase.
+ ****************************************************************************/
+static void ProgSectAdd(CmdBatch *batch, uint8_t chip, uint8_t full,
+		const SectList *sect) {
+	int i;
+
+	if (full) ProgEraseAdd(batch, chip, PROG_ERASE_FULL);
+	else for (i = 0; i < sect->count; i++)
+		ProgEraseAdd(batch, chip, sect->addr[i]);
+}
+
+/************************************************************************//**
+ * Checks the geometry of a flash chip is known, as required to plan sector
+ * erases.
+ *
+ * \param[in] chip Flash chip to check.
+ *
+ * \return 0 if the chip geometry is known, -1 otherwise.
+ ****************************************************************************/
+static int ProgGeometryCheck(uint8_t chip) {
+	if (progFlash[chip]) return 0;
+	PrintErr("Unknown %s flash chip, cannot plan sector erases! Define it "
+			"in a [CHIP <name>] configuration file group.\n",
+			chip?"PRG":"CHR");
+	return -1;
+}
+
+/************************************************************************//**
+ * Checks if all the flash sectors covered by an image are erased before it
+ * is flashed, so its blank bytes do not have to be written.
+ *
+ * \param[in] chip Flash chip to program.
+ * \param[in] f    Memory image to flash.
+ * \param[in] full The entire chip is erased.
+ * \param[in] sect List of sectors erased.
+ *
+ * \return TRUE if all the sectors covered by the image are erased, FALSE
+ *         otherwise, or if the chip is unknown and not entirely erased.
+ ****************************************************************************/
+static int ProgErased(uint8_t chip, const MemImage *f, uint8_t full,
+		const SectList *sect) {
+	uint32_t addr, start, len;
+	int i;
+
+	if (full) return TRUE;
+	for (addr = f->addr; addr < f->addr + f->len; addr = start + len) {
+		if (!(len = FlashDbSect(progFlash[chip], addr, &start)))
+			return FALSE;
+		for (i = 0; (i < sect->count) && ((sect->addr[i] < start) ||
+					(sect->addr[i] >= start + len)); i++);
+		if (i == sect->count) return FALSE;
 	}
-	// Read the entire ROM and close file
-    if (1 > fread(writeBuf, f->len, 1, rom)) {
-		fclose(rom);
-		free(writeBuf);
-		PrintErr("Error reading ROM file!\n");
-		return NULL;
+	return TRUE;
+}
+
+/************************************************************************//**
+ * Loads the specified MemImage file to an input buffer, mapped in memory if
+ * possible, so it is read as it is written to the cart. If the MemImage
+ * length is 0, it is set to the file length.
+ *
+ * \param[inout] f  Memory image with the file to load.
+ * \param[out]   ib Input buffer to load.
+ *
+ * \return Pointer to the loaded data, or NULL if error occurred.
+ *
+ * \warning Buffer must be externally deallocated when no longer needed,
+ *          using InBufFree().
+ ****************************************************************************/
+static uint8_t *ImageLoad(MemImage *f, InBuf *ib) {
+	if (!InBufLoad(ib, f->file, f->len)) return NULL;
+	f->len = ib->len;
+
+	return ib->data;
+}
+
+/************************************************************************//**
+ * Reads a flash range, drawing its progress bar.
+ *
+ * \param[in]  chip Flash chip to read.
+ * \param[in]  addr Address of the first byte to read.
+ * \param[out] buf  Buffer for the read data.
+ * \param[in]  len  Length of the range. Nothing is read if 0.
+ * \param[in]  cols Number of columns of the terminal, used to draw the
+ *                  status bar.
+ *
+ * \return 0 on success, less than 0 on error.
+ ****************************************************************************/
+static int ProgRangeRead(uint8_t chip, uint32_t addr, uint8_t *buf,
+		uint32_t len, unsigned int cols) {
+	CmdRep *rep = NULL;
+	ProgState prog;
+
+	if (!len) return 0;
+	prog.addr = addr;
+	prog.len = len;
+	prog.cols = cols;
+	if (CmdPipeRead(CMD_CHR_READ + chip, addr, buf, len, &rep, ProgDraw,
+				&prog) != CMD_OK) {
+		PrintErr("CMD response: %d. Couldn't read from cart!\n",
+				rep->command);
+		CmdRepFree(rep);
+		return -1;
 	}
-	fclose(rom);
+	CmdRepFree(rep);
+	putchar('\n');
+	return 0;
+}
 
-   	printf("Flashing %s ROM %s starting at 0x%06X...\n", chip?"PRG":"CHR",
-			f->file, f->addr);
+/************************************************************************//**
+ * Flashes an image, only erasing the flash sectors it covers, instead of
+ * the entire chip. Sectors are taken from the flash chip geometry, so they
+ * can have different lengths. The parts of the boundary sectors the image
+ * does not cover are read before erasing them, and written back along with
+ * the image.
+ *
+ * In delta mode, all the sectors covered by the image are read and compared
+ * with it, and only the ones that differ are erased and written.
+ *
+ * \param[in] chip  Flash chip to program.
+ * \param[in] f     Memory image to program to specified chip.
+ * \param[in] data  Image data.
+ * \param[in] cols  Number of columns of the terminal, used to draw the
+ *                  status bar.
+ * \param[in] delta Only erase and write the sectors that differ.
+ * \param[in] blank Minimum length of the 0xFF runs not written to the
+ *                  erased sectors, 0 to write them.
+ *
+ * \return 0 on success, less than 0 on error.
+ ****************************************************************************/
+static int ProgSectFlash(uint8_t chip, const MemImage *f,
+		const uint8_t *data, unsigned int cols, int delta, uint32_t blank) {
+	const char *name = chip?"PRG":"CHR";
+	uint32_t start, end, len, sects = 0;
+	uint32_t i, j, from, to, diff = 0;
+	uint32_t *bound;
+	uint8_t *buf, *differs;
+	CmdRep *rep = NULL;
+	CmdBatch batch;
+	ProgState prog;
+	uint64_t phase;
+	int err = -1;
+
+	if (ProgGeometryCheck(chip)) return -1;
+	// Find the sectors covered by the image, that must fit in the chip
+	FlashDbSect(progFlash[chip], f->addr, &start);
+	for (end = start; end < f->addr + f->len; end += len, sects++)
+		len = FlashDbSect(progFlash[chip], end, &from);
+	buf = malloc(end - start);
+	differs = calloc(sects, 1);
+	// Sector boundaries: sector i spans from bound[i] to bound[i + 1]
+	bound = malloc((sects + 1) * sizeof(uint32_t));
+	if (!buf || !differs || !bound) {
+		perror("Allocating sector buffer");
+		goto out;
+	}
+	for (i = 0, bound[0] = start; i < sects; i++)
+		bound[i + 1] = bound[i] + FlashDbSect(progFlash[chip], bound[i],
+				&from);
+
+	phase = StatsStart();
+	if (delta) {
+		// Read the sectors covered by the image
+		printf("Comparing %s ROM %s with cart sectors 0x%06X-0x%06X...\n",
+				name, f->file, start, end - 1);
+		if (ProgRangeRead(chip, start, buf, end - start, cols)) goto out;
+	} else {
+		// Read the parts of the boundary sectors not covered by the image
+		printf("%s ROM %s covers sectors 0x%06X-0x%06X.\n", name,
+				f->file, start, end - 1);
+		if (ProgRangeRead(chip, start, buf, f->addr - start, cols) ||
+				ProgRangeRead(chip, f->addr + f->len,
+					buf + f->addr + f->len - start,
+					end - f->addr - f->len, cols)) goto out;
+	}
+	// Merge the image with the sectors that differ (all of them if not in
+	// delta mode)
+	for (i = 0; i < sects; i++) {
+		from = MAX(bound[i], f->addr);
+		to = MIN(bound[i + 1], f->addr + f->len);
+		if (!delta || memcmp(buf + from - start, data + from - f->addr,
+					to - from)) {
+			memcpy(buf + from - start, data + from - f->addr, to - from);
+			differs[i] = TRUE;
+			diff++;
+		}
+	}
+	if (delta) {
+		StatsSpan(chip?"PRG compare":"CHR compare", phase, StatsNow());
+		printf("%u of %u %s sectors differ.\n", diff, sects, name);
+	}
+	if (!diff) {
+		err = 0;
+		goto out;
+	}
 
-	// Send flash command to programmer
-	cmd.rdWr.cmd = CMD_CHR_WRITE + chip;
-	for (i = 0, addr = f->addr; i < f->len;) {
-		toWrite = MIN(32768, f->len - i);
-		CMD_SET_ADDR(cmd.rdWr.addr, addr);
-		CMD_SET_LEN(cmd.rdWr.len, toWrite);
-		if ((CmdSendLongCmd(&cmd, sizeof(CmdRdWrHdr), writeBuf + i,
-				toWrite, &rep) != CMD_OK) || (rep->command != CMD_OK)) {
+	// Erase the sectors that differ, in as few batches as possible
+	phase = StatsStart();
+	CmdBatchInit(&batch);
+	for (i = 0; i < sects; i++) {
+		if (!differs[i]) continue;
+		ProgEraseAdd(&batch, chip, bound[i]);
+		if ((CMD_BATCH_MAX == batch.count) || (diff == batch.count)) {
+			if (ProgEraseRun(&batch)) goto out;
+			diff -= batch.count;
+			CmdBatchInit(&batch);
+		}
+	}
+	StatsSpan("Erase", phase, StatsNow());
+
+	// Write each run of consecutive sectors that differ
+	phase = StatsStart();
+	prog.cols = cols;
+	for (i = 0; i < sects; i = j) {
+		if (!differs[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; (j < sects) && differs[j]; j++);
+		prog.addr = bound[i];
+		prog.len = bound[j] - bound[i];
+		printf("Flashing %s ROM sectors 0x%06X-0x%06X", name, prog.addr,
+				prog.addr + prog.len - 1);
+		ProgEtaPrint(ProgFlashMs(chip, prog.len));
+		printf("...\n");
+		if (CmdPipeWriteSparse(CMD_CHR_WRITE + chip, prog.addr,
+					buf + prog.addr - start, prog.len, blank, &rep, ProgDraw,
+					&prog) != CMD_OK) {
 			PrintErr("CMD response: %d. Couldn't write to cart!\n",
 					rep->command);
-			if (rep) CmdRepFree(rep);
-			free(writeBuf);
+			goto out;
+		}
+		CmdRepFree(rep);
+		rep = NULL;
+		putchar('\n');
+	}
+	StatsSpan(chip?"PRG flash":"CHR flash", phase, StatsNow());
+	err = 0;
+
+out:
+	if (rep) CmdRepFree(rep);
+	free(bound);
+	free(differs);
+	free(buf);
+	return err;
+}
+
+/************************************************************************//**
+ * Loads the specified MemImage file to an input buffer, and writes it to
+ * the specified flash chip. Images not fitting in the detected chip are
+ * rejected.
+ *
+ * \param[in] chip  Flash chip to program.
+ * \param[in] f     Memory image to program to specified chip.
+ * \param[in] cols  Number of columns of the terminal, used to draw the
+ *                  status bar.
+ * \param[in] mode  How the image is flashed (PROG_FLASH_*). With
+ *                  PROG_FLASH_ERASED, the flash must have been erased
+ *                  before.
+ * \param[in] full  The entire chip was erased (PROG_FLASH_ERASED mode).
+ * \param[in] sect  Sectors erased (PROG_FLASH_ERASED mode).
+ * \param[in] blank Minimum length of the 0xFF runs not written, if all
+ *                  the sectors covered by the image were erased (always
+ *                  in the other modes). 0 to write all the image.
+ * \param[out] ib   Input buffer to load the image file to.
+ *
+ * \return Pointer to the raw data of the loaded and flashed image file,
+ *         or NULL if error occurred.
+ *
+ * \warning Buffer must be externally deallocated when no longer needed,
+ *          using InBufFree().
+ ****************************************************************************/
+static uint8_t *AllocAndFlash(uint8_t chip, MemImage *f, unsigned int cols,
+		int mode, uint8_t full, const SectList *sect, uint32_t blank,
+		InBuf *ib) {
+	uint8_t *writeBuf;
+	CmdRep *rep = NULL;
+	ProgState prog;
+	uint64_t start;
+
+	if (chip > PROG_CHIP_MAX) return NULL;
+	if (!(writeBuf = ImageLoad(f, ib))) return NULL;
+	if (progFlash[chip] &&
+			((uint64_t)f->addr + f->len > FlashDbLen(progFlash[chip]))) {
+		PrintErr("%s ROM %s does not fit in the %s flash chip!\n",
+				chip?"PRG":"CHR", f->file, progFlash[chip]->name);
+		InBufFree(ib);
+		return NULL;
+	}
+	// Write chunks are aligned to the flash chip pages
+	CmdPageSet(progFlash[chip]?progFlash[chip]->page:0);
+
+	if (PROG_FLASH_ERASED != mode) {
+		if (ProgSectFlash(chip, f, writeBuf, cols,
+					PROG_FLASH_DELTA == mode, blank)) {
+			InBufFree(ib);
 			return NULL;
 		}
+		return writeBuf;
+	}
+
+   	printf("Flashing %s ROM %s starting at 0x%06X", chip?"PRG":"CHR",
+			f->file, f->addr);
+	ProgEtaPrint(ProgFlashMs(chip, f->len));
+	printf("...\n");
+
+	// Send flash commands to programmer, drawing progress bar
+	prog.addr = f->addr;
+	prog.len = f->len;
+	prog.cols = cols;
+	// Blank bytes are only skipped on flash known to be erased
+	if (!ProgErased(chip, f, full, sect)) blank = 0;
+	start = StatsStart();
+	if (CmdPipeWriteSparse(CMD_CHR_WRITE + chip, f->addr, writeBuf, f->len,
+				blank, &rep, ProgDraw, &prog) != CMD_OK) {
+		PrintErr("CMD response: %d. Couldn't write to cart!\n",
+				rep->command);
 		CmdRepFree(rep);
-		// Update vars and draw progress bar
-		i += toWrite;
-		addr += toWrite;
-   	    sprintf(addrStr, "0x%06X", addr);
-   	    ProgBarDraw(i, f->len, cols, addrStr);
+		InBufFree(ib);
+		return NULL;
 	}
+	CmdRepFree(rep);
+	StatsSpan(chip?"PRG flash":"CHR flash", start, StatsNow());
    	putchar('\n');
 	return writeBuf;
 }
 
 
 /************************************************************************//**
- * Allocates a RAM buffer, and reads range specified in MemImage input
- * from the specified Flash chip to the allocated buffer.
+ * Allocates an output buffer, and reads range specified in MemImage input
+ * from the specified Flash chip to the allocated buffer. If the MemImage
+ * has a file, data is read directly into the file, mapped in memory.
  *
- * \param[in] chip Flash chip to read.
- * \param[in] f    Memory image with the range to read.
- * \param[in] cols Number of columns of the terminal, used to draw the
- *                 status bar.
+ * \param[in]  chip Flash chip to read.
+ * \param[in]  f    Memory image with the range to read.
+ * \param[in]  cols Number of columns of the terminal, used to draw the
+ *                  status bar.
+ * \param[out] ob   Output buffer to allocate.
  *
  * \return Pointer to the raw data of the allocated and read image file,
  *         or NULL if error occurred.
  *
  * \warning Buffer must be externally deallocated when no longer needed,
- *          using free().
+ *          using OutBufFree().
  ****************************************************************************/
-uint8_t *AllocAndRead(uint8_t chip, MemImage *f, unsigned int cols) {
+uint8_t *AllocAndRead(uint8_t chip, MemImage *f, unsigned int cols,
+		OutBuf *ob) {
 	uint8_t *readBuf;
-	int toRead;
-	uint32_t addr;
-	uint32_t i;
-	// Address string, e.g.: 0x123456
-	char addrStr[9];
-	Cmd cmd;
 	CmdRep *rep = NULL;
+	ProgState prog;
+	uint64_t start;
 
 	if (chip > PROG_CHIP_MAX) return NULL;
 
-	readBuf = malloc(f->len);
-	if (!readBuf) {
-		perror("Allocating read buffer");
-		return NULL;
-	}
+	if (!(readBuf = OutBufAlloc(ob, f->file, f->len))) return NULL;
 	printf("Reading %s ROM starting at 0x%06X...\n", chip?"PRG":"CHR",
 			f->addr);
 
 	fflush(stdout);
-	cmd.rdWr.cmd = CMD_CHR_READ + chip;
-	for (i = 0, addr = f->addr; i < f->len;) {
-		toRead = MIN(32768, f->len - i);
-		CMD_SET_ADDR(cmd.rdWr.addr, addr);
-		CMD_SET_LEN(cmd.rdWr.len, toRead);
-		if ((CmdSendLongRep(&cmd, sizeof(CmdRdWrHdr), &rep, readBuf + i,
-				toRead) != toRead) || (rep->command != CMD_OK)) {
-			PrintErr("CMD response: %d. Couldn't read from cart!\n", rep->command);
-			if (rep) CmdRepFree(rep);
-			free(readBuf);
-			return NULL;
-		}
+	prog.addr = f->addr;
+	prog.len = f->len;
+	prog.cols = cols;
+	start = StatsStart();
+	if (CmdPipeRead(CMD_CHR_READ + chip, f->addr, readBuf, f->len, &rep,
+				ProgDraw, &prog) != CMD_OK) {
+		PrintErr("CMD response: %d. Couldn't read from cart!\n", rep->command);
 		CmdRepFree(rep);
-		fflush(stdout);
-		// Update vars and draw progress bar
-		i += toRead;
-		addr += toRead;
-   	    sprintf(addrStr, "0x%06X", addr);
-   	    ProgBarDraw(i, f->len, cols, addrStr);
+		OutBufFree(ob);
+		return NULL;
 	}
+	CmdRepFree(rep);
+	StatsSpan(chip?"PRG read":"CHR read", start, StatsNow());
 	putchar('\n');
 	return readBuf;
 }
 
 /************************************************************************//**
- * Allocates a RAM buffer, reads the specified MemImage file, and writes it
- * to the in-cart RAM chip.
+ * Loads the specified MemImage file to an input buffer, and writes it to
+ * the in-cart RAM chip.
  *
- * \param[in] f    Memory image with the range to write and file to read.
+ * \param[in]  f  Memory image with the range to write and file to read.
+ * \param[out] ib Input buffer to load the file to.
  *
- * \return Pointer to the raw data of the allocated and read image file,
- *         or NULL if error occurred.
+ * \return Pointer to the raw data of the loaded and written file, or NULL
+ *         if error occurred.
  *
  * \warning Buffer must be externally deallocated when no longer needed,
- *          using free().
+ *          using InBufFree().
  ****************************************************************************/
-uint8_t *AllocAndRamWrite(MemImage *f) {
-    FILE *ram;
+uint8_t *AllocAndRamWrite(MemImage *f, InBuf *ib) {
 	uint8_t *writeBuf;
 	Cmd cmd;
 	CmdRep *rep = NULL;
+	uint64_t start;
 
-	// Check address and length are OK
+	if (!(writeBuf = ImageLoad(f, ib))) return NULL;
+	// Check address and length (of the file, if not specified) are OK
 	if ((PROG_SRAM_BASE > f->addr) ||
 			((PROG_SRAM_BASE + PROG_SRAM_LEN) < (f->addr + f->len))) {
-		PrintErr("Wrong RAM read address:length combination!\n");
-		return NULL;
-	}
-	if (!(ram = fopen(f->file, "rb"))) {
-		perror(f->file);
-		return NULL;
-	}
-
-	// Obtain length if not specified
-	if (!f->len) {
-	    fseek(ram, 0, SEEK_END);
-	    f->len = ftell(ram);
-	    fseek(ram, 0, SEEK_SET);
-	}
-
-    writeBuf = malloc(f->len);
-	if (!writeBuf) {
-		perror("Allocating write buffer RAM");
-		fclose(ram);
+		PrintErr("Wrong RAM write address:length combination!\n");
+		InBufFree(ib);
 		return NULL;
 	}
-	// Read the entire RAM file and close it.
-    if (1 > fread(writeBuf, f->len, 1, ram)) {
-		fclose(ram);
-		free(writeBuf);
-		PrintErr("Error reading RAM file!\n");
-		return NULL;
-	}
-	fclose(ram);
 
    	printf("Writing SRAM %s starting at 0x%04X... ", f->file, f->addr);
 
@@ -575,34 +1072,39 @@ uint8_t *AllocAndRamWrite(MemImage *f) {
 	cmd.rdWr.cmd = CMD_RAM_WRITE;
 	CMD_SET_ADDR(cmd.rdWr.addr, f->addr - PROG_SRAM_BASE);
 	CMD_SET_LEN(cmd.rdWr.len, f->len);
+	start = StatsStart();
 	if ((CmdSendLongCmd(&cmd, sizeof(CmdRdWrHdr), writeBuf,
-			f->len, &rep) != f->len) || (rep->command != CMD_OK)) {
+			f->len, &rep) != CMD_OK) || (rep->command != CMD_REP_OK)) {
 		if (rep) CmdRepFree(rep);
-		free(writeBuf);
+		InBufFree(ib);
 		PrintErr("Couldn't write to cart!\n");
 		return NULL;
 	}
 	CmdRepFree(rep);
+	StatsSpan("RAM write", start, StatsNow());
 	printf("OK!\n");
 	return writeBuf;
 }
 
 /************************************************************************//**
- * Allocates a RAM buffer, and reads range specified in MemImage input
- * from the in-cart RAM chip.
+ * Allocates an output buffer, and reads range specified in MemImage input
+ * from the in-cart RAM chip. If the MemImage has a file, data is read
+ * directly into the file, mapped in memory.
  *
- * \param[in] f    Memory image with the range to read.
+ * \param[in]  f  Memory image with the range to read.
+ * \param[out] ob Output buffer to allocate.
  *
  * \return Pointer to the raw data of the allocated and read image file,
  *         or NULL if error occurred.
  *
  * \warning Buffer must be externally deallocated when no longer needed,
- *          using free().
+ *          using OutBufFree().
  ****************************************************************************/
-uint8_t *AllocAndRamRead(MemImage *f) {
+uint8_t *AllocAndRamRead(MemImage *f, OutBuf *ob) {
 	uint8_t *readBuf;
 	Cmd cmd;
 	CmdRep *rep = NULL;
+	uint64_t start;
 
 	// Check address and length are OK
 	if ((PROG_SRAM_BASE > f->addr) ||
@@ -611,11 +1113,7 @@ uint8_t *AllocAndRamRead(MemImage *f) {
 		return NULL;
 	}
 
-	readBuf = malloc(f->len);
-	if (!readBuf) {
-		perror("Allocating RAM read buffer");
-		return NULL;
-	}
+	if (!(readBuf = OutBufAlloc(ob, f->file, f->len))) return NULL;
 	printf("Reading cart starting at 0x%06X... ", f->addr);
 	fflush(stdout);
 
@@ -623,36 +1121,72 @@ uint8_t *AllocAndRamRead(MemImage *f) {
 	cmd.rdWr.cmd = CMD_RAM_READ;
 	CMD_SET_ADDR(cmd.rdWr.addr, f->addr - PROG_SRAM_BASE);
 	CMD_SET_LEN(cmd.rdWr.len, f->len);
+	start = StatsStart();
 	if ((CmdSendLongRep(&cmd, sizeof(CmdRdWrHdr), &rep, readBuf,
 			f->len) != f->len) || (rep->command != CMD_OK)) {
 		PrintErr("CMD response: %d. Couldn't read from cart!\n", rep->command);
 		if (rep) CmdRepFree(rep);
-		free(readBuf);
+		OutBufFree(ob);
 		return NULL;
 	}
 	CmdRepFree(rep);
+	StatsSpan("RAM read", start, StatsNow());
 	printf("OK!\n");
 	return readBuf;
 }
 
 /************************************************************************//**
- * Send mapper configuration command.
+ * Queues the mapper configuration command.
  *
- * \param[in] mapper Mapper to set.
+ * \param[inout] batch Command batch to which the request is added.
+ * \param[in]    mapper Mapper to set.
  *
- * \return 0 if OK, -1 if error.
+ * \return Index of the request in the batch, less than 0 on error.
  ****************************************************************************/
-int CmdMapperCfg(CmdMapper mapper) {
+static int ProgMapperAdd(CmdBatch *batch, CmdMapper mapper) {
 	Cmd cmd;
-	CmdRep *rep = NULL;
 
 	cmd.command = CMD_MAPPER_SET;
 	cmd.data[1] = mapper;
-	if (CmdSend(&cmd, 2, &rep) < 0) return -1;
 
-	return 0;
+	return CmdBatchAdd(batch, &cmd, 2);
 }
 
+#ifdef SC_SIM
+/************************************************************************//**
+ * Loads the simulated programmer configuration from the SIM group of the
+ * configuration file. Keys not present keep their default values.
+ *
+ * \param[in] gkf Key file holding the configuration.
+ ****************************************************************************/
+static void SimCfgLoad(GKeyFile *gkf) {
+	ProgSimCfg cfg;
+
+	ProgSimCfgGet(&cfg);
+	if (!g_key_file_has_group(gkf, "SIM")) return;
+#define SIM_KEY_GET(key, field)	\
+	if (g_key_file_has_key(gkf, "SIM", key, NULL)) \
+		cfg.field = g_key_file_get_int64(gkf, "SIM", key, NULL)
+	SIM_KEY_GET("count", count);
+	SIM_KEY_GET("proto", proto);
+	SIM_KEY_GET("features", features);
+	SIM_KEY_GET("max_frame", maxFrame);
+	SIM_KEY_GET("window", window);
+	SIM_KEY_GET("caps", caps);
+	SIM_KEY_GET("latency_us", latency);
+	SIM_KEY_GET("spi_clk_max", clkMax);
+	SIM_KEY_GET("prog_ns", progNs);
+	SIM_KEY_GET("sect_erase_ms", sectMs);
+	SIM_KEY_GET("chip_erase_ms", chipMs);
+#undef SIM_KEY_GET
+	if (g_key_file_has_key(gkf, "SIM", "ber", NULL))
+		cfg.ber = g_key_file_get_double(gkf, "SIM", "ber", NULL);
+	// Kept until the program exits
+	cfg.dir = g_key_file_get_string(gkf, "SIM", "dir", NULL);
+	ProgSimCfgSet(&cfg);
+}
+#endif
+
 /************************************************************************//**
  * Evaluate a value. If less than 0, print the specified error. Else do 
  * nothing.
@@ -680,18 +1214,40 @@ int main(int argc, char **argv){
 	unsigned int cols = 80;
 	// Mapper to use
 	int mapper = INT_MAX;
-	// CHR sector erase address. Set to UINT32_MAX for none
-	uint32_t chrSectErase = UINT32_MAX;
-	// PRG sector erase address. Set to UINT32_MAX for none
-	uint32_t prgSectErase = UINT32_MAX;
+	// CHR sectors to erase
+	SectList chrSect = {{0}, 0};
+	// PRG sectors to erase
+	SectList prgSect = {{0}, 0};
+	// Batch for setup and erase commands
+	CmdBatch batch;
+	// Replies to batched commands
+	CmdRep *batchRep;
+	// Batch for erase commands in gang mode
+	CmdBatch erBatch;
+	// Operations performed on each cart in gang mode
+	GangJob job;
+	// Number of carts to program in gang mode
+	long carts = 0;
+	// Trace file to record the programmer traffic to
+	const char *traceOut = NULL;
+	// Trace file to replay instead of using a programmer
+	const char *replay = NULL;
+	// Replayed calls take the recorded time
+	int replayTimed = FALSE;
+	// Timeline file, in Chrome trace event format
+	const char *timeline = NULL;
+	// Configuration load start and end times, and current phase start time
+	uint64_t cfgStart, cfgEnd, phase;
+	// Index of batched requests
+	int mapperIdx = -1, fwIdx = -1, fIdIdx = -1;
 	// Rom file to write to CHR ROM
 	MemImage fCWr = {NULL, 0, 0};
-	// Rom file to read from CHR ROM (default read length: 256 KiB)
-	MemImage fCRd = {NULL, 0, 256*1024};
+	// Rom file to read from CHR ROM (default: up to the end of the chip)
+	MemImage fCRd = {NULL, 0, 0};
 	// Rom file to write to PRG ROM
 	MemImage fPWr = {NULL, 0, 0};
-	// Rom file to read from PRG ROM (default read length: 512 KiB)
-	MemImage fPRd = {NULL, 0, 512*1024};
+	// Rom file to read from PRG ROM (default: up to the end of the chip)
+	MemImage fPRd = {NULL, 0, 0};
 	// Binary blob to flash to the FPGA
 	MemImage fFpga = {NULL, 0, 0};
 	// Binary blob to flash to the AVR CIC microcontroller
@@ -706,18 +1262,30 @@ int main(int argc, char **argv){
 	int errCode = 0;
 	// Buffer for writing data to CHR flash
     uint8_t *chrWrBuf = NULL;
+	InBuf chrWr = INBUF_INIT;
 	// Buffer for writing data to PRG flash
     uint8_t *prgWrBuf = NULL;
+	InBuf prgWr = INBUF_INIT;
 	// Buffer for reading CHR cart data
 	uint8_t *chrRdBuf = NULL;
+	OutBuf chrRd = OUTBUF_INIT;
 	// Buffer for reading PRG cart data
 	uint8_t *prgRdBuf = NULL;
+	OutBuf prgRd = OUTBUF_INIT;
 	// Buffer for RAM writes
 	uint8_t *ramWrBuf = NULL;
+	InBuf ramWr = INBUF_INIT;
 	// Buffer for RAM reads
 	uint8_t *ramRdBuf = NULL;
+	OutBuf ramRd = OUTBUF_INIT;
 	// MPSSE interface to use (default: 1).
 	long mpsseIf = 2;
+	// USB transfers in flight, 0 to use the default
+	long queue = 0;
+	// Minimum length of the 0xFF runs not written to erased flash
+	long blankRun = PROG_BLANK_RUN;
+	// How images are flashed (PROG_FLASH_*)
+	int flashMode;
 	// Key file for the configuration
 	GKeyFile *gkf = NULL;
 	// Configuration file path
@@ -753,6 +1321,7 @@ int main(int argc, char **argv){
         int c;
 
 		// Open configuration file
+		cfgStart = StatsNow();
 		gkf = g_key_file_new();
 		if (g_key_file_load_from_file(gkf, cfgFile, G_KEY_FILE_NONE, NULL)) {
 			// Read config data
@@ -792,7 +1361,27 @@ int main(int argc, char **argv){
 				mpsseIf = 2;
 				puts("WARNING: Failed to load MPSSE interface number.");
 			}
+			// Optional MPSSE backend, built-in default used if not set
+			if ((tmpChr = g_key_file_get_string(gkf, "MPSSE", "backend",
+							NULL))) {
+				if (SCBackendSet(tmpChr)) printf("WARNING: MPSSE backend "
+						"\"%s\" not available.\n", tmpChr);
+				g_free(tmpChr);
+			}
+			// Optional number of USB transfers in flight
+			queue = g_key_file_get_int64(gkf, "MPSSE", "queue", NULL);
+			// Optional minimum length of the blank runs not written
+			if (g_key_file_has_key(gkf, "FLASH", "blank_run", NULL))
+				blankRun = g_key_file_get_int64(gkf, "FLASH", "blank_run",
+						NULL);
+			if (blankRun < 0) blankRun = 0;
+			// Optional flash chip definitions
+			FlashDbLoad(cfgFile);
+#ifdef SC_SIM
+			SimCfgLoad(gkf);
+#endif
 		} else printf("WARNING: could not open configuration file \"%s\"\n", cfgFile);
+		cfgEnd = StatsNow();
 
 		puts(latPath);
 		puts(avrPath);
@@ -803,7 +1392,7 @@ int main(int argc, char **argv){
 		puts(chipCic);
 		printf("%ld\n", mpsseIf);
 
-        while ((c = getopt_long(argc, argv, "fc:p:C:P:eEs:S:ViR:W:b:a:F:m:M:drvh", opt, &opIdx)) != -1)
+        while ((c = getopt_long(argc, argv, "fc:p:C:P:eEs:S:ViR:W:b:a:F:m:M:Ag:t:y:Y:Tj:Dkdrvh", opt, &opIdx)) != -1)
         {
 			// Parse command-line options
             switch (c)
@@ -856,12 +1445,18 @@ int main(int argc, char **argv){
 					f.prgErase = TRUE;
                 	break;
 
-				case 's': // Erase CHR flash sector
-	                chrSectErase = strtol( optarg, NULL, 16 );
+				case 's': // Erase CHR flash sectors
+					if (ParseSectList(optarg, &chrSect)) {
+						PrintErr("Invalid CHR sector list %s!\n", optarg);
+						return -1;
+					}
 					break;
 
-				case 'S': // Erase CHR flash sector
-	                prgSectErase = strtol( optarg, NULL, 16 );
+				case 'S': // Erase PRG flash sectors
+					if (ParseSectList(optarg, &prgSect)) {
+						PrintErr("Invalid PRG sector list %s!\n", optarg);
+						return -1;
+					}
 					break;
 
                 case 'V': // Verify flash write
@@ -933,6 +1528,45 @@ int main(int argc, char **argv){
 					mapper--;
 					break;
 
+				case 'A': // Autotune link settings
+					f.autotune = TRUE;
+					break;
+
+				case 'g': // Gang programming
+					f.gang = TRUE;
+					carts = strtol(optarg, NULL, 0);
+					if (carts < 0) {
+						PrintErr("Invalid number of carts %s!\n", optarg);
+						return 1;
+					}
+					break;
+
+				case 't': // Record trace
+					traceOut = optarg;
+					break;
+
+				case 'y': // Timed trace replay
+				case 'Y': // Untimed trace replay
+					replay = optarg;
+					replayTimed = c == 'y';
+					break;
+
+				case 'T': // Performance statistics
+					f.stats = TRUE;
+					break;
+
+				case 'j': // Timeline
+					timeline = optarg;
+					break;
+
+				case 'D': // Delta flashing
+					f.delta = TRUE;
+					break;
+
+				case 'k': // Erase sectors covered by flashed files
+					f.sectErase = TRUE;
+					break;
+
 				case 'd': // Dry run
 					f.dry = TRUE;
 				break;
@@ -971,6 +1605,34 @@ int main(int argc, char **argv){
 		return -1;
 	}
 
+	// In gang mode, carts are only written, erased and verified
+	if (f.gang && (fCRd.file || fPRd.file || fRRd.file || f.fwVer ||
+				f.flashId || f.autotune)) {
+		PrintErr("Gang mode does not support reads, queries or autotune!\n");
+		return 1;
+	}
+	// Delta flashing and erase planning read the cart, and only erase the
+	// sectors needed, so they are useless after a chip erase
+	if ((f.delta || f.sectErase) && (f.gang || f.chrErase || f.prgErase)) {
+		PrintErr("Delta flashing and erase planning do not support gang "
+				"mode or chip erase!\n");
+		return 1;
+	}
+	if ((traceOut || replay) && (f.gang || (traceOut && replay))) {
+		PrintErr("Traces can only be recorded or replayed, one programmer "
+				"at a time!\n");
+		return 1;
+	}
+	SCTraceSet(traceOut);
+	SCReplaySet(replay, replayTimed);
+	// Stored link settings might not work, tune them from the defaults
+	SCLinkStoredSet(!f.autotune);
+	if (f.stats) StatsEnable();
+	if (timeline) {
+		if (StatsTimelineOpen(timeline)) return 1;
+		StatsSpan("Config load", cfgStart, cfgEnd);
+	}
+
 	if (f.verbose) {
 		printf("\nUsing MPSSE interface: %ld\n", mpsseIf);
 		printf("The following actions will%s be performed (in order):\n",
@@ -992,6 +1654,12 @@ int main(int argc, char **argv){
 		if (mapper != INT_MAX) {
 			printf(" - Set mapper to %d.\n", mapper);
 		}
+		CondPrintf(f.autotune, " - Tune link settings.\n");
+		if (f.gang) {
+			if (carts) printf(" - Program %ld carts ", carts);
+			else printf(" - Program one cart on each programmer ");
+			printf("using all programmers:\n");
+		}
 		CondPrintf(f.fwVer, " - Get programmer board firmware version.\n");
 		CondPrintf(f.flashId, " - Show Flash chip identification.\n");
 		if (fRWr.file) {
@@ -1003,13 +1671,15 @@ int main(int argc, char **argv){
 			PrintMemImage(&fRRd); putchar('\n');
 		}
 		if (f.chrErase) printf(" - Erase CHR Flash.\n");
-		else if (chrSectErase != UINT32_MAX) 
-			printf(" - Erase CHR sector at 0x%X.\n", chrSectErase);
+		else for (i = 0; i < chrSect.count; i++)
+			printf(" - Erase CHR sector at 0x%X.\n", chrSect.addr[i]);
 		if (f.prgErase) printf(" - Erase PRG Flash.\n");
-		else if (prgSectErase != UINT32_MAX) 
-			printf(" - Erase PRG sector at 0x%X.\n", prgSectErase);
+		else for (i = 0; i < prgSect.count; i++)
+			printf(" - Erase PRG sector at 0x%X.\n", prgSect.addr[i]);
 		if (fCWr.file) {
-		   printf(" - Flash CHR %s", f.verify?"and verify ":"");
+		   printf(" - Flash CHR %s%s", f.delta?"differing sectors ":
+				   f.sectErase?"erasing covered sectors ":"",
+				   f.verify?"and verify ":"");
 		   PrintMemImage(&fCWr); putchar('\n');
 		}
 		if (fCRd.file) {
@@ -1017,7 +1687,9 @@ int main(int argc, char **argv){
 			PrintMemImage(&fCRd); putchar('\n');
 		}
 		if (fPWr.file) {
-		   printf(" - Flash PRG %s", f.verify?"and verify ":"");
+		   printf(" - Flash PRG %s%s", f.delta?"differing sectors ":
+				   f.sectErase?"erasing covered sectors ":"",
+				   f.verify?"and verify ":"");
 		   PrintMemImage(&fPWr); putchar('\n');
 		}
 		if (fPRd.file) {
@@ -1045,6 +1717,7 @@ int main(int argc, char **argv){
 	cols = max.ws_col;
 
 	// Catch SIGTERM to restore cursor before exiting
+	FlightRecInit();
 	if ((signal(SIGTERM, Terminate) == SIG_ERR) ||
 			(signal(SIGINT, Terminate) == SIG_ERR)){
 		PrintErr("Could not catch signals.\n");
@@ -1078,10 +1751,6 @@ int main(int argc, char **argv){
 			goto dealloc_exit;
 		}
 	}
-	// Configure programmer to use TK-ROM like mapper
-	if (mapper != INT_MAX) {
-		CmdMapperCfg(mapper);
-	}
 	// Flash programmer firmware blob
 	if (fFw.file) {
 		// File must be flashed using BDBUS interface. Prior to flashing,
@@ -1096,24 +1765,120 @@ int main(int argc, char **argv){
 	}
 
 	/* Next come commands that communicate with the MCU */
+	// Gang mode: images are loaded once, and written to carts by all the
+	// connected programmers at once
+	if (f.gang) {
+		memset(&job, 0, sizeof(GangJob));
+		CmdBatchInit(&batch);
+		if (mapper != INT_MAX) ProgMapperAdd(&batch, mapper);
+		if (batch.count) job.setup = &batch;
+		CmdBatchInit(&erBatch);
+		ProgSectAdd(&erBatch, PROG_CHIP_CHR, f.chrErase, &chrSect);
+		ProgSectAdd(&erBatch, PROG_CHIP_PRG, f.prgErase, &prgSect);
+		if (erBatch.count) job.erase = &erBatch;
+		job.verify = f.verify;
+		if (fRWr.file) {
+			if (!(ramWrBuf = ImageLoad(&fRWr, &ramWr))) {
+				errCode = 1;
+				goto dealloc_exit;
+			}
+			if ((PROG_SRAM_BASE > fRWr.addr) || ((PROG_SRAM_BASE +
+					PROG_SRAM_LEN) < (fRWr.addr + fRWr.len))) {
+				PrintErr("Wrong RAM write address:length combination!\n");
+				errCode = 1;
+				goto dealloc_exit;
+			}
+			job.ram.data = ramWrBuf;
+			job.ram.addr = fRWr.addr - PROG_SRAM_BASE;
+			job.ram.len = fRWr.len;
+		}
+		if (fCWr.file) {
+			if (!(chrWrBuf = ImageLoad(&fCWr, &chrWr))) {
+				errCode = 1;
+				goto dealloc_exit;
+			}
+			job.chr.data = chrWrBuf;
+			job.chr.addr = fCWr.addr;
+			job.chr.len = fCWr.len;
+			// Chips are not identified in gang mode, so blank runs are
+			// only skipped when the entire chip is erased
+			if (ProgErased(PROG_CHIP_CHR, &fCWr, f.chrErase, &chrSect))
+				job.chr.blank = blankRun;
+		}
+		if (fPWr.file) {
+			if (!(prgWrBuf = ImageLoad(&fPWr, &prgWr))) {
+				errCode = 1;
+				goto dealloc_exit;
+			}
+			job.prg.data = prgWrBuf;
+			job.prg.addr = fPWr.addr;
+			job.prg.len = fPWr.len;
+			if (ProgErased(PROG_CHIP_PRG, &fPWr, f.prgErase, &prgSect))
+				job.prg.blank = blankRun;
+		}
+		errCode = GangRun(&job, mpsseIf, carts)?1:0;
+		goto dealloc_exit;
+	}
+
 	// Open MPSSE SPI interface with programmer board
 	printf("Opening MPSSE interface... ");
+	phase = StatsStart();
 	if (CmdInit(mpsseIf)) {
 		errCode = 1;
 		goto dealloc_exit;
 	}
+	StatsSpan("CmdInit", phase, StatsNow());
 	printf("OK!\n");
+	if ((queue > 0) && CmdQueueSet(queue)) {
+		printf("WARNING: USB queue depth %ld not supported.\n", queue);
+	}
 
-	if (f.fwVer) {
-		try(ProgFwGet(), "Couldn't get programmer firmware!\n");
+	// Setup commands (mapper configuration, firmware version and flash ID
+	// queries) are sent together, in a single batch. Flash chips are
+	// always identified before flash operations, to use their geometry.
+	CmdBatchInit(&batch);
+	if (mapper != INT_MAX) mapperIdx = ProgMapperAdd(&batch, mapper);
+	if (f.fwVer) fwIdx = ProgFwAdd(&batch);
+	if (f.flashId || f.chrErase || f.prgErase || chrSect.count ||
+			prgSect.count || fCWr.file || fPWr.file || fCRd.file ||
+			fPRd.file) fIdIdx = ProgFIdAdd(&batch);
+	if (batch.count) {
+		phase = StatsStart();
+		try(CmdBatchRun(&batch, &batchRep), "Setup commands failed!\n");
+		StatsSpan("Setup", phase, StatsNow());
+		if ((mapperIdx >= 0) &&
+				(batchRep[mapperIdx].command != CMD_REP_OK)) {
+			try(-1, "Couldn't set mapper!\n");
+		}
+		if (fwIdx >= 0) {
+			try(ProgFwPrint(batchRep + fwIdx),
+					"Couldn't get programmer firmware!\n");
+		}
+		if (f.flashId) {
+			try(ProgFIdPrint(batchRep + fIdIdx), "Couldn't get flash ID\n");
+		}
+		if (fIdIdx >= 0) {
+			ProgFlashDetect(batchRep + fIdIdx, f.flashId || f.verbose);
+		}
+	}
+	ProgReadLen(PROG_CHIP_CHR, &fCRd);
+	ProgReadLen(PROG_CHIP_PRG, &fPRd);
+	// Erase planning and delta flashing need the chip geometry
+	if ((f.delta || f.sectErase) &&
+			((fCWr.file && ProgGeometryCheck(PROG_CHIP_CHR)) ||
+			 (fPWr.file && ProgGeometryCheck(PROG_CHIP_PRG)))) {
+		errCode = 1;
+		goto dealloc_exit;
 	}
 
-	if (f.flashId) {
-		try(ProgFIdGet(), "Couldn't get flash ID\n");
+	if (f.autotune) {
+		phase = StatsStart();
+		try(AutoTune(), "Link autotune failed!\n");
+		StatsSpan("Autotune", phase, StatsNow());
 	}
 	// RAM write
 	if (fRWr.file) {
-		ramWrBuf = AllocAndRamWrite(&fRWr);
+		ramWrBuf = AllocAndRamWrite(&fRWr, &ramWr);
 		if (!ramWrBuf) {
 			errCode = 1;
 			goto dealloc_exit;
@@ -1126,18 +1891,20 @@ int main(int argc, char **argv){
 			fRRd.addr = fRWr.addr;
 			fRRd.len  = fRWr.len;
 		}
-		ramRdBuf = AllocAndRamRead(&fRRd);
+		ramRdBuf = AllocAndRamRead(&fRRd, &ramRd);
 		if (!ramRdBuf) {
 			errCode = 1;
 			goto dealloc_exit;
 		}
 		// Verify
 		if (f.verify) {
+			phase = StatsStart();
 			for (i = 0; i < fRWr.len; i++) {
 				if (ramWrBuf[i] != ramRdBuf[i]) {
 					break;
 				}
 			}
+			StatsSpan("RAM verify", phase, StatsNow());
 			if (i == fRWr.len)
 				printf("RAM Verify OK!\n");
 			else {
@@ -1151,46 +1918,34 @@ int main(int argc, char **argv){
 		}
 		// Write output file
 		if (fRRd.file) {
-        	FILE *dump = fopen(fRRd.file, "wb");
-			if (!dump) {
-				perror(fRRd.file);
+			if (OutBufSave(&ramRd)) {
 				errCode = 1;
 				goto dealloc_exit;
 			}
-	        fwrite(ramRdBuf, fRRd.len, 1, dump);
-	        fclose(dump);
 			printf("Wrote RAM file %s.\n", fRRd.file);
 		}
 		// Exit if we had a previous error (e.g. on verify stage).
 		if (errCode) goto dealloc_exit;
 	}
-	if (f.chrErase) {
-		printf("Erasing CHR Flash... "); fflush(stdout);
-		try(ProgFlashErase(PROG_CHIP_CHR, PROG_ERASE_FULL),
-			"CHR chip erase ERROR!\n");
-		printf("OK!\n");
-	}
-	if (f.prgErase) {
-		printf("Erasing PRG Flash... "); fflush(stdout);
-		try(ProgFlashErase(PROG_CHIP_PRG, PROG_ERASE_FULL),
-			"PRG chip erase ERROR!\n");
-		printf("OK!\n");
-	}
-	if (chrSectErase != UINT32_MAX) {
-		printf("Erasing CHR sector at 0x%06X... ", chrSectErase);
-		try(ProgFlashErase(PROG_CHIP_CHR,
-				chrSectErase), "CHR sector erase ERROR!\n");
-		printf("OK!\n");
-	}
-	if (prgSectErase != UINT32_MAX) {
-		printf("Erasing PRG sector at 0x%06X... ", prgSectErase);
-		try(ProgFlashErase(PROG_CHIP_PRG,
-				prgSectErase), "PRG sector erase ERROR!\n");
-		printf("OK!\n");
+	// Images are flashed in delta mode, or erasing the sectors they cover,
+	// or to flash erased here
+	if (f.delta) flashMode = PROG_FLASH_DELTA;
+	else if (f.sectErase) flashMode = PROG_FLASH_SECT;
+	else flashMode = PROG_FLASH_ERASED;
+	// Chip and sector erases are sent together, in a single batch. Sector
+	// erases are skipped if the entire chip is erased.
+	CmdBatchInit(&batch);
+	ProgSectAdd(&batch, PROG_CHIP_CHR, f.chrErase, &chrSect);
+	ProgSectAdd(&batch, PROG_CHIP_PRG, f.prgErase, &prgSect);
+	if (batch.count) {
+		phase = StatsStart();
+		try(ProgEraseRun(&batch), "Flash erase ERROR!\n");
+		StatsSpan("Erase", phase, StatsNow());
 	}
 	// CHR Flash program
 	if (fCWr.file) {
-		chrWrBuf = AllocAndFlash(PROG_CHIP_CHR, &fCWr, cols);
+		chrWrBuf = AllocAndFlash(PROG_CHIP_CHR, &fCWr, cols, flashMode,
+				f.chrErase, &chrSect, blankRun, &chrWr);
 		if (!chrWrBuf) {
 			errCode = 1;
 			goto dealloc_exit;
@@ -1203,18 +1958,20 @@ int main(int argc, char **argv){
 			fCRd.addr = fCWr.addr;
 			fCRd.len  = fCWr.len;
 		}
-		chrRdBuf = AllocAndRead(PROG_CHIP_CHR, &fCRd, cols);
+		chrRdBuf = AllocAndRead(PROG_CHIP_CHR, &fCRd, cols, &chrRd);
 		if (!chrRdBuf) {
 			errCode = 1;
 			goto dealloc_exit;
 		}
 		// Verify
 		if (f.verify) {
+			phase = StatsStart();
 			for (i = 0; i < fCWr.len; i++) {
 				if (chrWrBuf[i] != chrRdBuf[i]) {
 					break;
 				}
 			}
+			StatsSpan("CHR verify", phase, StatsNow());
 			if (i == fCWr.len)
 				printf("CHR Verify OK!\n");
 			else {
@@ -1228,14 +1985,10 @@ int main(int argc, char **argv){
 		}
 		// Write output file
 		if (fCRd.file) {
-        	FILE *dump = fopen(fCRd.file, "wb");
-			if (!dump) {
-				perror(fCRd.file);
+			if (OutBufSave(&chrRd)) {
 				errCode = 1;
 				goto dealloc_exit;
 			}
-	        fwrite(chrRdBuf, fCRd.len, 1, dump);
-	        fclose(dump);
 			printf("Wrote CHR file %s.\n", fCRd.file);
 		}
 		// Exit if we had a previous error (e.g. on verify stage).
@@ -1243,7 +1996,8 @@ int main(int argc, char **argv){
 	}
 	// PRG Flash program
 	if (fPWr.file) {
-		prgWrBuf = AllocAndFlash(PROG_CHIP_PRG, &fPWr, cols);
+		prgWrBuf = AllocAndFlash(PROG_CHIP_PRG, &fPWr, cols, flashMode,
+				f.prgErase, &prgSect, blankRun, &prgWr);
 		if (!prgWrBuf) {
 			errCode = 1;
 			goto dealloc_exit;
@@ -1256,18 +2010,20 @@ int main(int argc, char **argv){
 			fPRd.addr = fPWr.addr;
 			fPRd.len  = fPWr.len;
 		}
-		prgRdBuf = AllocAndRead(PROG_CHIP_PRG, &fPRd, cols);
+		prgRdBuf = AllocAndRead(PROG_CHIP_PRG, &fPRd, cols, &prgRd);
 		if (!prgRdBuf) {
 			errCode = 1;
 			goto dealloc_exit;
 		}
 		// Verify
 		if (f.verify) {
+			phase = StatsStart();
 			for (i = 0; i < fPWr.len; i++) {
 				if (prgWrBuf[i] != prgRdBuf[i]) {
 					break;
 				}
 			}
+			StatsSpan("PRG verify", phase, StatsNow());
 			if (i == fPWr.len)
 				printf("PRG Verify OK!\n");
 			else {
@@ -1281,14 +2037,10 @@ int main(int argc, char **argv){
 		}
 		// Write output file
 		if (fPRd.file) {
-        	FILE *dump = fopen(fPRd.file, "wb");
-			if (!dump) {
-				perror(fPRd.file);
+			if (OutBufSave(&prgRd)) {
 				errCode = 1;
 				goto dealloc_exit;
 			}
-	        fwrite(prgRdBuf, fPRd.len, 1, dump);
-	        fclose(dump);
 			printf("Wrote PRG file %s.\n", fPRd.file);
 		}
 		// Exit if we had a previous error (e.g. on verify stage).
@@ -1296,13 +2048,19 @@ int main(int argc, char **argv){
 	}
 
 dealloc_exit:
+	CmdClose();
+	// Keep the last transfers, to find out what went wrong. Gang workers
+	// already wrote them for each failed cart.
+	if (errCode && !f.gang) FlightRecDump("operation failed");
+	if (f.stats) StatsPrint();
+	StatsTimelineClose();
 	if (gkf) g_key_file_free(gkf);
-	if (ramWrBuf) free(ramWrBuf);
-	if (ramRdBuf) free(ramRdBuf);
-	if (chrWrBuf) free(chrWrBuf);
-	if (prgWrBuf) free(prgWrBuf);
-	if (chrRdBuf) free(chrRdBuf);
-	if (prgRdBuf) free(prgRdBuf);
+	InBufFree(&ramWr);
+	OutBufFree(&ramRd);
+	InBufFree(&chrWr);
+	InBufFree(&prgWr);
+	OutBufFree(&chrRd);
+	OutBufFree(&prgRd);
 #ifndef __OS_WIN
 	// Restore cursor
 	printf("\e[?25h");
@@ -0,0 +1,145 @@
+/************************************************************************//**
+ * \file
+ * \brief Output buffers for data read from the cartridge.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "outbuf.h"
+#include "util.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+#ifndef __OS_WIN
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#ifndef __OS_WIN
+/************************************************************************//**
+ * Creates a temporary file in the output file directory, and maps it to
+ * memory. Being in the same directory, it can be renamed over the output
+ * file when saved.
+ *
+ * \param[inout] ob Output buffer, with file and len fields set.
+ *
+ * \return 0 if OK, -1 if error.
+ ****************************************************************************/
+static int OutBufMap(OutBuf *ob) {
+	mode_t mask;
+	void *map;
+
+	// The mask can only be read by setting it
+	mask = umask(0);
+	umask(mask);
+	ob->tmp = g_strdup_printf("%s.XXXXXX", ob->file);
+	if ((ob->fd = g_mkstemp(ob->tmp)) < 0) {
+		g_free(ob->tmp);
+		ob->tmp = NULL;
+		return -1;
+	}
+	// Temporary files are created private, use usual permissions instead
+	if (fchmod(ob->fd, 0644 & ~mask) || ftruncate(ob->fd, ob->len) ||
+			(MAP_FAILED == (map = mmap(NULL, ob->len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, ob->fd, 0)))) {
+		close(ob->fd);
+		unlink(ob->tmp);
+		g_free(ob->tmp);
+		ob->tmp = NULL;
+		ob->fd = -1;
+		return -1;
+	}
+	ob->data = map;
+
+	return 0;
+}
+#endif
+
+/************************************************************************//**
+ * Allocates an output buffer. If a file is specified, a temporary file is
+ * created next to it and mapped to memory. Otherwise heap memory is
+ * allocated.
+ *
+ * \param[out] ob   Output buffer to allocate.
+ * \param[in]  file Output file, or NULL if data is not saved to a file.
+ * \param[in]  len  Buffer length.
+ *
+ * \return Pointer to the buffer data, or NULL if error occurred.
+ ****************************************************************************/
+uint8_t *OutBufAlloc(OutBuf *ob, const char *file, uint32_t len) {
+	ob->file = file;
+	ob->len = len;
+	ob->tmp = NULL;
+	ob->fd = -1;
+	ob->saved = FALSE;
+#ifndef __OS_WIN
+	// Fall back to heap memory if file cannot be mapped
+	if (file && len && !OutBufMap(ob)) return ob->data;
+#endif
+	if (!(ob->data = malloc(len))) perror("Allocating read buffer");
+
+	return ob->data;
+}
+
+/************************************************************************//**
+ * Saves the output buffer data to its file, replacing it if it exists.
+ *
+ * \param[in] ob Output buffer to save.
+ *
+ * \return 0 if OK, -1 if error.
+ ****************************************************************************/
+int OutBufSave(OutBuf *ob) {
+	FILE *dump;
+	uint64_t start = StatsStart();
+
+	if (!ob->file) return -1;
+#ifndef __OS_WIN
+	if (ob->fd >= 0) {
+		if (msync(ob->data, ob->len, MS_SYNC) || rename(ob->tmp, ob->file)) {
+			perror(ob->file);
+			return -1;
+		}
+		ob->saved = TRUE;
+		StatsEnd(STATS_FILE_WRITE, start, ob->len);
+		return 0;
+	}
+#endif
+	if (!(dump = fopen(ob->file, "wb"))) {
+		perror(ob->file);
+		return -1;
+	}
+	fwrite(ob->data, ob->len, 1, dump);
+	fclose(dump);
+	ob->saved = TRUE;
+	StatsEnd(STATS_FILE_WRITE, start, ob->len);
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Frees an output buffer. If the buffer is mapped to a temporary file that
+ * has not been saved, it is removed, so no incomplete files are left behind
+ * and the output file is kept untouched.
+ *
+ * \param[in] ob Output buffer to free.
+ ****************************************************************************/
+void OutBufFree(OutBuf *ob) {
+	if (!ob->data) return;
+#ifndef __OS_WIN
+	if (ob->fd >= 0) {
+		munmap(ob->data, ob->len);
+		close(ob->fd);
+		if (!ob->saved) unlink(ob->tmp);
+		g_free(ob->tmp);
+		ob->tmp = NULL;
+		ob->fd = -1;
+		ob->data = NULL;
+		return;
+	}
+#endif
+	free(ob->data);
+	ob->data = NULL;
+}
+
@@ -0,0 +1,70 @@
+/************************************************************************//**
+ * \file
+ * \brief Output buffers for data read from the cartridge.
+ *
+ * \defgroup outbuf outbuf
+ * \{
+ * \brief Output buffers for data read from the cartridge.
+ *
+ * When data is read to a file, the buffer is a temporary file in the same
+ * directory, mapped in memory, so read data lands directly in the page cache
+ * and does not have to be written later. Saving the buffer renames the
+ * temporary file over the output file, so an existing file is only replaced
+ * once the new data is complete. If the file cannot be mapped (or on
+ * Windows), a heap buffer is used, and written to the file when saved.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _OUTBUF_H_
+#define _OUTBUF_H_
+
+#include <stdint.h>
+
+/// Output buffer
+typedef struct {
+	uint8_t *data;		///< Buffer data
+	uint32_t len;		///< Buffer length
+	const char *file;	///< Output file, or NULL if none
+	char *tmp;			///< Mapped temporary file, or NULL if not mapped
+	int fd;				///< Mapped file descriptor, or -1 if not mapped
+	int saved;			///< TRUE if data has been saved to file
+} OutBuf;
+
+/// Initializer for OutBuf variables
+#define OUTBUF_INIT	{NULL, 0, NULL, NULL, -1, 0}
+
+/************************************************************************//**
+ * Allocates an output buffer. If a file is specified, a temporary file is
+ * created next to it and mapped to memory. Otherwise heap memory is
+ * allocated.
+ *
+ * \param[out] ob   Output buffer to allocate.
+ * \param[in]  file Output file, or NULL if data is not saved to a file.
+ * \param[in]  len  Buffer length.
+ *
+ * \return Pointer to the buffer data, or NULL if error occurred.
+ ****************************************************************************/
+uint8_t *OutBufAlloc(OutBuf *ob, const char *file, uint32_t len);
+
+/************************************************************************//**
+ * Saves the output buffer data to its file, replacing it if it exists.
+ *
+ * \param[in] ob Output buffer to save.
+ *
+ * \return 0 if OK, -1 if error.
+ ****************************************************************************/
+int OutBufSave(OutBuf *ob);
+
+/************************************************************************//**
+ * Frees an output buffer. If the buffer is mapped to a temporary file that
+ * has not been saved, it is removed, so no incomplete files are left behind
+ * and the output file is kept untouched.
+ *
+ * \param[in] ob Output buffer to free.
+ ****************************************************************************/
+void OutBufFree(OutBuf *ob);
+
+#endif /*_OUTBUF_H_*/
+
+/** \} */
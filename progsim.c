@@ -0,0 +1,806 @@
+/************************************************************************//**
+ * \file
+ * \brief Software model of the programmer firmware.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "progsim.h"
+#include "cmd.h"
+#include "crc.h"
+#include "rle.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+/// Simulated firmware major version
+#define PS_VER_MAJOR	2
+/// Simulated firmware minor version
+#define PS_VER_MINOR	0
+
+/// Manufacturer ID of the simulated flash chips
+#define PS_MAN_ID		0x01
+/// Device ID of the simulated flash chips
+static const uint8_t psDevId[3] = {0x7E, 0x1D, 0x00};
+
+/// Length of the buffers holding a long payload
+#define PS_PAYLOAD_MAX	65536
+/// Maximum number of replies queued with their own ready time
+#define PS_MARK_MAX		256
+
+/// Nanoseconds per millisecond
+#define PS_NS_PER_MS	1000000ULL
+
+/** \addtogroup PsMem
+ *  \brief Simulated memories.
+ *  \{ */
+#define PS_MEM_CHR		0	///< CHR flash
+#define PS_MEM_PRG		1	///< PRG flash
+#define PS_MEM_RAM		2	///< Cartridge SRAM
+#define PS_MEM_LOOP		3	///< Loopback buffer, in the programmer
+#define PS_MEM_MAX		4	///< Number of memories
+/** \} */
+
+/// Length of each memory
+static const uint32_t psMemLen[PS_MEM_MAX] = {
+	PROGSIM_FLASH_LEN, PROGSIM_FLASH_LEN, CMD_SRAM_MAXLEN, CMD_LOOP_LEN
+};
+
+/// Name of each memory, used for the files keeping the cart contents
+static const char *const psMemName[PS_MEM_LOOP] = {"chr", "prg", "ram"};
+
+/// Configuration used for the programmers opened from now on
+static ProgSimCfg psCfg = {
+	.proto = CMD_PROTO_V2,
+	.features = CMD_PROTO_F_BULK | CMD_PROTO_F_CRC | CMD_PROTO_F_DUPLEX |
+		CMD_PROTO_F_READY | CMD_PROTO_F_PIPE,
+	.maxFrame = SC_V2_MAX_DATALEN,
+	.window = 8,
+	.caps = CMD_CAP_BATCH | CMD_CAP_RLE | CMD_CAP_LOOP,
+	.latency = 125,
+	.clkMax = 3000000,
+	.progNs = 9000,
+	.sectMs = 300,
+	.chipMs = 10000,
+	.ber = 0,
+	.count = 1,
+	.dir = NULL
+};
+
+/// Reply queued for transmission, with the time it is available.
+typedef struct {
+	uint32_t end;		///< Position following the last reply byte
+	uint64_t ready;		///< Time the reply is available, in ns
+} PsMark;
+
+/// Long write payload being received.
+typedef struct {
+	uint8_t active;		///< Payload is being received
+	uint8_t mem;		///< Memory to write (PS_MEM_*)
+	uint8_t rle;		///< Payload is RLE compressed
+	uint8_t single;		///< Single reply, sent when payload is written
+	uint8_t code;		///< Reply code for the write
+	uint8_t seq;		///< Next expected chunk sequence number
+	uint32_t addr;		///< Address to write
+	uint32_t len;		///< Payload length
+	uint32_t got;		///< Payload bytes received
+	uint8_t buf[PS_PAYLOAD_MAX];	///< Payload data
+} PsWrite;
+
+/// Simulated programmer data.
+struct ProgSim {
+	ProgSimCfg cfg;					///< Configuration
+	char serial[SC_SERIAL_MAXLEN];	///< USB serial number
+	uint8_t *mem[PS_MEM_MAX];		///< Memory contents
+	uint8_t mapper;					///< Configured mapper
+	uint16_t frameMax;	///< Maximum frame payload length in use
+	uint8_t v2;			///< Protocol v2 frames in use
+	uint8_t bulk;		///< Long payloads use the bulk phase
+	uint8_t crc;		///< Bulk chunks carry sequence number and CRC
+	uint8_t pipe;		///< Pipelined requests in use
+	PsWrite wr;			///< Long write payload being received
+	/// Buffer for decompressed payloads
+	uint8_t rleBuf[PS_PAYLOAD_MAX];
+	uint8_t *tx;		///< Reply bytes queued for transmission
+	uint32_t txLen;		///< Number of bytes in the reply queue
+	uint32_t txPos;		///< Position of the next byte to transmit
+	uint32_t txSize;	///< Length of the reply queue buffer
+	PsMark mark[PS_MARK_MAX];	///< Queued replies
+	unsigned int markHead;		///< First queued reply not yet sent
+	unsigned int markCount;		///< Number of queued replies not yet sent
+	uint64_t busy;		///< Time the firmware completes its work, in ns
+};
+
+/************************************************************************//**
+ * Obtains the configuration used for the programmers opened from now on.
+ *
+ * \param[out] cfg Simulated programmer configuration.
+ ****************************************************************************/
+void ProgSimCfgGet(ProgSimCfg *cfg) {
+	*cfg = psCfg;
+}
+
+/************************************************************************//**
+ * Sets the configuration used for the programmers opened from now on.
+ * Out of range values are clamped to the supported ones.
+ *
+ * \param[in] cfg Simulated programmer configuration.
+ ****************************************************************************/
+void ProgSimCfgSet(const ProgSimCfg *cfg) {
+	psCfg = *cfg;
+	psCfg.proto = MAX(MIN(psCfg.proto, CMD_PROTO_V2), CMD_PROTO_V1);
+	psCfg.maxFrame = MAX(MIN(psCfg.maxFrame, SC_V2_MAX_DATALEN),
+			CMD_PROTO_V2_MINFRAME);
+	psCfg.window = MAX(MIN(psCfg.window, CMD_PIPE_MAXWIN), 1);
+	psCfg.clkMax = MAX(psCfg.clkMax, 1);
+	psCfg.count = MAX(MIN(psCfg.count, PROGSIM_MAX), 1);
+}
+
+/************************************************************************//**
+ * Obtains the name of the file keeping the contents of a memory.
+ *
+ * \param[in] ps  Simulated programmer handler.
+ * \param[in] mem Memory (PS_MEM_*).
+ *
+ * \return File name, to be freed with g_free().
+ ****************************************************************************/
+static char *PsMemFile(ProgSim *ps, int mem) {
+	char *name = g_strdup_printf("%s-%s.bin", ps->serial, psMemName[mem]);
+	char *file = g_build_filename(ps->cfg.dir, name, NULL);
+
+	g_free(name);
+	return file;
+}
+
+/************************************************************************//**
+ * Creates a simulated programmer, with a cart inserted. If a directory was
+ * configured, memory contents saved by a previous run are loaded.
+ *
+ * \param[in] serial USB serial number of the programmer.
+ *
+ * \return Simulated programmer handler, or NULL if allocation failed.
+ ****************************************************************************/
+ProgSim *ProgSimNew(const char *serial) {
+	ProgSim *ps;
+	FILE *f;
+	char *file;
+	int i;
+
+	if (!(ps = calloc(1, sizeof(ProgSim)))) return NULL;
+	ps->cfg = psCfg;
+	strncpy(ps->serial, serial, SC_SERIAL_MAXLEN - 1);
+	ps->frameMax = SC_MAX_DATALEN;
+	for (i = 0; i < PS_MEM_MAX; i++) {
+		if (!(ps->mem[i] = malloc(psMemLen[i]))) {
+			ProgSimFree(ps);
+			return NULL;
+		}
+		// Flash chips start erased
+		memset(ps->mem[i], (i < PS_MEM_RAM)?0xFF:0x00, psMemLen[i]);
+		if (!ps->cfg.dir || (i == PS_MEM_LOOP)) continue;
+		file = PsMemFile(ps, i);
+		if ((f = fopen(file, "rb"))) {
+			if (fread(ps->mem[i], 1, psMemLen[i], f) < psMemLen[i])
+				PrintErr("WARNING: %s is incomplete.\n", file);
+			fclose(f);
+		}
+		g_free(file);
+	}
+
+	return ps;
+}
+
+/************************************************************************//**
+ * Frees a simulated programmer. If a directory was configured, memory
+ * contents are saved to it.
+ *
+ * \param[in] ps Simulated programmer handler.
+ ****************************************************************************/
+void ProgSimFree(ProgSim *ps) {
+	FILE *f;
+	char *file;
+	int i;
+
+	for (i = 0; i < PS_MEM_MAX; i++) {
+		if (!ps->mem[i]) continue;
+		if (ps->cfg.dir && (i != PS_MEM_LOOP)) {
+			file = PsMemFile(ps, i);
+			if (!(f = fopen(file, "wb")) ||
+					(fwrite(ps->mem[i], psMemLen[i], 1, f) < 1))
+				perror(file);
+			if (f) fclose(f);
+			g_free(file);
+		}
+		free(ps->mem[i]);
+	}
+	free(ps->tx);
+	free(ps);
+}
+
+/************************************************************************//**
+ * Appends bytes to the reply queue.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Bytes to append.
+ * \param[in] len  Number of bytes to append.
+ ****************************************************************************/
+static void PsTxAdd(ProgSim *ps, const uint8_t *data, uint32_t len) {
+	uint32_t size;
+	uint8_t *tx;
+
+	if (ps->txLen + len > ps->txSize) {
+		size = MAX(ps->txSize * 2, ps->txLen + len);
+		// Bytes that do not fit are lost, as on a real overflow
+		if (!(tx = realloc(ps->tx, size))) return;
+		ps->tx = tx;
+		ps->txSize = size;
+	}
+	memcpy(ps->tx + ps->txLen, data, len);
+	ps->txLen += len;
+}
+
+/************************************************************************//**
+ * Marks the end of a reply added to the queue, and sets the time it is
+ * available for transmission.
+ *
+ * \param[in] ps    Simulated programmer handler.
+ * \param[in] ready Time the reply is available, in ns.
+ ****************************************************************************/
+static void PsTxMark(ProgSim *ps, uint64_t ready) {
+	PsMark *last;
+
+	// Merge with the previous reply if there is no room for another one
+	if (ps->markHead + ps->markCount >= PS_MARK_MAX) {
+		last = &ps->mark[ps->markHead + ps->markCount - 1];
+		last->end = ps->txLen;
+		last->ready = MAX(last->ready, ready);
+		return;
+	}
+	ps->mark[ps->markHead + ps->markCount].end = ps->txLen;
+	ps->mark[ps->markHead + ps->markCount].ready = ready;
+	ps->markCount++;
+}
+
+/************************************************************************//**
+ * Removes transmitted bytes and replies from the reply queue.
+ *
+ * \param[in] ps Simulated programmer handler.
+ ****************************************************************************/
+static void PsTxCompact(ProgSim *ps) {
+	unsigned int i;
+
+	if (!ps->txPos) return;
+	memmove(ps->tx, ps->tx + ps->txPos, ps->txLen - ps->txPos);
+	for (i = 0; i < ps->markCount; i++) {
+		ps->mark[i] = ps->mark[ps->markHead + i];
+		ps->mark[i].end -= ps->txPos;
+	}
+	ps->markHead = 0;
+	ps->txLen -= ps->txPos;
+	ps->txPos = 0;
+}
+
+/************************************************************************//**
+ * Appends a frame to the reply queue, using the framing in use.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Frame payload.
+ * \param[in] len  Frame payload length.
+ ****************************************************************************/
+static void PsFrameAdd(ProgSim *ps, const uint8_t *data, uint16_t len) {
+	uint8_t hdr[3];
+	const uint8_t eof = SC_EOF;
+
+	if (ps->v2) {
+		hdr[0] = SC_SOF_V2;
+		hdr[1] = len>>8;
+		hdr[2] = len;
+		PsTxAdd(ps, hdr, 3);
+	} else {
+		hdr[0] = SC_SOF;
+		hdr[1] = len;
+		PsTxAdd(ps, hdr, 2);
+	}
+	PsTxAdd(ps, data, len);
+	PsTxAdd(ps, &eof, 1);
+}
+
+/************************************************************************//**
+ * Queues a reply holding only a reply code.
+ *
+ * \param[in] ps    Simulated programmer handler.
+ * \param[in] code  Reply code.
+ * \param[in] ready Time the reply is available, in ns.
+ ****************************************************************************/
+static void PsReply(ProgSim *ps, uint8_t code, uint64_t ready) {
+	PsFrameAdd(ps, &code, 1);
+	PsTxMark(ps, ready);
+}
+
+/************************************************************************//**
+ * Appends a long reply payload to the reply queue, using bulk chunks if
+ * negotiated, or frames of the maximum length otherwise.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Payload.
+ * \param[in] len  Payload length.
+ ****************************************************************************/
+static void PsPayloadAdd(ProgSim *ps, const uint8_t *data, uint32_t len) {
+	uint32_t sent, n;
+	uint16_t crc;
+	uint8_t seq;
+	uint8_t buf[3];
+
+	for (sent = 0, seq = 0; sent < len; sent += n, seq++) {
+		if (!ps->bulk) {
+			n = MIN(len - sent, ps->frameMax);
+			PsFrameAdd(ps, data + sent, n);
+			continue;
+		}
+		n = MIN(len - sent, SC_BULK_MAXLEN);
+		buf[0] = SC_SOB;
+		buf[1] = seq;
+		PsTxAdd(ps, buf, ps->crc?2:1);
+		PsTxAdd(ps, data + sent, n);
+		if (ps->crc) {
+			crc = Crc16(Crc16(CRC16_INIT, &seq, 1), data + sent, n);
+			buf[0] = crc>>8;
+			buf[1] = crc;
+			buf[2] = SC_EOF;
+			PsTxAdd(ps, buf, 3);
+		} else {
+			buf[0] = SC_EOF;
+			PsTxAdd(ps, buf, 1);
+		}
+	}
+}
+
+/************************************************************************//**
+ * Obtains the memory accessed by a read, write or erase command.
+ *
+ * \param[in] code Command code, without flags.
+ *
+ * \return Memory accessed (PS_MEM_*).
+ ****************************************************************************/
+static int PsMemGet(uint8_t code) {
+	switch (code) {
+		case CMD_CHR_WRITE: case CMD_CHR_READ: case CMD_CHR_ERASE:
+			return PS_MEM_CHR;
+
+		case CMD_PRG_WRITE: case CMD_PRG_READ: case CMD_PRG_ERASE:
+			return PS_MEM_PRG;
+
+		case CMD_LOOP_WRITE: case CMD_LOOP_READ:
+			return PS_MEM_LOOP;
+
+		default:
+			return PS_MEM_RAM;
+	}
+}
+
+/************************************************************************//**
+ * Processes the firmware version request, negotiating the protocol.
+ * Requests without protocol fields keep the protocol in use.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Request.
+ * \param[in] len  Request length.
+ * \param[in] t    Time the request is processed, in ns.
+ ****************************************************************************/
+static void PsFwVer(ProgSim *ps, const uint8_t *data, uint16_t len,
+		uint64_t t) {
+	uint8_t rep[sizeof(CmdRepFwVer)] = {CMD_REP_OK, PS_VER_MAJOR,
+		PS_VER_MINOR};
+	uint8_t features;
+
+	if ((ps->cfg.proto < CMD_PROTO_V2) || (len < sizeof(CmdFwVer)) ||
+			(data[1] < CMD_PROTO_V2)) {
+		PsFrameAdd(ps, rep, 3);
+		PsTxMark(ps, t);
+		return;
+	}
+	features = data[2] & ps->cfg.features;
+	if (!(features & CMD_PROTO_F_BULK)) features &= ~CMD_PROTO_F_CRC;
+	rep[3] = CMD_PROTO_V2;
+	rep[4] = features;
+	rep[5] = ps->cfg.maxFrame>>8;
+	rep[6] = ps->cfg.maxFrame;
+	rep[7] = ps->cfg.window;
+	// Reply uses the framing in use when the request was received
+	PsFrameAdd(ps, rep, sizeof(rep));
+	PsTxMark(ps, t);
+
+	ps->frameMax = ps->cfg.maxFrame;
+	ps->v2 = TRUE;
+	ps->bulk = (features & CMD_PROTO_F_BULK)?TRUE:FALSE;
+	ps->crc = (features & CMD_PROTO_F_CRC)?TRUE:FALSE;
+	ps->pipe = (features & CMD_PROTO_F_PIPE) && (ps->cfg.window > 1);
+}
+
+/************************************************************************//**
+ * Processes a write request header. The payload is received next.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Request.
+ * \param[in] len  Request length.
+ * \param[in] t    Time the request is processed, in ns.
+ *
+ * \return Time the firmware completes the request, in ns.
+ ****************************************************************************/
+static uint64_t PsWriteStart(ProgSim *ps, const uint8_t *data, uint16_t len,
+		uint64_t t);
+
+/************************************************************************//**
+ * Writes a completely received payload to its memory. Flash chips can only
+ * clear bits.
+ *
+ * \param[in] ps Simulated programmer handler.
+ * \param[in] t  Time the payload is complete, in ns.
+ *
+ * \return Time the firmware completes the write, in ns.
+ ****************************************************************************/
+static uint64_t PsWriteEnd(ProgSim *ps, uint64_t t) {
+	PsWrite *wr = &ps->wr;
+	const uint8_t *src = wr->buf;
+	uint8_t *dst = ps->mem[wr->mem];
+	int len = wr->len;
+	int i;
+
+	wr->active = FALSE;
+	if (wr->rle && ((len = RleDecode(wr->buf, wr->len, ps->rleBuf,
+						PS_PAYLOAD_MAX)) < 0)) wr->code = CMD_REP_ERROR;
+	src = ps->rleBuf;
+	if (!wr->rle) src = wr->buf;
+	if ((wr->code == CMD_REP_OK) && (wr->addr + len > psMemLen[wr->mem]))
+		wr->code = CMD_REP_ERROR;
+	if (wr->code != CMD_REP_OK) return t;
+
+	if (wr->mem >= PS_MEM_RAM) {
+		memcpy(dst + wr->addr, src, len);
+		return t;
+	}
+	for (i = 0; i < len; i++) dst[wr->addr + i] &= src[i];
+	return t + (uint64_t)ps->cfg.progNs * len;
+}
+
+static uint64_t PsWriteStart(ProgSim *ps, const uint8_t *data, uint16_t len,
+		uint64_t t) {
+	PsWrite *wr = &ps->wr;
+
+	if (len < sizeof(CmdRdWrHdr)) {
+		PsReply(ps, CMD_REP_ERROR, t);
+		return t;
+	}
+	wr->mem = PsMemGet(data[0] & ~CMD_F_RLE);
+	wr->rle = (data[0] & CMD_F_RLE)?TRUE:FALSE;
+	wr->addr = CMD_GET_ADDR(data + 1);
+	wr->len = (data[4]<<8) | data[5];
+	wr->got = 0;
+	wr->seq = 0;
+	wr->single = ps->pipe && (wr->mem < PS_MEM_RAM);
+	// Wrong requests get an error reply, but their payload is received
+	wr->code = CMD_REP_OK;
+	if ((wr->rle && !(ps->cfg.caps & CMD_CAP_RLE)) ||
+			(wr->addr + (wr->rle?0:wr->len) > psMemLen[wr->mem]))
+		wr->code = CMD_REP_ERROR;
+	wr->active = TRUE;
+	if (!wr->single) PsReply(ps, wr->code, t);
+	if (wr->len) return t;
+
+	// No payload follows
+	t = PsWriteEnd(ps, t);
+	if (wr->single) PsReply(ps, wr->code, t);
+	return t;
+}
+
+/************************************************************************//**
+ * Processes a read request, queueing the reply and the read data.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Request.
+ * \param[in] len  Request length.
+ * \param[in] t    Time the request is processed, in ns.
+ ****************************************************************************/
+static void PsRead(ProgSim *ps, const uint8_t *data, uint16_t len,
+		uint64_t t) {
+	int mem = PsMemGet(data[0]);
+	uint32_t addr, rdLen;
+	const uint8_t ok = CMD_REP_OK;
+
+	if (len < sizeof(CmdRdWrHdr)) {
+		PsReply(ps, CMD_REP_ERROR, t);
+		return;
+	}
+	addr = CMD_GET_ADDR(data + 1);
+	rdLen = (data[4]<<8) | data[5];
+	if (addr + rdLen > psMemLen[mem]) {
+		PsReply(ps, CMD_REP_ERROR, t);
+		return;
+	}
+	PsFrameAdd(ps, &ok, 1);
+	PsPayloadAdd(ps, ps->mem[mem] + addr, rdLen);
+	PsTxMark(ps, t);
+}
+
+/************************************************************************//**
+ * Processes an erase request.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Request.
+ * \param[in] len  Request length.
+ * \param[in] t    Time the request is processed, in ns.
+ *
+ * \return Time the firmware completes the request, in ns.
+ ****************************************************************************/
+static uint64_t PsErase(ProgSim *ps, const uint8_t *data, uint16_t len,
+		uint64_t t) {
+	uint8_t *flash = ps->mem[PsMemGet(data[0])];
+	uint32_t addr;
+
+	if (len < sizeof(CmdErase)) {
+		PsReply(ps, CMD_REP_ERROR, t);
+		return t;
+	}
+	addr = CMD_GET_ADDR(data + 1);
+	if (addr == 0xFFFFFF) {
+		memset(flash, 0xFF, PROGSIM_FLASH_LEN);
+		t += ps->cfg.chipMs * PS_NS_PER_MS;
+	} else if (addr < PROGSIM_FLASH_LEN) {
+		memset(flash + (addr & ~(PROGSIM_SECT_LEN - 1)), 0xFF,
+				PROGSIM_SECT_LEN);
+		t += ps->cfg.sectMs * PS_NS_PER_MS;
+	} else {
+		PsReply(ps, CMD_REP_ERROR, t);
+		return t;
+	}
+	PsReply(ps, CMD_REP_OK, t);
+	return t;
+}
+
+/************************************************************************//**
+ * Processes a command request.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Request.
+ * \param[in] len  Request length.
+ * \param[in] t    Time the request is processed, in ns.
+ *
+ * \return Time the firmware completes the request, in ns.
+ ****************************************************************************/
+static uint64_t PsCmd(ProgSim *ps, const uint8_t *data, uint16_t len,
+		uint64_t t) {
+	uint8_t rep[sizeof(CmdRepFlashId)];
+
+	if (!len) return t;
+	switch (data[0]) {
+		case CMD_FW_VER:
+			PsFwVer(ps, data, len, t);
+			break;
+
+		case CMD_CHR_WRITE: case CMD_PRG_WRITE: case CMD_RAM_WRITE:
+		case CMD_CHR_WRITE | CMD_F_RLE: case CMD_PRG_WRITE | CMD_F_RLE:
+		case CMD_RAM_WRITE | CMD_F_RLE:
+			return PsWriteStart(ps, data, len, t);
+
+		case CMD_CHR_READ: case CMD_PRG_READ: case CMD_RAM_READ:
+			PsRead(ps, data, len, t);
+			break;
+
+		case CMD_LOOP_WRITE: case CMD_LOOP_WRITE | CMD_F_RLE:
+			if (!(ps->cfg.caps & CMD_CAP_LOOP)) {
+				PsReply(ps, CMD_REP_ERROR, t);
+				break;
+			}
+			return PsWriteStart(ps, data, len, t);
+
+		case CMD_LOOP_READ:
+			if (!(ps->cfg.caps & CMD_CAP_LOOP)) PsReply(ps, CMD_REP_ERROR, t);
+			else PsRead(ps, data, len, t);
+			break;
+
+		case CMD_CHR_ERASE: case CMD_PRG_ERASE:
+			return PsErase(ps, data, len, t);
+
+		case CMD_FLASH_ID:
+			rep[0] = CMD_REP_OK;
+			rep[1] = 0;
+			rep[2] = rep[6] = PS_MAN_ID;
+			memcpy(rep + 3, psDevId, 3);
+			memcpy(rep + 7, psDevId, 3);
+			PsFrameAdd(ps, rep, sizeof(CmdRepFlashId));
+			PsTxMark(ps, t);
+			break;
+
+		case CMD_MAPPER_SET:
+			if ((len < 2) || (data[1] > 2)) {
+				PsReply(ps, CMD_REP_ERROR, t);
+			} else {
+				ps->mapper = data[1];
+				PsReply(ps, CMD_REP_OK, t);
+			}
+			break;
+
+		case CMD_CAPS:
+			if (ps->cfg.proto < CMD_PROTO_V2) {
+				PsReply(ps, CMD_REP_ERROR, t);
+				break;
+			}
+			rep[0] = CMD_REP_OK;
+			rep[1] = ps->cfg.caps>>8;
+			rep[2] = ps->cfg.caps;
+			PsFrameAdd(ps, rep, sizeof(CmdRepCaps));
+			PsTxMark(ps, t);
+			break;
+
+		default:
+			PsReply(ps, CMD_REP_ERROR, t);
+	}
+	return t;
+}
+
+/************************************************************************//**
+ * Processes a received frame: a command request, or part of a long write
+ * payload if the bulk phase is not in use.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Frame payload.
+ * \param[in] len  Frame payload length.
+ * \param[in] t    Time the frame is processed, in ns.
+ *
+ * \return Time the firmware completes the frame processing, in ns.
+ ****************************************************************************/
+static uint64_t PsFrameRecv(ProgSim *ps, const uint8_t *data, uint16_t len,
+		uint64_t t) {
+	PsWrite *wr = &ps->wr;
+	uint32_t n;
+
+	if (!wr->active) return PsCmd(ps, data, len, t);
+	// With the bulk phase, a frame aborts the payload being received
+	if (ps->bulk) {
+		wr->active = FALSE;
+		return PsCmd(ps, data, len, t);
+	}
+	n = MIN(len, wr->len - wr->got);
+	memcpy(wr->buf + wr->got, data, n);
+	wr->got += n;
+	if (wr->got < wr->len) return t;
+
+	t = PsWriteEnd(ps, t);
+	if (wr->single) PsReply(ps, wr->code, t);
+	return t;
+}
+
+/************************************************************************//**
+ * Processes a received bulk chunk of a long write payload. With CRC
+ * protection, each chunk is acknowledged, and damaged chunks (and the ones
+ * following them) are rejected until sent again.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Cycle data, starting with SOB.
+ * \param[in] len  Cycle data length.
+ * \param[in] t    Time the chunk is processed, in ns.
+ *
+ * \return Time the firmware completes the chunk processing, in ns.
+ ****************************************************************************/
+static uint64_t PsChunkRecv(ProgSim *ps, const uint8_t *data, uint32_t len,
+		uint64_t t) {
+	PsWrite *wr = &ps->wr;
+	uint32_t hdr = ps->crc?2:1;
+	uint32_t tail = ps->crc?3:1;
+	uint32_t n = MIN(wr->len - wr->got, SC_BULK_MAXLEN);
+	int ok;
+	uint16_t crc;
+
+	ok = (len == hdr + n + tail) && (data[len - 1] == SC_EOF);
+	if (ok && ps->crc) {
+		crc = Crc16(Crc16(CRC16_INIT, data + 1, 1), data + 2, n);
+		ok = (data[1] == wr->seq) &&
+			(crc == ((data[len - 3]<<8) | data[len - 2]));
+	}
+	if (!ok) {
+		// Without CRC, damage can only be detected by the host on verify
+		if (!ps->crc) {
+			wr->active = FALSE;
+		} else if (wr->single) {
+			wr->active = FALSE;
+			PsReply(ps, CMD_REP_CRC_ERROR, t);
+		} else {
+			PsReply(ps, CMD_REP_CRC_ERROR, t);
+		}
+		return t;
+	}
+
+	memcpy(wr->buf + wr->got, data + hdr, n);
+	wr->got += n;
+	wr->seq++;
+	if (wr->got == wr->len) {
+		t = PsWriteEnd(ps, t);
+		if (wr->single) PsReply(ps, wr->code, t);
+	}
+	if (!wr->single && ps->crc) PsReply(ps, CMD_REP_OK, t);
+	return t;
+}
+
+/************************************************************************//**
+ * Processes the bytes received during a chip select cycle. Damaged cycles
+ * are dropped, as the firmware synchronizes on each cycle start.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Bytes received during the cycle.
+ * \param[in] len  Number of bytes received.
+ * \param[in] now  Time at the end of the cycle, in nanoseconds.
+ ****************************************************************************/
+void ProgSimCycle(ProgSim *ps, const uint8_t *data, uint32_t len,
+		uint64_t now) {
+	// Requests are processed when the firmware completes the previous ones
+	uint64_t t = MAX(now, ps->busy);
+	uint32_t flen;
+
+	if (!len) return;
+	PsTxCompact(ps);
+	switch (data[0]) {
+		case SC_SOF:
+			if ((len < 3) || ((flen = data[1]) + 3 != len)) break;
+			if (data[len - 1] == SC_EOF)
+				t = PsFrameRecv(ps, data + 2, flen, t);
+			break;
+
+		case SC_SOF_V2:
+			if ((len < 4) || ((flen = (data[1]<<8) | data[2]) + 4 != len))
+				break;
+			if (data[len - 1] == SC_EOF)
+				t = PsFrameRecv(ps, data + 3, flen, t);
+			break;
+
+		case SC_SOB:
+			if (ps->wr.active && ps->bulk) t = PsChunkRecv(ps, data, len, t);
+			break;
+	}
+	ps->busy = t;
+}
+
+/************************************************************************//**
+ * Checks if reply bytes are pending, and when the next one is available.
+ * The programmer ready line is high while a pending byte is available.
+ *
+ * \param[in]  ps    Simulated programmer handler.
+ * \param[out] ready Time the next reply byte is available, in nanoseconds.
+ *
+ * \return TRUE if reply bytes are pending, FALSE otherwise.
+ ****************************************************************************/
+int ProgSimPending(ProgSim *ps, uint64_t *ready) {
+	if (ps->txPos >= ps->txLen) return FALSE;
+	*ready = ps->mark[ps->markHead].ready;
+
+	return TRUE;
+}
+
+/************************************************************************//**
+ * Obtains the next reply byte clocked out by the programmer.
+ *
+ * \param[in]  ps   Simulated programmer handler.
+ * \param[in]  now  Time the byte is clocked, in nanoseconds.
+ * \param[out] byte Reply byte, or SC_FILL if none is available.
+ *
+ * \return TRUE if a reply byte was obtained, FALSE if fill was sent.
+ ****************************************************************************/
+int ProgSimTx(ProgSim *ps, uint64_t now, uint8_t *byte) {
+	if ((ps->txPos >= ps->txLen) || (ps->mark[ps->markHead].ready > now)) {
+		*byte = SC_FILL;
+		return FALSE;
+	}
+	*byte = ps->tx[ps->txPos++];
+	while (ps->markCount && (ps->mark[ps->markHead].end <= ps->txPos)) {
+		ps->markHead++;
+		ps->markCount--;
+	}
+	if (ps->txPos == ps->txLen) {
+		ps->txPos = ps->txLen = 0;
+		ps->markHead = 0;
+	}
+
+	return TRUE;
+}
+
@@ -0,0 +1,132 @@
+/************************************************************************//**
+ * \file
+ * \brief Software model of the programmer firmware.
+ *
+ * \defgroup progsim progsim
+ * \{
+ * \brief Software model of the programmer firmware.
+ *
+ * Models the programmer MCU as seen from the SPI bus: it receives the bytes
+ * clocked in during each chip select cycle, decodes the framing described
+ * in spi-com.h, runs every CMD_* command against in-memory CHR flash, PRG
+ * flash, SRAM and the programmer loopback buffer, and queues the reply
+ * bytes to be clocked out. It is used
+ * by the simulated port backend (sc-sim.c), that adds the USB and SPI
+ * timing and bit errors, so the full program can run without hardware.
+ *
+ * Flash chips behave as NOR flash: programming can only clear bits, and
+ * erasing sets a whole sector (or chip) to 0xFF. Each command takes the
+ * configured time to complete, and its reply is not available until then.
+ * The firmware processes a cycle at a time, so requests sent while it is
+ * busy are queued, and replies are sent in request order.
+ *
+ * With the pipelining feature, flash write requests get a single reply,
+ * after the payload is programmed. SRAM and loopback buffer writes are
+ * always acknowledged as without pipelining, as they are sent using
+ * CmdSendLongCmd().
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _PROGSIM_H_
+#define _PROGSIM_H_
+
+#include <stdint.h>
+
+/// Length of each simulated flash chip (4 MiB)
+#define PROGSIM_FLASH_LEN	(4 * 1024 * 1024)
+/// Length of the simulated flash sectors (uniform, 64 KiB)
+#define PROGSIM_SECT_LEN	0x10000
+/// Maximum number of simulated programmers
+#define PROGSIM_MAX			16
+
+/// Simulated programmer configuration.
+typedef struct {
+	uint8_t proto;		///< Highest protocol version supported (1 or 2)
+	uint8_t features;	///< Protocol features supported (CMD_PROTO_F_*)
+	uint16_t maxFrame;	///< Maximum frame payload length, for protocol v2
+	uint8_t window;		///< Maximum number of outstanding requests
+	uint16_t caps;		///< Capabilities (CMD_CAP_*)
+	uint32_t latency;	///< USB transfer latency, in microseconds
+	uint32_t clkMax;	///< Fastest SPI clock received without errors, Hz
+	uint32_t progNs;	///< Flash program time per byte, in nanoseconds
+	uint32_t sectMs;	///< Flash sector erase time, in milliseconds
+	uint32_t chipMs;	///< Flash chip erase time, in milliseconds
+	double ber;			///< Bit error rate injected on the SPI bus
+	uint8_t count;		///< Number of simulated programmers
+	const char *dir;	///< Directory keeping memory contents, NULL if none
+} ProgSimCfg;
+
+/// Simulated programmer handler
+typedef struct ProgSim ProgSim;
+
+/************************************************************************//**
+ * Obtains the configuration used for the programmers opened from now on.
+ *
+ * \param[out] cfg Simulated programmer configuration.
+ ****************************************************************************/
+void ProgSimCfgGet(ProgSimCfg *cfg);
+
+/************************************************************************//**
+ * Sets the configuration used for the programmers opened from now on.
+ * Out of range values are clamped to the supported ones.
+ *
+ * \param[in] cfg Simulated programmer configuration.
+ ****************************************************************************/
+void ProgSimCfgSet(const ProgSimCfg *cfg);
+
+/************************************************************************//**
+ * Creates a simulated programmer, with a cart inserted. If a directory was
+ * configured, memory contents saved by a previous run are loaded.
+ *
+ * \param[in] serial USB serial number of the programmer.
+ *
+ * \return Simulated programmer handler, or NULL if allocation failed.
+ ****************************************************************************/
+ProgSim *ProgSimNew(const char *serial);
+
+/************************************************************************//**
+ * Frees a simulated programmer. If a directory was configured, memory
+ * contents are saved to it.
+ *
+ * \param[in] ps Simulated programmer handler.
+ ****************************************************************************/
+void ProgSimFree(ProgSim *ps);
+
+/************************************************************************//**
+ * Processes the bytes received during a chip select cycle. Damaged cycles
+ * are dropped, as the firmware synchronizes on each cycle start.
+ *
+ * \param[in] ps   Simulated programmer handler.
+ * \param[in] data Bytes received during the cycle.
+ * \param[in] len  Number of bytes received.
+ * \param[in] now  Time at the end of the cycle, in nanoseconds.
+ ****************************************************************************/
+void ProgSimCycle(ProgSim *ps, const uint8_t *data, uint32_t len,
+		uint64_t now);
+
+/************************************************************************//**
+ * Checks if reply bytes are pending, and when the next one is available.
+ * The programmer ready line is high while a pending byte is available.
+ *
+ * \param[in]  ps    Simulated programmer handler.
+ * \param[out] ready Time the next reply byte is available, in nanoseconds.
+ *
+ * \return TRUE if reply bytes are pending, FALSE otherwise.
+ ****************************************************************************/
+int ProgSimPending(ProgSim *ps, uint64_t *ready);
+
+/************************************************************************//**
+ * Obtains the next reply byte clocked out by the programmer.
+ *
+ * \param[in]  ps   Simulated programmer handler.
+ * \param[in]  now  Time the byte is clocked, in nanoseconds.
+ * \param[out] byte Reply byte, or SC_FILL if none is available.
+ *
+ * \return TRUE if a reply byte was obtained, FALSE if fill was sent.
+ ****************************************************************************/
+int ProgSimTx(ProgSim *ps, uint64_t now, uint8_t *byte);
+
+#endif /*_PROGSIM_H_*/
+
+/** \} */
@@ -0,0 +1,87 @@
+/************************************************************************//**
+ * \file
+ * \brief Run length encoding of write payloads.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "rle.h"
+#include <string.h>
+
+/// Maximum number of bytes encoded by a control byte
+#define RLE_BLOCK_MAX	128
+/// Minimum run length worth encoding as a run
+#define RLE_RUN_MIN		3
+
+/************************************************************************//**
+ * Encodes data using PackBits run length encoding.
+ *
+ * \param[in]  in     Data to encode.
+ * \param[in]  len    Length of the data to encode.
+ * \param[out] out    Buffer for the encoded data.
+ * \param[in]  maxLen Length of the output buffer.
+ *
+ * \return Length of the encoded data, or -1 if it does not fit in the
+ *         output buffer.
+ ****************************************************************************/
+int RleEncode(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t maxLen) {
+	uint32_t i, o, n;
+
+	for (i = 0, o = 0; i < len; i += n) {
+		// Measure the run starting at current position
+		for (n = 1; (i + n < len) && (n < RLE_BLOCK_MAX) &&
+				(in[i + n] == in[i]); n++);
+		if (n >= RLE_RUN_MIN) {
+			if (o + 2 > maxLen) return -1;
+			out[o++] = 257 - n;
+			out[o++] = in[i];
+			continue;
+		}
+		// Literal block, up to the start of the next run
+		for (n = 0; (i + n < len) && (n < RLE_BLOCK_MAX); n++) {
+			if ((i + n + 2 < len) && (in[i + n] == in[i + n + 1]) &&
+					(in[i + n] == in[i + n + 2])) break;
+		}
+		if (o + 1 + n > maxLen) return -1;
+		out[o++] = n - 1;
+		memcpy(out + o, in + i, n);
+		o += n;
+	}
+
+	return o;
+}
+
+/************************************************************************//**
+ * Decodes data encoded with RleEncode(), as the programmer firmware does.
+ *
+ * \param[in]  in     Encoded data.
+ * \param[in]  len    Length of the encoded data.
+ * \param[out] out    Buffer for the decoded data.
+ * \param[in]  maxLen Length of the output buffer.
+ *
+ * \return Length of the decoded data, or -1 if encoded data is malformed
+ *         or decoded data does not fit in the output buffer.
+ ****************************************************************************/
+int RleDecode(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t maxLen) {
+	uint32_t i, o, n;
+
+	for (i = 0, o = 0; i < len; o += n) {
+		if (in[i] < 128) {
+			// Literal block
+			n = in[i++] + 1;
+			if ((i + n > len) || (o + n > maxLen)) return -1;
+			memcpy(out + o, in + i, n);
+			i += n;
+		} else if (in[i] > 128) {
+			// Run
+			n = 257 - in[i++];
+			if ((i >= len) || (o + n > maxLen)) return -1;
+			memset(out + o, in[i++], n);
+		} else {
+			return -1;
+		}
+	}
+
+	return o;
+}
+
@@ -0,0 +1,50 @@
+/************************************************************************//**
+ * \file
+ * \brief Run length encoding of write payloads.
+ *
+ * \defgroup rle rle
+ * \{
+ * \brief Run length encoding of write payloads.
+ *
+ * Uses the PackBits format: a control byte n from 0 to 127 is followed by
+ * n + 1 literal bytes, and a control byte n from 129 to 255 is followed by
+ * a byte to repeat 257 - n times. Control byte 128 is not used. Decoding is
+ * cheap enough for the programmer MCU.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _RLE_H_
+#define _RLE_H_
+
+#include <stdint.h>
+
+/************************************************************************//**
+ * Encodes data using PackBits run length encoding.
+ *
+ * \param[in]  in     Data to encode.
+ * \param[in]  len    Length of the data to encode.
+ * \param[out] out    Buffer for the encoded data.
+ * \param[in]  maxLen Length of the output buffer.
+ *
+ * \return Length of the encoded data, or -1 if it does not fit in the
+ *         output buffer.
+ ****************************************************************************/
+int RleEncode(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t maxLen);
+
+/************************************************************************//**
+ * Decodes data encoded with RleEncode(), as the programmer firmware does.
+ *
+ * \param[in]  in     Encoded data.
+ * \param[in]  len    Length of the encoded data.
+ * \param[out] out    Buffer for the decoded data.
+ * \param[in]  maxLen Length of the output buffer.
+ *
+ * \return Length of the decoded data, or -1 if encoded data is malformed
+ *         or decoded data does not fit in the output buffer.
+ ****************************************************************************/
+int RleDecode(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t maxLen);
+
+#endif /*_RLE_H_*/
+
+/** \} */
@@ -0,0 +1,267 @@
+/************************************************************************//**
+ * \file
+ * \brief spi-com port driving the FT2232 MPSSE engine through libftdi.
+ *
+ * Configures the MPSSE engine the same way libmpsse does for SPI mode 0,
+ * MSB first, without using libmpsse at all.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "sc-port.h"
+#include "util.h"
+#include <stdlib.h>
+#include <ftdi.h>
+
+/// Delay after resetting and configuring the MPSSE engine
+#define SC_FTDI_SETUP_MS	25
+
+/// Master clock with divide by 5 enabled
+#define SC_FTDI_CLK_12MHZ	12000000
+/// Master clock with divide by 5 disabled (H devices only)
+#define SC_FTDI_CLK_60MHZ	60000000
+
+/// libftdi port data
+typedef struct {
+	ScPort port;				///< Generic port data, must be first
+	struct ftdi_context *ftdi;	///< libftdi context
+} ScFtdi;
+
+/************************************************************************//**
+ * Lists the serial numbers of the connected programmers, using libftdi.
+ * Used by the backends based on libftdi.
+ *
+ * \param[out] serial Serial numbers of the found programmers.
+ * \param[in]  max    Maximum number of serial numbers to obtain.
+ *
+ * \return Number of programmers found, or SC_ERROR.
+ ****************************************************************************/
+int SCFtdiList(char serial[][SC_SERIAL_MAXLEN], int max) {
+	struct ftdi_context *ftdi;
+	struct ftdi_device_list *devs = NULL;
+	struct ftdi_device_list *d;
+	int n = 0;
+
+	if (!(ftdi = ftdi_new())) return SC_ERROR;
+	if (ftdi_usb_find_all(ftdi, &devs, SC_VID, SC_PID) < 0) n = SC_ERROR;
+	for (d = devs; d && n < max; d = d->next) {
+		if (!ftdi_usb_get_strings(ftdi, d->dev, NULL, 0, NULL, 0,
+				serial[n], SC_SERIAL_MAXLEN)) n++;
+	}
+	ftdi_list_free(&devs);
+	ftdi_free(ftdi);
+
+	return n;
+}
+
+/************************************************************************//**
+ * Writes a MPSSE command stream.
+ *
+ * \param[in] port Port handler.
+ * \param[in] buf  Command stream to write.
+ * \param[in] len  Length of the command stream.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCFtdiWrite(ScPort *port, const uint8_t *buf, int len) {
+	ScFtdi *f = (ScFtdi*)port;
+
+	return ftdi_write_data(f->ftdi, (unsigned char*)buf, len) == len?
+		SC_OK:SC_ERROR;
+}
+
+#ifndef SC_NO_ASYNC
+/************************************************************************//**
+ * Submits an asynchronous write using libftdi. Used by the backends based
+ * on libftdi.
+ *
+ * \param[in] ftdi libftdi context.
+ * \param[in] buf  Command stream to write.
+ * \param[in] len  Length of the command stream.
+ *
+ * \return Transfer handler, or NULL if submission failed.
+ ****************************************************************************/
+ScXfer *SCFtdiSubmit(struct ftdi_context *ftdi, uint8_t *buf, int len) {
+	return (ScXfer*)ftdi_write_data_submit(ftdi, buf, len);
+}
+
+/************************************************************************//**
+ * Waits for a write submitted with SCFtdiSubmit() to complete.
+ *
+ * \param[in] xfer Transfer handler.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCFtdiWait(ScXfer *xfer) {
+	return ftdi_transfer_data_done((struct ftdi_transfer_control*)xfer) < 0?
+		SC_ERROR:SC_OK;
+}
+
+/************************************************************************//**
+ * Submits a MPSSE command stream write, without waiting for it to complete.
+ *
+ * \param[in] port Port handler.
+ * \param[in] buf  Command stream to write.
+ * \param[in] len  Length of the command stream.
+ *
+ * \return Transfer handler, or NULL if submission failed.
+ ****************************************************************************/
+static ScXfer *SCFtdiPortSubmit(ScPort *port, uint8_t *buf, int len) {
+	return SCFtdiSubmit(((ScFtdi*)port)->ftdi, buf, len);
+}
+
+/************************************************************************//**
+ * Waits for a submitted write to complete.
+ *
+ * \param[in] port Port handler.
+ * \param[in] xfer Transfer handler.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCFtdiPortWait(ScPort *port, ScXfer *xfer) {
+	return SCFtdiWait(xfer);
+}
+#endif
+
+/************************************************************************//**
+ * Reads exactly len bytes of data clocked in by previous commands.
+ *
+ * \param[in]  port Port handler.
+ * \param[out] buf  Buffer for the read data.
+ * \param[in]  len  Number of bytes to read.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCFtdiRead(ScPort *port, uint8_t *buf, int len) {
+	ScFtdi *f = (ScFtdi*)port;
+	int recvd, ret;
+
+	for (recvd = 0; recvd < len; recvd += ret) {
+		if ((ret = ftdi_read_data(f->ftdi, buf + recvd, len - recvd)) < 0)
+			return SC_ERROR;
+	}
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Applies link settings: SPI clock, latency timer and USB chunk size.
+ *
+ * \param[in] port Port handler.
+ * \param[in] cfg  Link settings to apply.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCFtdiLink(ScPort *port, const ScLinkCfg *cfg) {
+	ScFtdi *f = (ScFtdi*)port;
+	uint32_t master = SC_FTDI_CLK_12MHZ;
+	uint32_t div;
+	uint8_t cmd[4];
+
+	// Same as libmpsse: only use 60 MHz master clock if needed
+	cmd[0] = SC_MPSSE_EN_DIV5;
+	if (cfg->clk > (SC_FTDI_CLK_12MHZ / 2)) {
+		master = SC_FTDI_CLK_60MHZ;
+		cmd[0] = SC_MPSSE_DIS_DIV5;
+	}
+	div = ((master / MAX(cfg->clk, 1)) / 2) - 1;
+	cmd[1] = SC_MPSSE_TCK_DIVISOR;
+	cmd[2] = div;
+	cmd[3] = div>>8;
+
+	if (SCFtdiWrite(port, cmd, sizeof(cmd)) ||
+			ftdi_set_latency_timer(f->ftdi, cfg->latency) ||
+			ftdi_write_data_set_chunksize(f->ftdi, cfg->chunk) ||
+			ftdi_read_data_set_chunksize(f->ftdi, cfg->chunk))
+		return SC_ERROR;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Closes the device and frees the port.
+ *
+ * \param[in] port Port handler.
+ ****************************************************************************/
+static void SCFtdiClose(ScPort *port) {
+	ScFtdi *f = (ScFtdi*)port;
+
+	ftdi_set_bitmode(f->ftdi, 0, BITMODE_RESET);
+	ftdi_usb_close(f->ftdi);
+	ftdi_free(f->ftdi);
+	free(f);
+}
+
+/************************************************************************//**
+ * Opens the device with the specified serial number, and sets the MPSSE
+ * engine in SPI mode 0 with default link settings. PORTB LED is turned on.
+ *
+ * \param[in] serial Serial number of the device, or NULL for the first one.
+ *
+ * \return Port handler, or NULL if the device could not be opened.
+ ****************************************************************************/
+static ScPort *SCFtdiOpen(const char *serial) {
+	const ScLinkCfg def = {SC_SPI_CLK, SC_USB_CHUNK, SC_LATENCY_MS};
+	ScFtdi *f;
+	uint8_t cmd[7];
+
+	if (!(f = calloc(1, sizeof(ScFtdi)))) return NULL;
+	if (!(f->ftdi = ftdi_new())) {
+		free(f);
+		return NULL;
+	}
+	f->port.ops = &scFtdiOps;
+	// SPI mode 0: CS active low, clock idle low, write on falling edge
+	f->port.tris = SC_PIN_TRIS;
+	f->port.pidle = f->port.pstop = SC_PIN_CS;
+	f->port.pstart = 0;
+	f->port.tx = SC_MPSSE_DO_WRITE | SC_MPSSE_WRITE_NEG;
+	f->port.rx = SC_MPSSE_DO_READ;
+	f->port.txrx = SC_MPSSE_DO_WRITE | SC_MPSSE_DO_READ | SC_MPSSE_WRITE_NEG;
+
+	if (ftdi_set_interface(f->ftdi, SC_IFACE) ||
+			ftdi_usb_open_desc_index(f->ftdi, SC_VID, SC_PID, NULL, serial,
+				0)) {
+		ftdi_free(f->ftdi);
+		free(f);
+		return NULL;
+	}
+	if (ftdi_usb_reset(f->ftdi) ||
+			ftdi_set_bitmode(f->ftdi, 0, BITMODE_RESET) ||
+			ftdi_set_bitmode(f->ftdi, 0, BITMODE_MPSSE) ||
+			ftdi_usb_purge_buffers(f->ftdi)) goto err;
+	DelayMs(SC_FTDI_SETUP_MS);
+
+	// Set pins idle. High byte pins are outputs driven low, this turns
+	// PORTB LED (GPIOH1) ON.
+	cmd[0] = SC_MPSSE_LOOPBACK_END;
+	cmd[1] = SC_MPSSE_SET_LOW;
+	cmd[2] = f->port.pidle;
+	cmd[3] = f->port.tris;
+	cmd[4] = SC_MPSSE_SET_HIGH;
+	cmd[5] = 0x00;
+	cmd[6] = 0xFF;
+	if (SCFtdiWrite(&f->port, cmd, sizeof(cmd)) ||
+			SCFtdiLink(&f->port, &def)) goto err;
+
+	return &f->port;
+
+err:
+	SCFtdiClose(&f->port);
+	return NULL;
+}
+
+/// Port backend driving the MPSSE engine directly through libftdi
+const ScPortOps scFtdiOps = {
+	.name = "ftdi",
+	.list = SCFtdiList,
+	.open = SCFtdiOpen,
+	.close = SCFtdiClose,
+	.link = SCFtdiLink,
+	.write = SCFtdiWrite,
+	.read = SCFtdiRead,
+#ifndef SC_NO_ASYNC
+	.submit = SCFtdiPortSubmit,
+	.wait = SCFtdiPortWait
+#endif
+};
+
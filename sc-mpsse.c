@@ -0,0 +1,167 @@
+/************************************************************************//**
+ * \file
+ * \brief spi-com port using libmpsse.
+ *
+ * libmpsse is used to open and configure the device. Command streams are
+ * written and read through the libftdi context owned by libmpsse, because
+ * libmpsse cannot queue several commands in a single transfer.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "sc-port.h"
+#include <stdlib.h>
+#include <mpsse.h>
+
+/// SPI mode for using with MPSSE library
+#define SC_SPI_MODE		SPI0
+
+/// libmpsse port data
+typedef struct {
+	ScPort port;					///< Generic port data, must be first
+	struct mpsse_context *mpsse;	///< libmpsse context
+} ScMpsse;
+
+/************************************************************************//**
+ * Writes a MPSSE command stream.
+ *
+ * \param[in] port Port handler.
+ * \param[in] buf  Command stream to write.
+ * \param[in] len  Length of the command stream.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCMpsseWrite(ScPort *port, const uint8_t *buf, int len) {
+	ScMpsse *m = (ScMpsse*)port;
+
+	return ftdi_write_data(&m->mpsse->ftdi, (unsigned char*)buf, len) ==
+		len?SC_OK:SC_ERROR;
+}
+
+#ifndef SC_NO_ASYNC
+/************************************************************************//**
+ * Submits a MPSSE command stream write, without waiting for it to complete.
+ *
+ * \param[in] port Port handler.
+ * \param[in] buf  Command stream to write.
+ * \param[in] len  Length of the command stream.
+ *
+ * \return Transfer handler, or NULL if submission failed.
+ ****************************************************************************/
+static ScXfer *SCMpsseSubmit(ScPort *port, uint8_t *buf, int len) {
+	return SCFtdiSubmit(&((ScMpsse*)port)->mpsse->ftdi, buf, len);
+}
+
+/************************************************************************//**
+ * Waits for a submitted write to complete.
+ *
+ * \param[in] port Port handler.
+ * \param[in] xfer Transfer handler.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCMpsseWait(ScPort *port, ScXfer *xfer) {
+	return SCFtdiWait(xfer);
+}
+#endif
+
+/************************************************************************//**
+ * Reads exactly len bytes of data clocked in by previous commands.
+ *
+ * \param[in]  port Port handler.
+ * \param[out] buf  Buffer for the read data.
+ * \param[in]  len  Number of bytes to read.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCMpsseRead(ScPort *port, uint8_t *buf, int len) {
+	ScMpsse *m = (ScMpsse*)port;
+	int recvd, ret;
+
+	for (recvd = 0; recvd < len; recvd += ret) {
+		if ((ret = ftdi_read_data(&m->mpsse->ftdi, buf + recvd,
+				len - recvd)) < 0) return SC_ERROR;
+	}
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Applies link settings: SPI clock, latency timer and USB chunk size.
+ *
+ * \param[in] port Port handler.
+ * \param[in] cfg  Link settings to apply.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCMpsseLink(ScPort *port, const ScLinkCfg *cfg) {
+	ScMpsse *m = (ScMpsse*)port;
+	struct ftdi_context *ftdi = &m->mpsse->ftdi;
+
+	if (SetClock(m->mpsse, cfg->clk) ||
+			ftdi_set_latency_timer(ftdi, cfg->latency) ||
+			ftdi_write_data_set_chunksize(ftdi, cfg->chunk) ||
+			ftdi_read_data_set_chunksize(ftdi, cfg->chunk)) return SC_ERROR;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Closes the device and frees the port.
+ *
+ * \param[in] port Port handler.
+ ****************************************************************************/
+static void SCMpsseClose(ScPort *port) {
+	ScMpsse *m = (ScMpsse*)port;
+
+	Close(m->mpsse);
+	free(m);
+}
+
+/************************************************************************//**
+ * Opens the device with the specified serial number using libmpsse, in SPI
+ * mode 0 with default link settings. PORTB LED is turned on.
+ *
+ * \param[in] serial Serial number of the device, or NULL for the first one.
+ *
+ * \return Port handler, or NULL if the device could not be opened.
+ ****************************************************************************/
+static ScPort *SCMpsseOpen(const char *serial) {
+	ScMpsse *m;
+
+	if (!(m = calloc(1, sizeof(ScMpsse)))) return NULL;
+	m->mpsse = Open(SC_VID, SC_PID, SC_SPI_MODE, SC_SPI_CLK, MSB, SC_IFACE,
+			NULL, serial);
+	if (!m->mpsse) {
+		free(m);
+		return NULL;
+	}
+	m->port.ops = &scMpsseOps;
+	// Use the pin values and data commands libmpsse computed for the mode
+	m->port.tris = m->mpsse->tris;
+	m->port.pstart = m->mpsse->pstart;
+	m->port.pstop = m->mpsse->pstop;
+	m->port.pidle = m->mpsse->pidle;
+	m->port.tx = m->mpsse->tx;
+	m->port.rx = m->mpsse->rx;
+	m->port.txrx = m->mpsse->txrx;
+	// Turn ON PORTB LED (GPIOH1).
+	PinLow(m->mpsse, GPIOH1);
+
+	return &m->port;
+}
+
+/// Port backend using libmpsse
+const ScPortOps scMpsseOps = {
+	.name = "mpsse",
+	.list = SCFtdiList,
+	.open = SCMpsseOpen,
+	.close = SCMpsseClose,
+	.link = SCMpsseLink,
+	.write = SCMpsseWrite,
+	.read = SCMpsseRead,
+#ifndef SC_NO_ASYNC
+	.submit = SCMpsseSubmit,
+	.wait = SCMpsseWait
+#endif
+};
+
@@ -0,0 +1,149 @@
+/************************************************************************//**
+ * \file
+ * \brief Low level MPSSE ports used by the spi-com module.
+ *
+ * \defgroup sc-port sc-port
+ * \{
+ * \brief Low level MPSSE ports used by the spi-com module.
+ *
+ * The spi-com module builds raw MPSSE command streams (including chip
+ * select changes), and uses a port to send them to the FT2232 and to read
+ * the data clocked in. Several port backends are available, selectable at
+ * build time (SC_BACKEND_DEFAULT) and at runtime with SCBackendSet():
+ * - mpsse: uses libmpsse to open and configure the device.
+ * - ftdi: drives the MPSSE engine directly through libftdi.
+ * - sim: runs the command streams on simulated programmers, only available
+ *   when built with SC_SIM defined.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _SC_PORT_H_
+#define _SC_PORT_H_
+
+#include <stdint.h>
+#include "spi-com.h"
+
+struct ftdi_context;
+
+/** \addtogroup ScMpsseCmds
+ *  \brief MPSSE engine commands, as documented in FTDI AN_108.
+ *  \{ */
+#define SC_MPSSE_WRITE_NEG		0x01	///< Write on clock falling edge
+#define SC_MPSSE_DO_WRITE		0x10	///< Clock data out
+#define SC_MPSSE_DO_READ		0x20	///< Clock data in
+#define SC_MPSSE_SET_LOW		0x80	///< Set low byte pins
+#define SC_MPSSE_SET_HIGH		0x82	///< Set high byte pins
+#define SC_MPSSE_LOOPBACK_END	0x85	///< Disable loopback
+#define SC_MPSSE_TCK_DIVISOR	0x86	///< Set clock divisor
+#define SC_MPSSE_SEND_IMM		0x87	///< Flush data to host
+#define SC_MPSSE_WAIT_HIGH		0x88	///< Wait until GPIOL1 is high
+#define SC_MPSSE_DIS_DIV5		0x8A	///< Use 60 MHz master clock
+#define SC_MPSSE_EN_DIV5		0x8B	///< Use 12 MHz master clock
+/** \} */
+
+/// FT2232 interface used to communicate with the microcontroller (B)
+#define SC_IFACE		2
+
+/// Low byte pins: SPI clock
+#define SC_PIN_SK		0x01
+/// Low byte pins: SPI data out
+#define SC_PIN_DO		0x02
+/// Low byte pins: SPI data in
+#define SC_PIN_DI		0x04
+/// Low byte pins: SPI chip select
+#define SC_PIN_CS		0x08
+/// Low byte pins: programmer ready line (GPIOL1), input when used
+#define SC_PIN_READY	0x20
+/// Low byte pins: directions (1 output, 0 input). All but DI are outputs.
+#define SC_PIN_TRIS		0xFB
+
+typedef struct ScPort ScPort;
+
+/// Asynchronous transfer handler, defined by each port backend
+typedef struct ScXfer ScXfer;
+
+/// Operations implemented by each port backend.
+typedef struct {
+	const char *name;	///< Backend name
+	/// Lists serial numbers of connected programmers, returns the count
+	int (*list)(char serial[][SC_SERIAL_MAXLEN], int max);
+	/// Opens the device with the specified serial (NULL for the first one)
+	ScPort *(*open)(const char *serial);
+	/// Closes the device and frees the port
+	void (*close)(ScPort *port);
+	/// Applies link settings
+	int (*link)(ScPort *port, const ScLinkCfg *cfg);
+	/// Writes a MPSSE command stream
+	int (*write)(ScPort *port, const uint8_t *buf, int len);
+	/// Reads exactly len bytes of data clocked in by previous commands
+	int (*read)(ScPort *port, uint8_t *buf, int len);
+	/// Submits a MPSSE command stream write, returning without waiting for
+	/// it to complete. Buffer must be kept until wait() returns. NULL if
+	/// asynchronous transfers are not supported.
+	ScXfer *(*submit)(ScPort *port, uint8_t *buf, int len);
+	/// Waits for a submitted write to complete
+	int (*wait)(ScPort *port, ScXfer *xfer);
+} ScPortOps;
+
+/// Port handler. Backends embed it at the start of their own data.
+struct ScPort {
+	const ScPortOps *ops;	///< Backend operations
+	uint8_t tris;		///< Low byte pins direction (1 output, 0 input)
+	uint8_t pstart;		///< Low byte pins value when frame starts
+	uint8_t pstop;		///< Low byte pins value when frame stops
+	uint8_t pidle;		///< Low byte pins value when idle
+	uint8_t tx;			///< MPSSE data write command
+	uint8_t rx;			///< MPSSE data read command
+	uint8_t txrx;		///< MPSSE data write and read command
+};
+
+#ifndef SC_NO_MPSSE
+/// Port backend using libmpsse
+extern const ScPortOps scMpsseOps;
+#endif
+/// Port backend driving the MPSSE engine directly through libftdi
+extern const ScPortOps scFtdiOps;
+#ifdef SC_SIM
+/// Port backend connected to simulated programmers
+extern const ScPortOps scSimOps;
+#endif
+
+/************************************************************************//**
+ * Lists the serial numbers of the connected programmers, using libftdi.
+ * Used by the backends based on libftdi.
+ *
+ * \param[out] serial Serial numbers of the found programmers.
+ * \param[in]  max    Maximum number of serial numbers to obtain.
+ *
+ * \return Number of programmers found, or SC_ERROR.
+ ****************************************************************************/
+int SCFtdiList(char serial[][SC_SERIAL_MAXLEN], int max);
+
+#ifndef SC_NO_ASYNC
+/************************************************************************//**
+ * Submits an asynchronous write using libftdi. Used by the backends based
+ * on libftdi.
+ *
+ * \param[in] ftdi libftdi context.
+ * \param[in] buf  Command stream to write.
+ * \param[in] len  Length of the command stream.
+ *
+ * \return Transfer handler, or NULL if submission failed.
+ ****************************************************************************/
+ScXfer *SCFtdiSubmit(struct ftdi_context *ftdi, uint8_t *buf, int len);
+
+/************************************************************************//**
+ * Waits for a write submitted with SCFtdiSubmit() to complete.
+ *
+ * \param[in] xfer Transfer handler.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCFtdiWait(ScXfer *xfer);
+#endif
+
+#endif /*_SC_PORT_H_*/
+
+/** \} */
+
@@ -0,0 +1,457 @@
+/************************************************************************//**
+ * \file
+ * \brief spi-com port connected to a simulated programmer.
+ *
+ * Interprets the MPSSE command streams as the FT2232 would, clocking the
+ * bytes in and out of a software model of the programmer firmware. Time is
+ * simulated: each byte takes the time needed at the configured SPI clock,
+ * and each USB transfer adds the configured latency. Calls sleep so the
+ * simulation runs in real time, making transfer rates and durations the
+ * same a real programmer would get. Bit errors are injected at the
+ * configured rate, and at a much higher one above the fastest SPI clock
+ * the programmer supports.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "sc-port.h"
+#include "progsim.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+/// Serial number prefix of the simulated programmers
+#define SC_SIM_PREFIX		"SIM"
+
+/// Master clock with divide by 5 enabled
+#define SC_SIM_CLK_12MHZ	12000000
+/// Master clock with divide by 5 disabled
+#define SC_SIM_CLK_60MHZ	60000000
+
+/// Bit error rate when the SPI clock is faster than the programmer supports
+#define SC_SIM_BER_OVERCLK	1e-4
+
+/// Length of the buffer holding the bytes written during a cycle
+#define SC_SIM_CYCLE_LEN	65536
+
+/// Fill bytes read with no reply pending before the programmer is
+/// considered hung (a real one would make the host wait forever)
+#define SC_SIM_IDLE_MAX		65536
+
+/// Nanoseconds per microsecond
+#define SC_SIM_NS_PER_US	1000ULL
+
+/// Simulated port data
+typedef struct {
+	ScPort port;		///< Generic port data, must be first
+	ProgSim *fw;		///< Simulated programmer firmware
+	GRand *rand;		///< Random generator for bit errors
+	uint32_t latency;	///< USB transfer latency, in microseconds
+	uint32_t clkMax;	///< Fastest SPI clock supported, in Hz
+	double ber;			///< Configured bit error rate
+	uint8_t pins;		///< Low byte pins value
+	uint8_t div5;		///< Master clock divide by 5 enabled
+	uint16_t div;		///< Clock divisor
+	uint64_t now;		///< Simulated time, in nanoseconds
+	uint32_t idle;		///< Fill bytes read with no reply pending
+	uint8_t hung;		///< Host is waiting for a reply that never comes
+	uint32_t cycleLen;	///< Bytes written during the current cycle
+	uint8_t cycle[SC_SIM_CYCLE_LEN];	///< Bytes written during the cycle
+	uint8_t *rx;		///< Data clocked in, waiting to be read
+	uint32_t rxLen;		///< Number of bytes in the rx buffer
+	uint32_t rxPos;		///< Position of the next byte to read
+	uint32_t rxSize;	///< Length of the rx buffer
+} ScSim;
+
+/************************************************************************//**
+ * Lists the serial numbers of the simulated programmers.
+ *
+ * \param[out] serial Serial numbers of the simulated programmers.
+ * \param[in]  max    Maximum number of serial numbers to obtain.
+ *
+ * \return Number of simulated programmers.
+ ****************************************************************************/
+static int SCSimList(char serial[][SC_SERIAL_MAXLEN], int max) {
+	ProgSimCfg cfg;
+	int i;
+
+	ProgSimCfgGet(&cfg);
+	for (i = 0; (i < cfg.count) && (i < max); i++)
+		snprintf(serial[i], SC_SERIAL_MAXLEN, SC_SIM_PREFIX "%04d", i + 1);
+
+	return i;
+}
+
+/************************************************************************//**
+ * Obtains the SPI clock frequency set in the MPSSE engine.
+ *
+ * \param[in] s Simulated port.
+ *
+ * \return SPI clock frequency, in Hz.
+ ****************************************************************************/
+static uint32_t SCSimClk(ScSim *s) {
+	uint32_t master = s->div5?SC_SIM_CLK_12MHZ:SC_SIM_CLK_60MHZ;
+
+	return master / ((s->div + 1) * 2);
+}
+
+/************************************************************************//**
+ * Flips a random bit of a byte clocked through the SPI bus, with the bit
+ * error rate corresponding to the SPI clock.
+ *
+ * \param[in] s     Simulated port.
+ * \param[in] clk   SPI clock frequency, in Hz.
+ * \param[in] byte  Byte clocked through the bus.
+ *
+ * \return The byte, possibly damaged.
+ ****************************************************************************/
+static uint8_t SCSimNoise(ScSim *s, uint32_t clk, uint8_t byte) {
+	double ber = s->ber;
+
+	if (clk > s->clkMax) ber = MAX(ber, SC_SIM_BER_OVERCLK);
+	if ((ber > 0) && (g_rand_double(s->rand) < 8 * ber))
+		byte ^= 1<<g_rand_int_range(s->rand, 0, 8);
+
+	return byte;
+}
+
+/************************************************************************//**
+ * Appends a byte clocked in by the host to the rx buffer.
+ *
+ * \param[in] s    Simulated port.
+ * \param[in] byte Byte clocked in.
+ *
+ * \return SC_OK on success, SC_ERROR if the buffer could not grow.
+ ****************************************************************************/
+static int SCSimRxAdd(ScSim *s, uint8_t byte) {
+	uint32_t size;
+	uint8_t *rx;
+
+	if (s->rxPos && (s->rxPos == s->rxLen)) s->rxPos = s->rxLen = 0;
+	if (s->rxLen == s->rxSize) {
+		size = MAX(s->rxSize * 2, SC_SIM_CYCLE_LEN);
+		if (!(rx = realloc(s->rx, size))) return SC_ERROR;
+		s->rx = rx;
+		s->rxSize = size;
+	}
+	s->rx[s->rxLen++] = byte;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Runs a MPSSE data command, clocking bytes out to and in from the
+ * simulated programmer.
+ *
+ * \param[in] s    Simulated port.
+ * \param[in] op   MPSSE data command.
+ * \param[in] data Bytes to write, NULL if the command does not write.
+ * \param[in] len  Number of bytes to clock.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCSimData(ScSim *s, uint8_t op, const uint8_t *data,
+		uint32_t len) {
+	uint32_t clk = SCSimClk(s);
+	uint64_t byteNs = MAX(8000000000ULL / clk, 1);
+	uint64_t ready;
+	uint32_t i, n;
+	uint8_t byte;
+	int cs = !(s->pins & SC_PIN_CS);
+
+	for (i = 0; i < len; i++) {
+		s->now += byteNs;
+		byte = SC_FILL;
+		if (data && cs) {
+			if (s->cycleLen < SC_SIM_CYCLE_LEN)
+				s->cycle[s->cycleLen] = SCSimNoise(s, clk, data[i]);
+			s->cycleLen++;
+		}
+		if (!(op & SC_MPSSE_DO_READ)) continue;
+		if (cs && ProgSimTx(s->fw, s->now, &byte)) {
+			s->idle = 0;
+			byte = SCSimNoise(s, clk, byte);
+		} else if (!data && (!cs || !ProgSimPending(s->fw, &ready) ||
+					(ready > s->now))) {
+			// Skip the fill bytes read while no reply is available
+			n = len - i - 1;
+			if (cs && ProgSimPending(s->fw, &ready)) {
+				n = MIN(n, (ready - s->now) / byteNs);
+			} else if (cs) {
+				s->idle += n + 1;
+			}
+			s->now += byteNs * n;
+			while (n--) {
+				if (SCSimRxAdd(s, SC_FILL)) return SC_ERROR;
+				i++;
+			}
+			if (s->idle > SC_SIM_IDLE_MAX) s->hung = TRUE;
+		}
+		if (SCSimRxAdd(s, byte)) return SC_ERROR;
+	}
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Sets the low byte pins. Chip select transitions start and end cycles.
+ *
+ * \param[in] s    Simulated port.
+ * \param[in] pins Low byte pins value.
+ * \param[in] tris Low byte pins direction.
+ ****************************************************************************/
+static void SCSimPins(ScSim *s, uint8_t pins, uint8_t tris) {
+	// Chip select is asserted when driven low
+	int csWas = !(s->pins & SC_PIN_CS);
+	int cs = (tris & SC_PIN_CS) && !(pins & SC_PIN_CS);
+
+	s->pins = cs?(pins & ~SC_PIN_CS):(pins | SC_PIN_CS);
+	if (!csWas && cs) {
+		s->cycleLen = 0;
+	} else if (csWas && !cs) {
+		// Overflowing cycles are dropped
+		ProgSimCycle(s->fw, s->cycle, s->cycleLen > SC_SIM_CYCLE_LEN?
+				0:s->cycleLen, s->now);
+	}
+}
+
+/************************************************************************//**
+ * Writes a MPSSE command stream, running it on the simulated programmer.
+ *
+ * \param[in] port Port handler.
+ * \param[in] buf  Command stream to write.
+ * \param[in] len  Length of the command stream.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCSimWrite(ScPort *port, const uint8_t *buf, int len) {
+	ScSim *s = (ScSim*)port;
+	uint64_t ready;
+	uint32_t dLen;
+	int pos = 0;
+	uint8_t op;
+
+	s->now = MAX(s->now, (uint64_t)g_get_monotonic_time() *
+			SC_SIM_NS_PER_US) + s->latency * SC_SIM_NS_PER_US / 2;
+	while (pos < len) {
+		op = buf[pos++];
+		if (!(op & 0x80)) {
+			// Data command, length field holds the length minus 1
+			if (pos + 2 > len) return SC_ERROR;
+			dLen = (buf[pos] | (buf[pos + 1]<<8)) + 1;
+			pos += 2;
+			if ((op & SC_MPSSE_DO_WRITE) && (pos + (int)dLen > len))
+				return SC_ERROR;
+			if (SCSimData(s, op, (op & SC_MPSSE_DO_WRITE)?buf + pos:NULL,
+						dLen)) return SC_ERROR;
+			if (op & SC_MPSSE_DO_WRITE) pos += dLen;
+			continue;
+		}
+		switch (op) {
+			case SC_MPSSE_SET_LOW:
+				if (pos + 2 > len) return SC_ERROR;
+				SCSimPins(s, buf[pos], buf[pos + 1]);
+				pos += 2;
+				break;
+
+			case SC_MPSSE_SET_HIGH:
+				pos += 2;
+				break;
+
+			case SC_MPSSE_TCK_DIVISOR:
+				if (pos + 2 > len) return SC_ERROR;
+				s->div = buf[pos] | (buf[pos + 1]<<8);
+				pos += 2;
+				break;
+
+			case SC_MPSSE_DIS_DIV5:
+			case SC_MPSSE_EN_DIV5:
+				s->div5 = op == SC_MPSSE_EN_DIV5;
+				break;
+
+			case SC_MPSSE_WAIT_HIGH:
+				if (ProgSimPending(s->fw, &ready)) s->now = MAX(s->now, ready);
+				else s->hung = TRUE;
+				break;
+
+			case SC_MPSSE_LOOPBACK_END:
+			case SC_MPSSE_SEND_IMM:
+				break;
+
+			default:
+				PrintErr("Simulated port: unsupported MPSSE command "
+						"0x%02X!\n", op);
+				return SC_ERROR;
+		}
+	}
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Sleeps until the simulated time is reached.
+ *
+ * \param[in] s Simulated port.
+ ****************************************************************************/
+static void SCSimSync(ScSim *s) {
+	uint64_t wall = (uint64_t)g_get_monotonic_time() * SC_SIM_NS_PER_US;
+
+	if (s->now > wall) g_usleep((s->now - wall) / SC_SIM_NS_PER_US);
+}
+
+/************************************************************************//**
+ * Submits a MPSSE command stream write. The stream is run at once, but the
+ * transfer completes when its simulated time is reached.
+ *
+ * \param[in] port Port handler.
+ * \param[in] buf  Command stream to write.
+ * \param[in] len  Length of the command stream.
+ *
+ * \return Transfer handler, or NULL if the stream could not be run.
+ ****************************************************************************/
+static ScXfer *SCSimSubmit(ScPort *port, uint8_t *buf, int len) {
+	return SCSimWrite(port, buf, len)?NULL:(ScXfer*)port;
+}
+
+/************************************************************************//**
+ * Waits for a submitted write to complete.
+ *
+ * \param[in] port Port handler.
+ * \param[in] xfer Transfer handler.
+ *
+ * \return SC_OK.
+ ****************************************************************************/
+static int SCSimWait(ScPort *port, ScXfer *xfer) {
+	SCSimSync((ScSim*)port);
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Reads exactly len bytes of data clocked in by previous commands.
+ *
+ * \param[in]  port Port handler.
+ * \param[out] buf  Buffer for the read data.
+ * \param[in]  len  Number of bytes to read.
+ *
+ * \return SC_OK on success, SC_ERROR if the data never arrives.
+ ****************************************************************************/
+static int SCSimRead(ScPort *port, uint8_t *buf, int len) {
+	ScSim *s = (ScSim*)port;
+
+	if (s->hung || (s->rxLen - s->rxPos < (uint32_t)len)) {
+		PrintErr("Simulated port: programmer not responding!\n");
+		s->hung = FALSE;
+		s->idle = 0;
+		s->rxPos = s->rxLen = 0;
+		return SC_ERROR;
+	}
+	s->now += s->latency * SC_SIM_NS_PER_US / 2;
+	SCSimSync(s);
+	memcpy(buf, s->rx + s->rxPos, len);
+	s->rxPos += len;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Applies link settings. Only the SPI clock is simulated.
+ *
+ * \param[in] port Port handler.
+ * \param[in] cfg  Link settings to apply.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCSimLink(ScPort *port, const ScLinkCfg *cfg) {
+	uint32_t master = SC_SIM_CLK_12MHZ;
+	uint32_t div;
+	uint8_t cmd[4];
+
+	// Same clock setup as the ftdi backend
+	cmd[0] = SC_MPSSE_EN_DIV5;
+	if (cfg->clk > (SC_SIM_CLK_12MHZ / 2)) {
+		master = SC_SIM_CLK_60MHZ;
+		cmd[0] = SC_MPSSE_DIS_DIV5;
+	}
+	div = ((master / MAX(cfg->clk, 1)) / 2) - 1;
+	cmd[1] = SC_MPSSE_TCK_DIVISOR;
+	cmd[2] = div;
+	cmd[3] = div>>8;
+
+	return SCSimWrite(port, cmd, sizeof(cmd));
+}
+
+/************************************************************************//**
+ * Closes the simulated programmer and frees the port.
+ *
+ * \param[in] port Port handler.
+ ****************************************************************************/
+static void SCSimClose(ScPort *port) {
+	ScSim *s = (ScSim*)port;
+
+	ProgSimFree(s->fw);
+	g_rand_free(s->rand);
+	free(s->rx);
+	free(s);
+}
+
+/************************************************************************//**
+ * Opens the simulated programmer with the specified serial number.
+ *
+ * \param[in] serial Serial number of the programmer, or NULL for the first
+ *            one.
+ *
+ * \return Port handler, or NULL if there is no such programmer.
+ ****************************************************************************/
+static ScPort *SCSimOpen(const char *serial) {
+	const ScLinkCfg def = {SC_SPI_CLK, SC_USB_CHUNK, SC_LATENCY_MS};
+	char names[PROGSIM_MAX][SC_SERIAL_MAXLEN];
+	ProgSimCfg cfg;
+	ScSim *s;
+	int count, i;
+
+	count = SCSimList(names, PROGSIM_MAX);
+	for (i = 0; serial && (i < count) && strcmp(serial, names[i]); i++);
+	if (i == count) return NULL;
+
+	if (!(s = calloc(1, sizeof(ScSim)))) return NULL;
+	if (!(s->fw = ProgSimNew(names[i]))) {
+		free(s);
+		return NULL;
+	}
+	ProgSimCfgGet(&cfg);
+	s->rand = g_rand_new_with_seed(i + 1);
+	s->latency = cfg.latency;
+	s->clkMax = cfg.clkMax;
+	s->ber = cfg.ber;
+	s->pins = SC_PIN_CS;
+	s->port.ops = &scSimOps;
+	// Same settings as the ftdi backend: SPI mode 0
+	s->port.tris = SC_PIN_TRIS;
+	s->port.pidle = s->port.pstop = SC_PIN_CS;
+	s->port.pstart = 0;
+	s->port.tx = SC_MPSSE_DO_WRITE | SC_MPSSE_WRITE_NEG;
+	s->port.rx = SC_MPSSE_DO_READ;
+	s->port.txrx = SC_MPSSE_DO_WRITE | SC_MPSSE_DO_READ | SC_MPSSE_WRITE_NEG;
+	if (SCSimLink(&s->port, &def)) {
+		SCSimClose(&s->port);
+		return NULL;
+	}
+
+	return &s->port;
+}
+
+/// Port backend connected to simulated programmers
+const ScPortOps scSimOps = {
+	.name = "sim",
+	.list = SCSimList,
+	.open = SCSimOpen,
+	.close = SCSimClose,
+	.link = SCSimLink,
+	.write = SCSimWrite,
+	.read = SCSimRead,
+	.submit = SCSimSubmit,
+	.wait = SCSimWait
+};
+
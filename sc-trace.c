@@ -0,0 +1,426 @@
+/************************************************************************//**
+ * \file
+ * \brief Recording and replay of the traffic exchanged by spi-com.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "sc-trace.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+/// Trace file magic
+#define SC_TRACE_MAGIC		"MK3TRACE"
+/// Trace file magic length
+#define SC_TRACE_MAGIC_LEN	8
+
+/// Trace data
+struct ScTrace {
+	ScPort port;		///< Replay port, must be first
+	FILE *f;			///< Trace file
+	uint8_t replay;		///< Trace opened for replay
+	uint8_t timed;		///< Replay calls take the recorded time
+	uint8_t flags;		///< Trace flags (SC_TRACE_F_*)
+	uint8_t err;		///< Write failed, or replay diverged
+	char serial[SC_SERIAL_MAXLEN];	///< Serial number of the programmer
+	uint64_t last;		///< Start time of the previous record
+	uint32_t count;		///< Number of records written or replayed
+	uint8_t *buf;		///< Data of the record being replayed
+	uint32_t bufLen;	///< Length of the record data buffer
+};
+
+/************************************************************************//**
+ * Obtains a monotonic timestamp.
+ *
+ * \return Timestamp, in nanoseconds.
+ ****************************************************************************/
+uint64_t SCTraceNow(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/************************************************************************//**
+ * Writes a LEB128 variable length integer to the trace file.
+ *
+ * \param[in] t   Trace handler.
+ * \param[in] val Value to write.
+ ****************************************************************************/
+static void SCTraceVarPut(ScTrace *t, uint64_t val) {
+	uint8_t buf[10];
+	int len = 0;
+
+	do {
+		buf[len] = val & 0x7F;
+		val >>= 7;
+		if (val) buf[len] |= 0x80;
+		len++;
+	} while (val);
+	if (fwrite(buf, len, 1, t->f) != 1) t->err = TRUE;
+}
+
+/************************************************************************//**
+ * Reads a LEB128 variable length integer from the trace file.
+ *
+ * \param[in]  t   Trace handler.
+ * \param[out] val Read value.
+ *
+ * \return 0 on success, -1 if the end of the file was reached.
+ ****************************************************************************/
+static int SCTraceVarGet(ScTrace *t, uint64_t *val) {
+	int c, shift;
+
+	*val = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if ((c = fgetc(t->f)) == EOF) return -1;
+		*val |= (uint64_t)(c & 0x7F)<<shift;
+		if (!(c & 0x80)) return 0;
+	}
+	return -1;
+}
+
+/************************************************************************//**
+ * Creates a trace file for recording.
+ *
+ * \param[in] file   Trace file name.
+ * \param[in] serial Serial number of the programmer.
+ * \param[in] flags  Trace flags (SC_TRACE_F_*).
+ *
+ * \return Trace handler, or NULL if the file could not be created.
+ ****************************************************************************/
+ScTrace *SCTraceCreate(const char *file, const char *serial, uint8_t flags) {
+	ScTrace *t;
+	uint8_t hdr[3];
+
+	if (!(t = calloc(1, sizeof(ScTrace)))) return NULL;
+	if (!(t->f = fopen(file, "wb"))) {
+		perror(file);
+		free(t);
+		return NULL;
+	}
+	strncpy(t->serial, serial, SC_SERIAL_MAXLEN - 1);
+	t->flags = flags;
+	hdr[0] = SC_TRACE_VERSION;
+	hdr[1] = flags;
+	hdr[2] = strlen(t->serial);
+	if ((fwrite(SC_TRACE_MAGIC, SC_TRACE_MAGIC_LEN, 1, t->f) != 1) ||
+			(fwrite(hdr, sizeof(hdr), 1, t->f) != 1) ||
+			(hdr[2] && (fwrite(t->serial, hdr[2], 1, t->f) != 1))) {
+		perror(file);
+		fclose(t->f);
+		free(t);
+		return NULL;
+	}
+	t->last = SCTraceNow();
+
+	return t;
+}
+
+/************************************************************************//**
+ * Replay port: discards MPSSE command streams.
+ *
+ * \param[in] port Port handler.
+ * \param[in] buf  Command stream to write.
+ * \param[in] len  Length of the command stream.
+ *
+ * \return SC_OK.
+ ****************************************************************************/
+static int SCTracePortWrite(ScPort *port, const uint8_t *buf, int len) {
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Replay port: reads fill bytes. Not used, as all the reads are replayed.
+ *
+ * \param[in]  port Port handler.
+ * \param[out] buf  Buffer for the read data.
+ * \param[in]  len  Number of bytes to read.
+ *
+ * \return SC_OK.
+ ****************************************************************************/
+static int SCTracePortRead(ScPort *port, uint8_t *buf, int len) {
+	memset(buf, SC_FILL, len);
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Replay port: ignores link settings.
+ *
+ * \param[in] port Port handler.
+ * \param[in] cfg  Link settings to apply.
+ *
+ * \return SC_OK.
+ ****************************************************************************/
+static int SCTracePortLink(ScPort *port, const ScLinkCfg *cfg) {
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Replay port: discards MPSSE command streams, completing at once.
+ *
+ * \param[in] port Port handler.
+ * \param[in] buf  Command stream to write.
+ * \param[in] len  Length of the command stream.
+ *
+ * \return Transfer handler.
+ ****************************************************************************/
+static ScXfer *SCTracePortSubmit(ScPort *port, uint8_t *buf, int len) {
+	return (ScXfer*)port;
+}
+
+/************************************************************************//**
+ * Replay port: waits for a submitted write, that is always complete.
+ *
+ * \param[in] port Port handler.
+ * \param[in] xfer Transfer handler.
+ *
+ * \return SC_OK.
+ ****************************************************************************/
+static int SCTracePortWait(ScPort *port, ScXfer *xfer) {
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Replay port: nothing to close, the port is freed along with the trace.
+ *
+ * \param[in] port Port handler.
+ ****************************************************************************/
+static void SCTracePortClose(ScPort *port) {
+}
+
+/// Port used to replay traces, not selectable as a backend
+static const ScPortOps scTraceOps = {
+	.name = "replay",
+	.close = SCTracePortClose,
+	.link = SCTracePortLink,
+	.write = SCTracePortWrite,
+	.read = SCTracePortRead,
+	.submit = SCTracePortSubmit,
+	.wait = SCTracePortWait
+};
+
+/************************************************************************//**
+ * Opens a trace file for replay.
+ *
+ * \param[in] file  Trace file name.
+ * \param[in] timed TRUE to make each call take the recorded time.
+ *
+ * \return Trace handler, or NULL if the file could not be opened or is not
+ *         a supported trace.
+ ****************************************************************************/
+ScTrace *SCTraceOpen(const char *file, int timed) {
+	ScTrace *t;
+	char magic[SC_TRACE_MAGIC_LEN];
+	uint8_t hdr[3];
+
+	if (!(t = calloc(1, sizeof(ScTrace)))) return NULL;
+	if (!(t->f = fopen(file, "rb"))) {
+		perror(file);
+		free(t);
+		return NULL;
+	}
+	if ((fread(magic, SC_TRACE_MAGIC_LEN, 1, t->f) != 1) ||
+			memcmp(magic, SC_TRACE_MAGIC, SC_TRACE_MAGIC_LEN) ||
+			(fread(hdr, sizeof(hdr), 1, t->f) != 1) ||
+			(hdr[0] != SC_TRACE_VERSION) || (hdr[2] >= SC_SERIAL_MAXLEN) ||
+			(hdr[2] && (fread(t->serial, hdr[2], 1, t->f) != 1))) {
+		PrintErr("%s is not a supported trace file!\n", file);
+		fclose(t->f);
+		free(t);
+		return NULL;
+	}
+	t->replay = TRUE;
+	t->timed = timed?TRUE:FALSE;
+	t->flags = hdr[1];
+
+	t->port.ops = &scTraceOps;
+	t->port.tris = SC_PIN_TRIS;
+	t->port.pidle = t->port.pstop = SC_PIN_CS;
+	t->port.tx = SC_MPSSE_DO_WRITE | SC_MPSSE_WRITE_NEG;
+	t->port.rx = SC_MPSSE_DO_READ;
+	// Duplex support must match, or the host sends different requests
+	if (t->flags & SC_TRACE_F_DUPLEX) t->port.txrx = SC_MPSSE_DO_WRITE |
+		SC_MPSSE_DO_READ | SC_MPSSE_WRITE_NEG;
+
+	return t;
+}
+
+/************************************************************************//**
+ * Obtains the serial number of the programmer the trace was recorded with.
+ *
+ * \param[in] t Trace handler.
+ *
+ * \return Serial number.
+ ****************************************************************************/
+const char *SCTraceSerial(ScTrace *t) {
+	return t->serial;
+}
+
+/************************************************************************//**
+ * Obtains the port used to replay a trace. The port accepts and discards
+ * all the MPSSE command streams, and supports duplex mode if the recorded
+ * one did.
+ *
+ * \param[in] t Trace handler, opened for replay.
+ *
+ * \return Replay port.
+ ****************************************************************************/
+ScPort *SCTracePort(ScTrace *t) {
+	return &t->port;
+}
+
+/************************************************************************//**
+ * Appends a record to a trace being recorded.
+ *
+ * \param[in] t   Trace handler.
+ * \param[in] rec Record to append.
+ ****************************************************************************/
+void SCTraceWrite(ScTrace *t, const ScTraceRec *rec) {
+	// Results are small negative or positive numbers, zigzag encode them
+	uint32_t ret = ((uint32_t)rec->ret<<1) ^ (uint32_t)(rec->ret>>31);
+
+	if (t->err) return;
+	fputc(rec->type, t->f);
+	SCTraceVarPut(t, rec->start - t->last);
+	SCTraceVarPut(t, rec->dur);
+	SCTraceVarPut(t, ret);
+	SCTraceVarPut(t, rec->arg);
+	SCTraceVarPut(t, rec->len);
+	if (rec->len && (fwrite(rec->data, rec->len, 1, t->f) != 1))
+		t->err = TRUE;
+	t->last = rec->start;
+	t->count++;
+}
+
+/************************************************************************//**
+ * Reads the next record of a trace being replayed, checking it has the
+ * expected type and argument. For timed replays, waits for the recorded
+ * call duration.
+ *
+ * \param[in]  t    Trace handler.
+ * \param[in]  type Expected record type.
+ * \param[in]  arg  Expected call argument.
+ * \param[out] rec  Read record. Data is valid until the next call.
+ *
+ * \return 0 on success, -1 if the trace ended or replay diverged, now or
+ *         on a previous call.
+ ****************************************************************************/
+static int SCTraceNext(ScTrace *t, uint8_t type, uint32_t arg,
+		ScTraceRec *rec) {
+	uint64_t val[5];
+	uint8_t *buf;
+	int c, i;
+
+	// Once diverged, replay cannot synchronize with the trace again
+	if (t->err) return -1;
+	if ((c = fgetc(t->f)) == EOF) {
+		PrintErr("Replay: trace ended after %u records!\n", t->count);
+		t->err = TRUE;
+		return -1;
+	}
+	for (i = 0; i < 5; i++) {
+		if (SCTraceVarGet(t, &val[i])) goto truncated;
+	}
+	rec->type = c;
+	rec->start = t->last += val[0];
+	rec->dur = val[1];
+	rec->ret = (int32_t)(val[2]>>1) ^ -(int32_t)(val[2] & 1);
+	rec->arg = val[3];
+	rec->len = val[4];
+	if (rec->len > t->bufLen) {
+		if (!(buf = realloc(t->buf, rec->len))) goto truncated;
+		t->buf = buf;
+		t->bufLen = rec->len;
+	}
+	if (rec->len && (fread(t->buf, rec->len, 1, t->f) != 1)) goto truncated;
+	rec->data = t->buf;
+	t->count++;
+
+	if ((rec->type != type) || (rec->arg != arg)) {
+		PrintErr("Replay diverged at record %u: expected type %d "
+				"(arg %u), found type %d (arg %u)!\n", t->count, type, arg,
+				rec->type, rec->arg);
+		t->err = TRUE;
+		return -1;
+	}
+	if (t->timed && (rec->dur >= 1000)) g_usleep(rec->dur / 1000);
+	return 0;
+
+truncated:
+	PrintErr("Replay: record %u is truncated!\n", t->count + 1);
+	t->err = TRUE;
+	return -1;
+}
+
+/************************************************************************//**
+ * Replays a send call, checking the data to send is the recorded one.
+ *
+ * \param[in] t    Trace handler, opened for replay.
+ * \param[in] type Record type (SC_TRACE_*).
+ * \param[in] arg  Call argument.
+ * \param[in] data Data to send.
+ * \param[in] len  Length of the data to send.
+ *
+ * \return Recorded result, or SC_ERROR if replay diverged from the trace.
+ ****************************************************************************/
+int SCTraceSend(ScTrace *t, uint8_t type, uint32_t arg, const void *data,
+		uint32_t len) {
+	ScTraceRec rec;
+
+	if (SCTraceNext(t, type, arg, &rec)) return SC_ERROR;
+	if ((rec.len != len) || memcmp(rec.data, data, len)) {
+		PrintErr("Replay diverged at record %u: sent data differs!\n",
+				t->count);
+		t->err = TRUE;
+		return SC_ERROR;
+	}
+	return rec.ret;
+}
+
+/************************************************************************//**
+ * Replays a receive call, obtaining the recorded data.
+ *
+ * \param[in]  t    Trace handler, opened for replay.
+ * \param[in]  type Record type (SC_TRACE_*).
+ * \param[in]  arg  Call argument.
+ * \param[out] data Buffer for the received data.
+ * \param[in]  max  Length of the buffer.
+ *
+ * \return Recorded result, or SC_ERROR if replay diverged from the trace.
+ ****************************************************************************/
+int SCTraceRecv(ScTrace *t, uint8_t type, uint32_t arg, void *data,
+		uint32_t max) {
+	ScTraceRec rec;
+
+	if (SCTraceNext(t, type, arg, &rec)) return SC_ERROR;
+	if (rec.len > max) {
+		PrintErr("Replay diverged at record %u: received data does not "
+				"fit!\n", t->count);
+		t->err = TRUE;
+		return SC_ERROR;
+	}
+	memcpy(data, rec.data, rec.len);
+	return rec.ret;
+}
+
+/************************************************************************//**
+ * Closes a trace. When replaying, warns if records were left unused.
+ *
+ * \param[in] t Trace handler.
+ ****************************************************************************/
+void SCTraceClose(ScTrace *t) {
+	if (t->replay && !t->err && (fgetc(t->f) != EOF))
+		PrintErr("WARNING: replay ended after %u records, trace has more!\n",
+				t->count);
+	if (fclose(t->f) && !t->replay) t->err = TRUE;
+	if (t->err && !t->replay) PrintErr("WARNING: trace is incomplete, "
+			"could not write all the records!\n");
+	free(t->buf);
+	free(t);
+}
+
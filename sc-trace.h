@@ -0,0 +1,165 @@
+/************************************************************************//**
+ * \file
+ * \brief Recording and replay of the traffic exchanged by spi-com.
+ *
+ * \defgroup sc-trace sc-trace
+ * \{
+ * \brief Recording and replay of the traffic exchanged by spi-com.
+ *
+ * Each call to the spi-com data functions (SCFrameSend(), SCFrameRecv(),
+ * SCFrameBatchSend(), SCChunkSend(), SCChunkRecv(), SCPayloadSend() and
+ * SCPayloadRecv()) can be recorded to a trace file, along with the time
+ * the call started and how long it took, with nanosecond resolution.
+ *
+ * A recorded trace can be replayed later without any programmer: the
+ * spi-com data functions then return the recorded results, and send
+ * functions check the data they are passed is the recorded one, so
+ * changes in the host behaviour are detected. Replay can be timed (each
+ * call takes the time it took when recorded) or untimed. In both cases,
+ * the time spent between calls is the host overhead being measured.
+ *
+ * Trace files start with a header: the "MK3TRACE" magic, the format
+ * version byte, a flags byte (SC_TRACE_F_*), the serial number length byte
+ * and the serial number. Then, a record follows for each call: the record
+ * type byte (SC_TRACE_*), followed by these fields encoded as LEB128
+ * variable length integers: time from the previous record start (ns),
+ * call duration (ns), call result (zigzag encoded), call argument (sequence
+ * number, frame count, or length), data length. Then the data sent or
+ * received by the call.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _SC_TRACE_H_
+#define _SC_TRACE_H_
+
+#include <stdint.h>
+#include "sc-port.h"
+
+/// Trace file format version
+#define SC_TRACE_VERSION		1
+
+/** \addtogroup ScTraceRecs
+ *  \brief Trace record types, one for each traced spi-com function.
+ *  \{ */
+#define SC_TRACE_FRAME_SEND		1	///< SCFrameSend()
+#define SC_TRACE_FRAME_RECV		2	///< SCFrameRecv()
+#define SC_TRACE_BATCH_SEND		3	///< SCFrameBatchSend()
+#define SC_TRACE_CHUNK_SEND		4	///< SCChunkSend()
+#define SC_TRACE_CHUNK_RECV		5	///< SCChunkRecv()
+#define SC_TRACE_PAYLOAD_SEND	6	///< SCPayloadSend()
+#define SC_TRACE_PAYLOAD_RECV	7	///< SCPayloadRecv()
+/** \} */
+
+/// Trace flags: port supported duplex mode when recorded
+#define SC_TRACE_F_DUPLEX		0x01
+
+/// Trace handler
+typedef struct ScTrace ScTrace;
+
+/// Traced call.
+typedef struct {
+	uint8_t type;			///< Record type (SC_TRACE_*)
+	uint64_t start;			///< Call start time, in nanoseconds
+	uint64_t dur;			///< Call duration, in nanoseconds
+	int32_t ret;			///< Call result
+	uint32_t arg;			///< Call argument
+	uint32_t len;			///< Length of the data sent or received
+	const uint8_t *data;	///< Data sent or received
+} ScTraceRec;
+
+/************************************************************************//**
+ * Obtains a monotonic timestamp.
+ *
+ * \return Timestamp, in nanoseconds.
+ ****************************************************************************/
+uint64_t SCTraceNow(void);
+
+/************************************************************************//**
+ * Creates a trace file for recording.
+ *
+ * \param[in] file   Trace file name.
+ * \param[in] serial Serial number of the programmer.
+ * \param[in] flags  Trace flags (SC_TRACE_F_*).
+ *
+ * \return Trace handler, or NULL if the file could not be created.
+ ****************************************************************************/
+ScTrace *SCTraceCreate(const char *file, const char *serial, uint8_t flags);
+
+/************************************************************************//**
+ * Opens a trace file for replay.
+ *
+ * \param[in] file  Trace file name.
+ * \param[in] timed TRUE to make each call take the recorded time.
+ *
+ * \return Trace handler, or NULL if the file could not be opened or is not
+ *         a supported trace.
+ ****************************************************************************/
+ScTrace *SCTraceOpen(const char *file, int timed);
+
+/************************************************************************//**
+ * Obtains the serial number of the programmer the trace was recorded with.
+ *
+ * \param[in] t Trace handler.
+ *
+ * \return Serial number.
+ ****************************************************************************/
+const char *SCTraceSerial(ScTrace *t);
+
+/************************************************************************//**
+ * Obtains the port used to replay a trace. The port accepts and discards
+ * all the MPSSE command streams, and supports duplex mode if the recorded
+ * one did.
+ *
+ * \param[in] t Trace handler, opened for replay.
+ *
+ * \return Replay port.
+ ****************************************************************************/
+ScPort *SCTracePort(ScTrace *t);
+
+/************************************************************************//**
+ * Appends a record to a trace being recorded.
+ *
+ * \param[in] t   Trace handler.
+ * \param[in] rec Record to append.
+ ****************************************************************************/
+void SCTraceWrite(ScTrace *t, const ScTraceRec *rec);
+
+/************************************************************************//**
+ * Replays a send call, checking the data to send is the recorded one.
+ *
+ * \param[in] t    Trace handler, opened for replay.
+ * \param[in] type Record type (SC_TRACE_*).
+ * \param[in] arg  Call argument.
+ * \param[in] data Data to send.
+ * \param[in] len  Length of the data to send.
+ *
+ * \return Recorded result, or SC_ERROR if replay diverged from the trace.
+ ****************************************************************************/
+int SCTraceSend(ScTrace *t, uint8_t type, uint32_t arg, const void *data,
+		uint32_t len);
+
+/************************************************************************//**
+ * Replays a receive call, obtaining the recorded data.
+ *
+ * \param[in]  t    Trace handler, opened for replay.
+ * \param[in]  type Record type (SC_TRACE_*).
+ * \param[in]  arg  Call argument.
+ * \param[out] data Buffer for the received data.
+ * \param[in]  max  Length of the buffer.
+ *
+ * \return Recorded result, or SC_ERROR if replay diverged from the trace.
+ ****************************************************************************/
+int SCTraceRecv(ScTrace *t, uint8_t type, uint32_t arg, void *data,
+		uint32_t max);
+
+/************************************************************************//**
+ * Closes a trace. When replaying, warns if records were left unused.
+ *
+ * \param[in] t Trace handler.
+ ****************************************************************************/
+void SCTraceClose(ScTrace *t);
+
+#endif /*_SC_TRACE_H_*/
+
+/** \} */
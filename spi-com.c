@@ -5,121 +5,1374 @@
  * Frames are delimited by the SOF/EOF characters. Following SOF, payload
  * length in sent using 1 byte. Then data follows, and finally EOF character
  * ends transmission.
+ *
+ * Received data is read in blocks as large as possible into a ring buffer,
+ * and frames are searched inside the buffer. This way several frames can be
+ * obtained using a single USB transfer.
+ *
+ * Transfers to the programmer are submitted asynchronously when the port
+ * backend supports it, using several transmit buffers, so the next transfer
+ * is built while the previous ones are still in flight.
  * 
  * \author Jesus Alonso (doragasu)
  * \date   2016
- * \note   Uses open source mpsse library to interface FT2232 in MSPSSE mode.
+ * \note   Interfaces FT2232 in MPSSE mode through a port backend (libmpsse
+ *         or libftdi), see sc-port.h.
  ****************************************************************************/
 #include "spi-com.h"
+#include "sc-port.h"
+#include "linkcfg.h"
+#include "sc-trace.h"
+#include "stats.h"
+#include "flightrec.h"
+#include "crc.h"
 #include "util.h"
 #include <string.h>
+#include <stdlib.h>
 
 #include <stdio.h>
+#include <glib.h>
+
+/// Frame overhead: SOF + LEN + EOF
+#define SC_FRAME_OVERHEAD		3
+/// Protocol v2 frame overhead: SOF + LEN (2 bytes) + EOF
+#define SC_FRAME_V2_OVERHEAD	4
+/// Bulk phase overhead: SOB + EOF
+#define SC_BULK_OVERHEAD		2
+/// Bulk phase overhead when CRC is enabled: SOB + SEQ + CRC + EOF
+#define SC_BULK_CRC_OVERHEAD	5
+/// Length of the MPSSE command setting low byte GPIO pins
+#define SC_MPSSE_PINS_LEN		3
+/// Length of the MPSSE data write/read command header (command + length)
+#define SC_MPSSE_WR_HDR_LEN		3
+/// MPSSE stream length needed for a frame, not counting the payload
+#define SC_MPSSE_FRAME_OVERHEAD	(3 * SC_MPSSE_PINS_LEN + \
+		SC_MPSSE_WR_HDR_LEN + SC_FRAME_V2_OVERHEAD)
+/// Length of the buffer holding the MPSSE stream of SC_BULK_MAXLEN bytes
+#define SC_TXBUF_LEN	(SC_BULK_MAXLEN + SC_MPSSE_FRAME_OVERHEAD * \
+		((SC_BULK_MAXLEN + SC_MAX_DATALEN - 1) / SC_MAX_DATALEN) + 1)
+
+/// Length of the receive ring buffer. Must be a power of 2, and not greater
+/// than 65536 (maximum length of a MPSSE read command).
+#define SC_RXBUF_LEN	65536
+
+/// Obtains the ring buffer index corresponding to a free running position
+#define SC_RXIDX(pos)	((pos) & (SC_RXBUF_LEN - 1))
+
+/// Obtains the byte at the specified offset from the ring buffer read
+/// position
+#define SC_RXBYTE(sc, off)	((sc)->rxBuf[SC_RXIDX((sc)->rxTail + (off))])
+
+/// Communications handler data.
+struct ScCtx {
+	ScPort *port;					///< MPSSE port handler
+	ScLinkCfg link;					///< Link settings in use
+	int linkStored;					///< Link settings in use are stored ones
+	char serial[SC_SERIAL_MAXLEN];	///< USB serial number of the device
+	/// Buffers used to build the MPSSE streams sent by SCFrameSend() and
+	/// SCChunkSend(), one for each transfer that can be in flight
+	uint8_t txBuf[SC_QUEUE_MAX][SC_TXBUF_LEN];
+	ScXfer *txXfer[SC_QUEUE_MAX];	///< Transfer in flight for each buffer
+	uint8_t txSlot;		///< Buffer to use for the next transfer
+	uint8_t queue;		///< Number of transfers that can be in flight
+	uint8_t duplex;		///< Data clocked in while writing is kept
+	uint8_t ready;		///< Wait for the ready line before reading replies
+	/// Bytes clocked in by the transfer being built, in duplex mode
+	uint32_t rxPend;
+	/// Receive ring buffer
+	uint8_t rxBuf[SC_RXBUF_LEN];
+	uint32_t rxHead;	///< Ring buffer write position (free running)
+	uint32_t rxTail;	///< Ring buffer read position (free running)
+	uint32_t expect;	///< Bytes expected to arrive, not yet read
+	uint16_t frameMax;	///< Maximum frame payload length
+	uint8_t v2;			///< Protocol v2 frames in use
+	uint8_t bulk;		///< Long payloads use the unframed bulk phase
+	uint8_t crc;		///< Bulk chunks carry sequence number and CRC
+	ScTrace *trace;		///< Trace being recorded or replayed, if any
+	uint8_t replay;		///< Data functions replay the trace
+	uint8_t id;			///< Identifier in flight recorder records
+};
+
+/// Available port backends, the default one must be the first
+static const ScPortOps *const scBackends[] = {
+#ifndef SC_NO_MPSSE
+	&scMpsseOps,
+#endif
+	&scFtdiOps,
+#ifdef SC_SIM
+	&scSimOps
+#endif
+};
+
+/// Port backend in use, NULL until selected
+static const ScPortOps *scOps;
+
+/// File to record the traffic to, NULL if not recording
+static const char *scTraceFile;
+/// File to replay the traffic from, NULL if not replaying
+static const char *scReplayFile;
+/// Replayed calls take the recorded time
+static int scReplayTimed;
+/// Link settings stored for each programmer are applied when opening it
+static int scLinkStored = TRUE;
+/// Last flight recorder identifier assigned to a handler
+static gint scIdLast;
+
+/************************************************************************//**
+ * Selects the port backend used by SCInit(). Available backends are
+ * "mpsse" (unless built without libmpsse support), "ftdi" and "sim" (only
+ * when built with simulation support).
+ *
+ * \param[in] name Name of the backend to use.
+ *
+ * \return SC_OK on success, SC_ERROR if the backend is not available.
+ ****************************************************************************/
+int SCBackendSet(const char *name) {
+	unsigned int i;
 
-/// Signals frame stop and returns with SC_ERROR
-#define SCStopErr()		do{Stop(mpsse);return SC_ERROR;}while(0)
+	for (i = 0; i < sizeof(scBackends) / sizeof(scBackends[0]); i++) {
+		if (!strcmp(name, scBackends[i]->name)) {
+			scOps = scBackends[i];
+			return SC_OK;
+		}
+	}
+	return SC_ERROR;
+}
+
+/************************************************************************//**
+ * Records the traffic of the interfaces opened from now on to a trace file.
+ * See sc-trace.h for the file format.
+ *
+ * \param[in] file Trace file name, or NULL to stop recording.
+ ****************************************************************************/
+void SCTraceSet(const char *file) {
+	scTraceFile = file;
+}
+
+/************************************************************************//**
+ * Replays a previously recorded trace file, instead of using a programmer,
+ * on the interfaces opened from now on. The data functions return the
+ * recorded results, and fail if the data sent is not the recorded one.
+ *
+ * \param[in] file  Trace file name, or NULL to stop replaying.
+ * \param[in] timed TRUE to make each call take the time it took when
+ *            recorded, FALSE to return immediately.
+ ****************************************************************************/
+void SCReplaySet(const char *file, int timed) {
+	scReplayFile = file;
+	scReplayTimed = timed;
+}
 
-/// Signals frame stop and returns NULL
-#define SCStopNull()	do{Stop(mpsse);return NULL;}while(0)
+/************************************************************************//**
+ * Selects whether the link settings stored for a programmer are applied
+ * when opening it. They are applied unless disabled, e.g. to find new ones.
+ *
+ * \param[in] use TRUE to apply stored link settings to the interfaces
+ *            opened from now on, FALSE to open them with the defaults.
+ ****************************************************************************/
+void SCLinkStoredSet(int use) {
+	scLinkStored = use;
+}
 
 /************************************************************************//**
  * Module initialization. Call this function to obtain the handler needed
- * to call any other function in this module.
+ * to call any other function in this module. If link settings are stored
+ * for the serial number of the opened programmer, they are applied, unless
+ * disabled with SCLinkStoredSet().
  *
  * \param[in] channel Channel number of the FT2232 device to open.
  *
- * \return The handler of the opened FT2232 MPSSE interface, or NULL if
- *         opening the interface failed.
+ * \return The handler of the opened interface, or NULL if opening the
+ *         FT2232 MPSSE interface failed.
+ ****************************************************************************/
+ScCtx *SCInit(unsigned int channel) {
+	return SCInitSerial(channel, NULL);
+}
+
+/************************************************************************//**
+ * Selects the default port backend, if none was selected.
+ ****************************************************************************/
+static void SCBackendDefault(void) {
+	if (!scOps && SCBackendSet(SC_BACKEND_DEFAULT)) scOps = scBackends[0];
+}
+
+/************************************************************************//**
+ * Lists the USB serial numbers of the connected programmers, using the
+ * selected port backend.
+ *
+ * \param[out] serial Serial numbers of the found programmers.
+ * \param[in]  max    Maximum number of serial numbers to obtain.
+ *
+ * \return Number of programmers found, or SC_ERROR.
  ****************************************************************************/
-struct mpsse_context *SCInit(unsigned int channel) {
-	struct mpsse_context *mpsse;
-	mpsse = Open(SC_VID, SC_PID, SC_SPI_MODE, SC_SPI_CLK, MSB, SC_IFACE,
-			NULL, NULL);
-	if (mpsse) {
-		// Turn ON PORTB LED (GPIOH1).
-		PinLow(mpsse, GPIOH1);
+int SCList(char serial[][SC_SERIAL_MAXLEN], int max) {
+	ScTrace *t;
+
+	// When replaying, the only programmer is the recorded one
+	if (scReplayFile) {
+		if (max < 1 || !(t = SCTraceOpen(scReplayFile, FALSE)))
+			return SC_ERROR;
+		strcpy(serial[0], SCTraceSerial(t));
+		SCTraceClose(t);
+		return 1;
 	}
-	return mpsse;
+	SCBackendDefault();
+	return scOps->list(serial, max);
 }
 
 /************************************************************************//**
- * Sends data through the MPSSE interface, using a tiny framing protocol.
+ * Completes the initialization of a handler replaying a trace, that uses
+ * the trace replay port instead of a programmer.
+ *
+ * \param[in] sc Handler being initialized.
+ *
+ * \return The handler, or NULL if the trace could not be opened.
+ ****************************************************************************/
+static ScCtx *SCInitReplay(ScCtx *sc) {
+	if (!(sc->trace = SCTraceOpen(scReplayFile, scReplayTimed))) {
+		free(sc);
+		return NULL;
+	}
+	strncpy(sc->serial, SCTraceSerial(sc->trace), SC_SERIAL_MAXLEN - 1);
+	sc->port = SCTracePort(sc->trace);
+	sc->replay = TRUE;
+	sc->frameMax = SC_MAX_DATALEN;
+	sc->queue = 1;
+	sc->link.clk = SC_SPI_CLK;
+	sc->link.chunk = SC_USB_CHUNK;
+	sc->link.latency = SC_LATENCY_MS;
+	FlightRecAdd(FLIGHTREC_OPEN, sc->id, SC_OK, 0, sc->serial,
+			strlen(sc->serial));
+
+	return sc;
+}
+
+/************************************************************************//**
+ * Module initialization, opening the programmer with the specified USB
+ * serial number. Handlers of different programmers can be used
+ * concurrently from different threads, but each handler must only be used
+ * by one thread at a time.
+ *
+ * \param[in] channel Channel number of the FT2232 device to open.
+ * \param[in] serial  USB serial number of the programmer to open, or NULL
+ *            to open the first one found.
+ *
+ * \return The handler of the opened interface, or NULL if opening the
+ *         FT2232 MPSSE interface failed.
+ ****************************************************************************/
+ScCtx *SCInitSerial(unsigned int channel, const char *serial) {
+	ScCtx *sc;
+	ScLinkCfg cfg;
+	char first[1][SC_SERIAL_MAXLEN];
+
+	SCBackendDefault();
+	if (!(sc = calloc(1, sizeof(ScCtx)))) return NULL;
+	sc->id = g_atomic_int_add(&scIdLast, 1) + 1;
+	if (scReplayFile) return SCInitReplay(sc);
+	// If serial cannot be read, just open the first device
+	if (serial) {
+		strncpy(sc->serial, serial, SC_SERIAL_MAXLEN - 1);
+	} else if (scOps->list(first, 1) > 0) {
+		strcpy(sc->serial, first[0]);
+	}
+	if (!(sc->port = scOps->open(sc->serial[0]?sc->serial:NULL))) {
+		free(sc);
+		return NULL;
+	}
+	sc->frameMax = SC_MAX_DATALEN;
+	sc->queue = sc->port->ops->submit?SC_QUEUE_DEFAULT:1;
+	sc->link.clk = SC_SPI_CLK;
+	sc->link.chunk = SC_USB_CHUNK;
+	sc->link.latency = SC_LATENCY_MS;
+	// Apply stored link settings for this programmer, if any
+	if (scLinkStored && sc->serial[0] && !LinkCfgLoad(sc->serial, &cfg)) {
+		if (SCLinkSet(sc, &cfg)) {
+			sc->port->ops->close(sc->port);
+			free(sc);
+			return NULL;
+		}
+		sc->linkStored = TRUE;
+	}
+	if (scTraceFile && !(sc->trace = SCTraceCreate(scTraceFile, sc->serial,
+			SCDuplexSupported(sc)?SC_TRACE_F_DUPLEX:0))) {
+		PrintErr("Cannot create trace file!\n");
+		sc->port->ops->close(sc->port);
+		free(sc);
+		return NULL;
+	}
+	FlightRecAdd(FLIGHTREC_OPEN, sc->id, SC_OK, 0, sc->serial,
+			strlen(sc->serial));
+
+	return sc;
+}
+
+/************************************************************************//**
+ * Waits until all the transfers in flight complete.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return SC_OK on success, SC_ERROR if any of the transfers failed.
+ ****************************************************************************/
+int SCTxFlush(ScCtx *sc) {
+	int i;
+	int err = SC_OK;
+
+	for (i = 0; i < SC_QUEUE_MAX; i++) {
+		if (sc->txXfer[i] && sc->port->ops->wait(sc->port, sc->txXfer[i]))
+			err = SC_ERROR;
+		sc->txXfer[i] = NULL;
+	}
+
+	return err;
+}
+
+/************************************************************************//**
+ * Closes the interface, waiting for the transfers in flight to complete,
+ * and frees the handler.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ ****************************************************************************/
+void SCClose(ScCtx *sc) {
+	SCTxFlush(sc);
+	FlightRecAdd(FLIGHTREC_CLOSE, sc->id, SC_OK, 0, NULL, 0);
+	sc->port->ops->close(sc->port);
+	if (sc->trace) SCTraceClose(sc->trace);
+	free(sc);
+}
+
+/************************************************************************//**
+ * Sets the number of USB transfers that can be in flight. While a transfer
+ * is in flight, next ones can be built and submitted. Depth 1 makes all
+ * transfers synchronous.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] depth Number of transfers that can be in flight, from 1 to
+ *            SC_QUEUE_MAX.
+ *
+ * \return SC_OK on success, SC_ERROR if depth is not supported by the
+ *         port backend.
+ ****************************************************************************/
+int SCQueueSet(ScCtx *sc, unsigned int depth) {
+	if (!depth || depth > SC_QUEUE_MAX ||
+			(depth > 1 && !sc->port->ops->submit)) return SC_ERROR;
+	if (SCTxFlush(sc)) return SC_ERROR;
+	sc->queue = depth;
+	sc->txSlot = 0;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Checks if duplex mode can be used with the port in use.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return TRUE if duplex mode is supported, FALSE otherwise.
+ ****************************************************************************/
+int SCDuplexSupported(ScCtx *sc) {
+	return sc->port->ops->submit && sc->port->txrx;
+}
+
+/************************************************************************//**
+ * Enables or disables duplex mode. In duplex mode, data clocked in while
+ * sending is also read, so replies sent by the programmer while it receives
+ * a transfer are obtained without additional bus cycles. Requires the port
+ * to support asynchronous transfers.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] enable TRUE to enable duplex mode, FALSE to disable it.
+ *
+ * \return SC_OK on success, SC_ERROR if duplex mode is not supported.
+ ****************************************************************************/
+int SCDuplexSet(ScCtx *sc, int enable) {
+	if (enable && !SCDuplexSupported(sc)) return SC_ERROR;
+	if (SCTxFlush(sc)) return SC_ERROR;
+	sc->duplex = enable?TRUE:FALSE;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Enables or disables waiting for the programmer ready line. When enabled,
+ * the MPSSE engine waits for the line (GPIOL1) to go high before reading
+ * the start of a reply, instead of the host polling the SPI bus. The ready
+ * line pin is configured as input.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] enable TRUE to wait for the ready line, FALSE to poll.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCReadySet(ScCtx *sc, int enable) {
+	ScPort *port = sc->port;
+	uint8_t cmd[SC_MPSSE_PINS_LEN];
+
+	if (enable) port->tris &= ~SC_PIN_READY;
+	else port->tris |= SC_PIN_READY;
+	cmd[0] = SC_MPSSE_SET_LOW;
+	cmd[1] = port->pidle;
+	cmd[2] = port->tris;
+	if (port->ops->write(port, cmd, sizeof(cmd))) return SC_ERROR;
+	sc->ready = enable?TRUE:FALSE;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Obtains the USB serial number of the opened programmer.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return The serial number string, empty if it could not be obtained.
+ ****************************************************************************/
+const char *SCSerialGet(ScCtx *sc) {
+	return sc->serial;
+}
+
+/************************************************************************//**
+ * Obtains the link settings in use.
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] cfg Link settings in use.
+ ****************************************************************************/
+void SCLinkGet(ScCtx *sc, ScLinkCfg *cfg) {
+	*cfg = sc->link;
+}
+
+/************************************************************************//**
+ * Applies the specified link settings.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] cfg Link settings to apply.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCLinkSet(ScCtx *sc, const ScLinkCfg *cfg) {
+	if (SCTxFlush(sc) || sc->port->ops->link(sc->port, cfg)) return SC_ERROR;
+	sc->link = *cfg;
+	sc->linkStored = FALSE;
+	// Stale data might be buffered after the change
+	sc->rxTail = sc->rxHead;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Checks if the link settings in use are the ones stored for the
+ * programmer, applied when it was opened.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return TRUE if stored link settings are in use, FALSE otherwise.
+ ****************************************************************************/
+int SCLinkStored(ScCtx *sc) {
+	return sc->linkStored;
+}
+
+/************************************************************************//**
+ * Sets the framing protocol, as negotiated with the programmer.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] frameMax Maximum frame payload length. If greater than
+ *            SC_MAX_DATALEN, protocol v2 frames (16-bit length) are used.
+ * \param[in] features Protocol features (SC_PROTO_F_*) to use. CRC
+ *            protection requires the bulk phase.
+ *
+ * \return SC_OK on success, SC_ERROR if settings are not supported.
+ ****************************************************************************/
+int SCProtoSet(ScCtx *sc, uint16_t frameMax, uint8_t features) {
+	if (frameMax < SC_MAX_DATALEN || frameMax > SC_V2_MAX_DATALEN ||
+			((features & SC_PROTO_F_CRC) && !(features & SC_PROTO_F_BULK)))
+		return SC_ERROR;
+	sc->frameMax = frameMax;
+	sc->v2 = frameMax > SC_MAX_DATALEN;
+	sc->bulk = (features & SC_PROTO_F_BULK)?TRUE:FALSE;
+	sc->crc = (features & SC_PROTO_F_CRC)?TRUE:FALSE;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Obtains the maximum frame payload length in use.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return Maximum frame payload length.
+ ****************************************************************************/
+uint16_t SCFrameMaxGet(ScCtx *sc) {
+	return sc->frameMax;
+}
+
+/************************************************************************//**
+ * Appends to a buffer the MPSSE command setting the low byte GPIO pins.
+ *
+ * \param[in] port Handler of the MPSSE port.
+ * \param[out] buf Buffer to which the command is appended.
+ * \param[in] pins Value to set on the low byte pins.
+ *
+ * \return Number of bytes appended to the buffer.
+ ****************************************************************************/
+static inline int SCPinsAdd(ScPort *port, uint8_t *buf, uint8_t pins) {
+	buf[0] = SC_MPSSE_SET_LOW;
+	buf[1] = pins;
+	buf[2] = port->tris;
+
+	return SC_MPSSE_PINS_LEN;
+}
+
+/************************************************************************//**
+ * Appends to a buffer data wrapped in the MPSSE commands needed to send it
+ * as a single chip select cycle: CS assertion, data write, CS deassertion
+ * and return to idle state. This is what Start(), Write() and Stop() would
+ * send. Data is preceded by a header, and followed by an optional trailer
+ * and the EOF marker.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[out] buf Buffer to which the command is appended.
+ * \param[in] hdr Header (SOF and length, or SOB).
+ * \param[in] hdrLen Header length.
+ * \param[in] data Payload.
+ * \param[in] len Payload length.
+ * \param[in] tail Trailer (CRC), NULL if none.
+ * \param[in] tailLen Trailer length.
+ *
+ * \return Number of bytes appended to the buffer.
+ ****************************************************************************/
+static int SCCycleAdd(ScCtx *sc, uint8_t *buf, const uint8_t *hdr,
+		int hdrLen, const char *data, uint16_t len, const uint8_t *tail,
+		int tailLen) {
+	ScPort *port = sc->port;
+	int pos;
+	// MPSSE length field holds the number of bytes to write minus 1
+	uint16_t wrLen = hdrLen + len + tailLen;
+
+	pos = SCPinsAdd(port, buf, port->pstart);
+	// In duplex mode, the bytes clocked in are also read
+	if (sc->duplex) {
+		buf[pos++] = port->txrx;
+		sc->rxPend += wrLen + 1;
+	} else {
+		buf[pos++] = port->tx;
+	}
+	buf[pos++] = wrLen;
+	buf[pos++] = wrLen>>8;
+	memcpy(buf + pos, hdr, hdrLen);
+	pos += hdrLen;
+	memcpy(buf + pos, data, len);
+	pos += len;
+	if (tailLen) memcpy(buf + pos, tail, tailLen);
+	pos += tailLen;
+	buf[pos++] = SC_EOF;
+	pos += SCPinsAdd(port, buf + pos, port->pstop);
+	pos += SCPinsAdd(port, buf + pos, port->pidle);
+
+	return pos;
+}
+
+/************************************************************************//**
+ * Appends to a buffer a complete frame, wrapped in the MPSSE commands
+ * needed to send it.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[out] buf Buffer to which the command is appended.
+ * \param[in] data Frame payload.
+ * \param[in] len Frame payload length (up to sc->frameMax).
+ *
+ * \return Number of bytes appended to the buffer.
+ ****************************************************************************/
+static int SCFrameAdd(ScCtx *sc, uint8_t *buf, const char *data,
+		uint16_t len) {
+	uint8_t hdr[3];
+
+	if (sc->v2) {
+		hdr[0] = SC_SOF_V2;
+		hdr[1] = len>>8;
+		hdr[2] = len;
+		return SCCycleAdd(sc, buf, hdr, 3, data, len, NULL, 0);
+	}
+	hdr[0] = SC_SOF;
+	hdr[1] = len;
+	return SCCycleAdd(sc, buf, hdr, 2, data, len, NULL, 0);
+}
+
+/************************************************************************//**
+ * Reads data from the port into the receive ring buffer.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] len Number of bytes to read. Must fit in the ring buffer.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCRxStore(ScCtx *sc, uint32_t len) {
+	ScPort *port = sc->port;
+	uint32_t idx = SC_RXIDX(sc->rxHead);
+	uint32_t seg = MIN(len, SC_RXBUF_LEN - idx);
+
+	// Split the read if the buffer wraps
+	if (port->ops->read(port, sc->rxBuf + idx, seg) ||
+			((len > seg) && port->ops->read(port, sc->rxBuf, len - seg)))
+		return SC_ERROR;
+	sc->rxHead += len;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Reads the data clocked in by duplex writes into the receive ring buffer.
+ * Fill bytes sent by the programmer when it has no reply data are dropped
+ * while no frame is being received, so they do not use ring buffer space.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCRxPendRead(ScCtx *sc) {
+	uint32_t len;
+
+	while (sc->rxPend) {
+		len = MIN(sc->rxPend, SC_RXBUF_LEN - (sc->rxHead - sc->rxTail));
+		if (!len || SCRxStore(sc, len)) {
+			sc->rxPend = 0;
+			return SC_ERROR;
+		}
+		sc->rxPend -= len;
+		sc->expect -= MIN(sc->expect, len);
+		while ((sc->rxTail != sc->rxHead) && (SC_RXBYTE(sc, 0) == SC_FILL))
+			sc->rxTail++;
+	}
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Obtains the buffer to build the next transfer, waiting for the transfer
+ * previously using it to complete.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return The buffer, or NULL if the previous transfer failed.
+ ****************************************************************************/
+static uint8_t *SCTxBufGet(ScCtx *sc) {
+	ScXfer *xfer = sc->txXfer[sc->txSlot];
+
+	sc->txXfer[sc->txSlot] = NULL;
+	if (xfer && sc->port->ops->wait(sc->port, xfer)) return NULL;
+
+	return sc->txBuf[sc->txSlot];
+}
+
+/************************************************************************//**
+ * Sends the transfer built in the buffer obtained with SCTxBufGet(). If
+ * more than one transfer can be in flight, returns as soon as the transfer
+ * is submitted.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] len Length of the transfer.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCTxSubmit(ScCtx *sc, int len) {
+	uint8_t *buf = sc->txBuf[sc->txSlot];
+
+	if (sc->duplex) {
+		// Data clocked in must be read while the write is in progress, or
+		// the MPSSE engine stalls when its buffer gets full
+		buf[len++] = SC_MPSSE_SEND_IMM;
+		if (!(sc->txXfer[sc->txSlot] = sc->port->ops->submit(sc->port,
+						buf, len))) return SC_ERROR;
+		sc->txSlot = (sc->txSlot + 1) % sc->queue;
+		return SCRxPendRead(sc);
+	}
+
+	if (sc->queue < 2) return sc->port->ops->write(sc->port, buf, len);
+
+	if (!(sc->txXfer[sc->txSlot] = sc->port->ops->submit(sc->port, buf, len)))
+		return SC_ERROR;
+	sc->txSlot = (sc->txSlot + 1) % sc->queue;
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Discards received data not read yet, and data announced with
+ * SCRecvExpect(). Call before starting a new exchange, if no replies to
+ * previous requests are pending.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ ****************************************************************************/
+void SCRxDiscard(ScCtx *sc) {
+	sc->rxTail = sc->rxHead;
+	sc->expect = 0;
+}
+
+/************************************************************************//**
+ * Sends frames through the port. Implements SCFrameSend().
  *
- * \param[in] mpsse Handler of the previously opened MPSSE interface.
+ * \param[in] sc Handler of the previously opened interface.
  * \param[in] data Data payload to send.
  * \param[in] datalen Length of the data payload to send in bytes.
  *
  * \return SC_OK on success, SC_ERROR on fail.
  ****************************************************************************/
-// NOTE: Previous implementation sent each frame split in 3 steps to avoid
+// NOTE: First implementation sent each frame split in 3 steps to avoid
 // having to copy input data: SOF + len, payload, eof. This caused huge delays
-// due minimum 1 ms USB latency. Due to this implementation has been changed
-// to build the complete frame (even if this means copying the data) and send
-// it at once.
-int SCFrameSend(struct mpsse_context *mpsse, char *data, uint16_t datalen) {
-	// Frame buffer. Maximum length is the payload length + SOF + EOF + LEN.
-	char frame[SC_MAX_DATALEN + 3];
-	uint16_t rem;
+// due minimum 1 ms USB latency. Then it was changed to build the complete
+// frame and send it using Start(), Write() and Stop(), but this still costs
+// 3 USB transfers per frame. Now the complete MPSSE command stream for all
+// the frames (chip select changes included) is built in txBuf, and sent
+// using a single USB transfer. When the port supports asynchronous
+// transfers, the next stream is built while the previous one is in flight.
+static int SCFrameSendBus(ScCtx *sc, char *data, uint16_t datalen) {
 	uint16_t sent;
+	uint16_t bulkEnd;
+	uint16_t frameLen;
+	uint8_t *buf;
+	int pos;
 
-	frame[0] = SC_SOF;
-	// If payload greater than SC_MAX_DATALEN bytes, split data
-	// transmission in SC_MAX_DATALEN byte chuncks.
-	for (sent = 0, rem = datalen; 0 < rem; sent += frame[1], rem -= frame[1]) {
-		// Build frame
-		frame[1] = MIN(rem, SC_MAX_DATALEN);
-		memcpy(frame + 2, data + sent, frame[1]);
-		frame[frame[1] + 2] = SC_EOF;
-		// Send frame
-		if (Start(mpsse)) SCStopErr();
-		if (Write(mpsse, frame, frame[1] + 3)) SCStopErr();
-		if (Stop(mpsse)) SCStopErr();
+	for (sent = 0; sent < datalen;) {
+		// Build MPSSE stream for up to SC_BULK_MAXLEN bytes of payload
+		bulkEnd = sent + MIN(datalen - sent, SC_BULK_MAXLEN);
+		if (!(buf = SCTxBufGet(sc))) return SC_ERROR;
+		for (pos = 0; sent < bulkEnd; sent += frameLen) {
+			frameLen = MIN(bulkEnd - sent, sc->frameMax);
+			pos += SCFrameAdd(sc, buf + pos, data + sent, frameLen);
+		}
+		// Send all the frames at once
+		if (SCTxSubmit(sc, pos)) return SC_ERROR;
 	}
 
 	return SC_OK;
 }
 
 /************************************************************************//**
- * Receives data through the MPSSE interface, using a tiny framing protocol.
+ * Sends a batch of frames through the port. Implements
+ * SCFrameBatchSend().
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] frame Frames to send.
+ * \param[in] count Number of frames to send.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCFrameBatchSendBus(ScCtx *sc, const ScFrame *frame,
+		unsigned int count) {
+	unsigned int i;
+	uint8_t *buf = NULL;
+	int pos = 0;
+
+	for (i = 0; i < count; i++) {
+		if (frame[i].len > SC_MAX_DATALEN) return SC_ERROR;
+		// Submit the frames built so far if the next one does not fit
+		if (buf && (pos + SC_MPSSE_FRAME_OVERHEAD + frame[i].len >
+					SC_TXBUF_LEN - 1)) {
+			if (SCTxSubmit(sc, pos)) return SC_ERROR;
+			buf = NULL;
+		}
+		if (!buf) {
+			if (!(buf = SCTxBufGet(sc))) return SC_ERROR;
+			pos = 0;
+		}
+		pos += SCFrameAdd(sc, buf + pos, frame[i].data, frame[i].len);
+	}
+
+	return buf?SCTxSubmit(sc, pos):SC_OK;
+}
+
+/************************************************************************//**
+ * Sends a bulk chunk through the port. Implements SCChunkSend().
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] data Chunk data.
+ * \param[in] len Chunk length, up to SC_BULK_MAXLEN.
+ * \param[in] seq Chunk sequence number.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCChunkSendBus(ScCtx *sc, char *data, uint16_t len, uint8_t seq) {
+	uint8_t hdr[2] = {SC_SOB, seq};
+	uint8_t tail[2];
+	uint16_t crc;
+	uint8_t *buf;
+	int pos;
+
+	if (!(buf = SCTxBufGet(sc))) return SC_ERROR;
+	if (sc->crc) {
+		crc = Crc16(Crc16(CRC16_INIT, &seq, 1), (uint8_t*)data, len);
+		tail[0] = crc>>8;
+		tail[1] = crc;
+		pos = SCCycleAdd(sc, buf, hdr, 2, data, len, tail, 2);
+	} else {
+		pos = SCCycleAdd(sc, buf, hdr, 1, data, len, NULL, 0);
+	}
+	return SCTxSubmit(sc, pos);
+}
+
+/************************************************************************//**
+ * Sends a long command payload through the port. Implements
+ * SCPayloadSend().
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] data Data payload to send.
+ * \param[in] datalen Length of the data payload to send in bytes.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCPayloadSendBus(ScCtx *sc, char *data, uint16_t datalen) {
+	uint16_t sent;
+	uint16_t len;
+	uint8_t seq;
+
+	if (!sc->bulk) return SCFrameSendBus(sc, data, datalen);
+
+	for (sent = 0, seq = 0; sent < datalen; sent += len, seq++) {
+		len = MIN(datalen - sent, SC_BULK_MAXLEN);
+		if (SCChunkSendBus(sc, data + sent, len, seq)) return SC_ERROR;
+	}
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Announces the amount of long payload data the programmer is about to
+ * send. This allows reading it using as few USB transfers as possible.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] payloadLen Length of the payload to be received using
+ *            SCPayloadRecv().
+ ****************************************************************************/
+void SCRecvExpect(ScCtx *sc, uint32_t payloadLen) {
+	uint32_t chunks;
+
+	if (sc->bulk) {
+		chunks = (payloadLen + SC_BULK_MAXLEN - 1) / SC_BULK_MAXLEN;
+		sc->expect += payloadLen + chunks * (sc->crc?SC_BULK_CRC_OVERHEAD:
+				SC_BULK_OVERHEAD);
+	} else {
+		chunks = (payloadLen + sc->frameMax - 1) / sc->frameMax;
+		sc->expect += payloadLen + chunks * (sc->v2?SC_FRAME_V2_OVERHEAD:
+				SC_FRAME_OVERHEAD);
+	}
+}
+
+/************************************************************************//**
+ * Announces the number of frames the programmer is about to send, e.g.
+ * the replies to the frames sent using SCFrameBatchSend(). This allows
+ * reading them using as few USB transfers as possible.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] frames Number of frames to be received using SCFrameRecv().
+ * \param[in] payloadLen Minimum length of the payload of all the frames.
+ ****************************************************************************/
+void SCFrameExpect(ScCtx *sc, uint32_t frames, uint32_t payloadLen) {
+	sc->expect += payloadLen + frames * (sc->v2?SC_FRAME_V2_OVERHEAD:
+			SC_FRAME_OVERHEAD);
+}
+
+/************************************************************************//**
+ * Sends the MPSSE command stream (CS assertion, read, CS deassertion) that
+ * reads data from the SPI bus. Read data must then be retrieved from the
+ * port.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] len Number of bytes to read, up to 65536.
+ * \param[in] start TRUE if waiting for the start of a reply. If the ready
+ *            line is in use, the MPSSE engine waits for it before reading.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCRxRequest(ScCtx *sc, uint32_t len, int start) {
+	ScPort *port = sc->port;
+	uint8_t cmd[3 * SC_MPSSE_PINS_LEN + SC_MPSSE_WR_HDR_LEN + 2];
+	int pos = 0;
+
+	// Instead of polling for the reply start, let the MPSSE engine wait
+	// until the programmer signals it is ready
+	if (start && sc->ready) cmd[pos++] = SC_MPSSE_WAIT_HIGH;
+	// MPSSE length field holds the number of bytes to read minus 1
+	pos += SCPinsAdd(port, cmd + pos, port->pstart);
+	cmd[pos++] = port->rx;
+	cmd[pos++] = len - 1;
+	cmd[pos++] = (len - 1)>>8;
+	pos += SCPinsAdd(port, cmd + pos, port->pstop);
+	pos += SCPinsAdd(port, cmd + pos, port->pidle);
+	// Flush read data to host without waiting for the latency timer
+	cmd[pos++] = SC_MPSSE_SEND_IMM;
+
+	return port->ops->write(port, cmd, pos)?SC_ERROR:SC_OK;
+}
+
+/************************************************************************//**
+ * Reads data from the SPI bus into the receive ring buffer, using a single
+ * MPSSE command stream.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] need Minimum number of bytes to read. If more data is expected
+ *            to arrive (as announced by SCRecvExpect()), up to the free
+ *            space in the ring buffer is read.
+ * \param[in] start TRUE if waiting for the start of a reply. If the ready
+ *            line is in use, the MPSSE engine waits for it before reading.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCRxFill(ScCtx *sc, uint32_t need, int start) {
+	uint32_t avail = SC_RXBUF_LEN - (sc->rxHead - sc->rxTail);
+	uint32_t len = MIN(MAX(need, sc->expect), avail);
+
+	if (need > len) return SC_ERROR;
+	if (SCRxRequest(sc, len, start) || SCRxStore(sc, len))
+		return SC_ERROR;
+	sc->expect -= MIN(sc->expect, len);
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Reads data from the SPI bus straight into the caller buffer, skipping
+ * the receive ring buffer. Used for chunk payloads, so data is copied only
+ * once (from the USB stack to its destination).
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where data will be read.
+ * \param[in]  len Number of bytes to read, up to 65536.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+static int SCRxDirect(ScCtx *sc, char *data, uint32_t len) {
+	ScPort *port = sc->port;
+
+	if (SCRxRequest(sc, len, FALSE) ||
+			port->ops->read(port, (uint8_t*)data, len)) return SC_ERROR;
+	sc->expect -= MIN(sc->expect, len);
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Copies data from the receive ring buffer, and advances the read position.
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where data will be copied.
+ * \param[in]  len Number of bytes to copy. Must be available in the ring.
+ ****************************************************************************/
+static void SCRxCopy(ScCtx *sc, char *data, uint32_t len) {
+	uint32_t seg = MIN(len, SC_RXBUF_LEN - SC_RXIDX(sc->rxTail));
+
+	memcpy(data, sc->rxBuf + SC_RXIDX(sc->rxTail), seg);
+	memcpy(data + seg, sc->rxBuf, len - seg);
+	sc->rxTail += len;
+}
+
+/************************************************************************//**
+ * Advances the receive buffer read position up to the next start marker,
+ * or discards all buffered data if none is found.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] sof Start marker to seek.
+ * \param[in] sofAlt Alternative start marker to seek.
  *
- * \param[in] mpsse Handler of the previously opened MPSSE interface.
- * \param[inout] maxlen Maximum length of the data payload to receive. On
- *               function return, holds the number of bytes received.
+ * \return Number of bytes skipped.
+ ****************************************************************************/
+static uint32_t SCRxSeek(ScCtx *sc, uint8_t sof, uint8_t sofAlt) {
+	uint32_t tail = sc->rxTail;
+	uint8_t c;
+
+	while (sc->rxTail != sc->rxHead) {
+		c = SC_RXBYTE(sc, 0);
+		if (c == sof || c == sofAlt) break;
+		sc->rxTail++;
+	}
+
+	return sc->rxTail - tail;
+}
+
+/************************************************************************//**
+ * Receives a frame through the port. Implements SCFrameRecv().
  *
- * \return Pointer to the received data, or NULL if reception failed.
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where received payload will be copied.
+ * \param[in]  maxlen Maximum length of the data payload to receive.
  *
- * \warning It looks like libmpsse does NOT free the received data buffer,
- *  so we have to make sure to free it ourselves when not needed!
- *  Other option is maybe using Fast functions inside fast.c
+ * \return Number of payload bytes received, or SC_ERROR if reception
+ *         failed.
  ****************************************************************************/
-char *SCFrameRecv(struct mpsse_context *mpsse, uint8_t *maxlen) {
-	char *data;
-	uint8_t length;
+static int SCFrameRecvBus(ScCtx *sc, char *data, uint16_t maxlen) {
+	uint32_t avail;
+	uint32_t skipped = 0, polls = 0;
+	uint16_t length;
+	int hdrLen;
 
-	if (Start(mpsse)) SCStopNull();
-	// Seek SOF
-//	printf("Receiving SOF "); fflush(stdout);
+	while (1) {
+		// Seek SOF. Protocol v2 frames use a different SOF marker.
+		skipped += SCRxSeek(sc, SC_SOF, sc->v2?SC_SOF_V2:SC_SOF);
+		avail = sc->rxHead - sc->rxTail;
+		hdrLen = (avail && SC_RXBYTE(sc, 0) == SC_SOF_V2)?3:2;
+		// Get length, and wait until the complete frame is available
+		if (avail < hdrLen) {
+			polls += !avail;
+			if (SCRxFill(sc, hdrLen - avail, !avail)) return SC_ERROR;
+			continue;
+		}
+		length = SC_RXBYTE(sc, 1);
+		if (hdrLen == 3) length = (length<<8) | SC_RXBYTE(sc, 2);
+		if (length > maxlen) break;
+		if (avail < (length + hdrLen + 1)) {
+			if (SCRxFill(sc, length + hdrLen + 1 - avail, FALSE))
+				return SC_ERROR;
+			continue;
+		}
+		if (SC_RXBYTE(sc, length + hdrLen) != SC_EOF) break;
+
+		// Complete frame received, copy payload
+		sc->rxTail += hdrLen;
+		SCRxCopy(sc, data, length);
+		sc->rxTail++;
+		StatsAdd(STATS_SOF_POLL, polls, skipped);
+		return length;
+	}
+
+	// Frame error, discard buffered data
+	sc->rxTail = sc->rxHead;
+	return SC_ERROR;
+}
+
+/************************************************************************//**
+ * Receives a bulk chunk through the port. Implements SCChunkRecv().
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where chunk data will be stored.
+ * \param[in]  len Chunk length, up to SC_BULK_MAXLEN.
+ * \param[in]  seq Expected chunk sequence number.
+ *
+ * \return SC_OK on success, SC_CRC_ERROR if the chunk was received
+ *         completely but is damaged (so it can be requested again), or
+ *         SC_ERROR if reception failed.
+ ****************************************************************************/
+static int SCChunkRecvBus(ScCtx *sc, char *data, uint16_t len, uint8_t seq) {
+	uint32_t got;
+	uint16_t crc;
+	uint8_t rxSeq = 0;
+	uint8_t tail[2];
+	int tailLen = sc->crc?2:0;
+
+	// Seek SOB
 	do {
-		data = Read(mpsse, 1);
-//		printf("%02X, ", (uint8_t)*data); fflush(stdout);
-		if (data == NULL) SCStopNull();
-	} while(*data != SC_SOF);
-//	printf("OK!\n");
-	// Read data length
-//	printf("Reading length... "); fflush(stdout);
-	if ((data = Read(mpsse, 1)) == NULL) SCStopNull();
-	length = *data;
-//	printf("OK!, length=%d\n", length);
-	if (length > *maxlen) SCStopNull();
-//	printf("Receiving data... "); fflush(stdout);
-	if ((data = Read(mpsse, length + 1)) == NULL) SCStopNull();
-	if (Stop(mpsse)) SCStopNull();
-	if (data[length] != SC_EOF) return NULL;
-	// Update number of received characters
-	*maxlen = length;
-//	printf("OK!\n");
-	return data;
+		SCRxSeek(sc, SC_SOB, SC_SOB);
+		if (sc->rxTail == sc->rxHead && SCRxFill(sc, 1, TRUE))
+			return SC_ERROR;
+	} while (sc->rxTail == sc->rxHead);
+	sc->rxTail++;
+	if (sc->crc) {
+		if (sc->rxTail == sc->rxHead && SCRxFill(sc, 1, FALSE))
+			return SC_ERROR;
+		rxSeq = SC_RXBYTE(sc, 0);
+		sc->rxTail++;
+	}
+	// Copy already buffered data, and read the remaining chunk data
+	// directly into the destination buffer. Then check CRC and EOF.
+	got = MIN(sc->rxHead - sc->rxTail, len);
+	SCRxCopy(sc, data, got);
+	if (got < len && SCRxDirect(sc, data + got, len - got)) return SC_ERROR;
+	if ((sc->rxHead - sc->rxTail) < (uint32_t)(tailLen + 1) &&
+			SCRxFill(sc, tailLen + 1 - (sc->rxHead - sc->rxTail), FALSE))
+		return SC_ERROR;
+	SCRxCopy(sc, (char*)tail, tailLen);
+	if (SC_RXBYTE(sc, 0) != SC_EOF) {
+		// With CRC, keep data following the damaged chunk, it might hold
+		// replies to other requests
+		if (!sc->crc) sc->rxTail = sc->rxHead;
+		return sc->crc?SC_CRC_ERROR:SC_ERROR;
+	}
+	sc->rxTail++;
+	if (sc->crc) {
+		crc = Crc16(Crc16(CRC16_INIT, &rxSeq, 1), (uint8_t*)data, len);
+		if (rxSeq != seq || crc != ((tail[0]<<8) | tail[1]))
+			return SC_CRC_ERROR;
+	}
+
+	return SC_OK;
+}
+
+/************************************************************************//**
+ * Receives a long reply payload through the port. Implements
+ * SCPayloadRecv().
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where received payload will be copied.
+ * \param[in]  len Length of the payload to receive.
+ *
+ * \return SC_OK on success, SC_CRC_ERROR if a chunk was damaged, SC_ERROR
+ *         if reception failed.
+ ****************************************************************************/
+static int SCPayloadRecvBus(ScCtx *sc, char *data, uint32_t len) {
+	uint32_t recvd, chunk;
+	uint8_t seq;
+	int last;
+
+	if (!sc->bulk) {
+		for (recvd = 0; recvd < len; recvd += last) {
+			chunk = MIN(len - recvd, sc->frameMax);
+			if ((last = SCFrameRecvBus(sc, data + recvd, chunk)) != (int)chunk)
+				return SC_ERROR;
+		}
+		return SC_OK;
+	}
+
+	for (recvd = 0, seq = 0; recvd < len; recvd += chunk, seq++) {
+		chunk = MIN(len - recvd, SC_BULK_MAXLEN);
+		if ((last = SCChunkRecvBus(sc, data + recvd, chunk, seq))) return last;
+	}
+
+	return SC_OK;
+}
+
+/// Statistic of each traced function, indexed by trace record type
+static const StatsId scStatsId[] = {
+	[SC_TRACE_FRAME_SEND] = STATS_FRAME_SEND,
+	[SC_TRACE_FRAME_RECV] = STATS_FRAME_RECV,
+	[SC_TRACE_BATCH_SEND] = STATS_BATCH_SEND,
+	[SC_TRACE_CHUNK_SEND] = STATS_CHUNK_SEND,
+	[SC_TRACE_CHUNK_RECV] = STATS_CHUNK_RECV,
+	[SC_TRACE_PAYLOAD_SEND] = STATS_PAYLOAD_SEND,
+	[SC_TRACE_PAYLOAD_RECV] = STATS_PAYLOAD_RECV
+};
+
+/************************************************************************//**
+ * Accounts a call to a data function: adds it to the flight recorder, the
+ * statistics and the timeline, and records it if a trace is being
+ * recorded.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] type Record type (SC_TRACE_*).
+ * \param[in] start Call start time, in nanoseconds.
+ * \param[in] ret Call result.
+ * \param[in] arg Call argument.
+ * \param[in] data Data sent or received by the call.
+ * \param[in] len Length of the data. For batches, it includes the length
+ *            of each frame (two bytes), see SCBatchPack().
+ *
+ * \return The call result.
+ ****************************************************************************/
+static int SCTraced(ScCtx *sc, uint8_t type, uint64_t start, int ret,
+		uint32_t arg, const void *data, uint32_t len) {
+	uint64_t dur = SCTraceNow() - start;
+	ScTraceRec rec;
+
+	FlightRecAdd(type, sc->id, ret, arg, data, len);
+	StatsEnd(scStatsId[type], start,
+			(type == SC_TRACE_BATCH_SEND)?len - 2 * arg:len);
+	if (!sc->trace || sc->replay) return ret;
+	rec.type = type;
+	rec.start = start;
+	rec.dur = dur;
+	rec.ret = ret;
+	rec.arg = arg;
+	rec.len = len;
+	rec.data = data;
+	SCTraceWrite(sc->trace, &rec);
+
+	return ret;
+}
+
+/************************************************************************//**
+ * Sends data through the MPSSE interface, using a tiny framing protocol.
+ * If payload is longer than the maximum frame length, it is split in
+ * several frames. All the frames needed to send up to SC_BULK_MAXLEN bytes
+ * of payload (including the chip select toggling between them) are sent in
+ * a single USB transfer. Returns as soon as the last transfer is submitted
+ * (see SCQueueSet()), data buffer can be reused at that point.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] data Data payload to send.
+ * \param[in] datalen Length of the data payload to send in bytes.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCFrameSend(ScCtx *sc, char *data, uint16_t datalen) {
+	uint64_t start = SCTraceNow();
+	int ret;
+
+	if (sc->replay) ret = SCTraceSend(sc->trace, SC_TRACE_FRAME_SEND, 0,
+			data, datalen);
+	else ret = SCFrameSendBus(sc, data, datalen);
+	return SCTraced(sc, SC_TRACE_FRAME_SEND, start, ret, 0, data, datalen);
 }
 
+/************************************************************************//**
+ * Packs the frames of a batch in a buffer, each one preceded by its length
+ * (two bytes, big endian), so they can be recorded or compared.
+ *
+ * \param[in]  frame Frames to pack.
+ * \param[in]  count Number of frames to pack.
+ * \param[out] len Length of the packed frames.
+ *
+ * \return Buffer holding the packed frames, to be freed with free(), or
+ *         NULL if allocation failed.
+ ****************************************************************************/
+static uint8_t *SCBatchPack(const ScFrame *frame, unsigned int count,
+		uint32_t *len) {
+	uint8_t *buf;
+	unsigned int i;
 
+	for (i = 0, *len = 0; i < count; i++) *len += 2 + frame[i].len;
+	if (!(buf = malloc(*len + 1))) return NULL;
+	for (i = 0, *len = 0; i < count; i++) {
+		buf[(*len)++] = frame[i].len>>8;
+		buf[(*len)++] = frame[i].len;
+		memcpy(buf + *len, frame[i].data, frame[i].len);
+		*len += frame[i].len;
+	}
+
+	return buf;
+}
+
+/************************************************************************//**
+ * Sends several short frames, using as few USB transfers as possible
+ * (usually a single one). Each frame is sent in its own chip select cycle.
+ * Returns as soon as the last transfer is submitted (see SCQueueSet()).
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] frame Frames to send.
+ * \param[in] count Number of frames to send.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCFrameBatchSend(ScCtx *sc, const ScFrame *frame, unsigned int count) {
+	uint64_t start = SCTraceNow();
+	uint8_t *buf = NULL;
+	uint32_t len = 0;
+	unsigned int i;
+	int ret;
+
+	// Frames are only packed if they have to be recorded or compared
+	if (sc->trace && !(buf = SCBatchPack(frame, count, &len)))
+		return SC_ERROR;
+	for (i = 0; !buf && (i < count); i++) len += 2 + frame[i].len;
+	if (sc->replay) {
+		ret = SCTraceSend(sc->trace, SC_TRACE_BATCH_SEND, count, buf, len);
+	} else ret = SCFrameBatchSendBus(sc, frame, count);
+	ret = SCTraced(sc, SC_TRACE_BATCH_SEND, start, ret, count, buf, len);
+	free(buf);
+
+	return ret;
+}
+
+/************************************************************************//**
+ * Sends a chunk of a long command payload, using the bulk phase: SOB, data
+ * and EOF, in a single chip select cycle. If CRC protection is enabled, SOB
+ * is followed by the chunk sequence number, and data by the CRC-16 of the
+ * sequence number and data. Returns as soon as the transfer is submitted
+ * (see SCQueueSet()), data buffer can be reused at that point.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] data Chunk data.
+ * \param[in] len Chunk length, up to SC_BULK_MAXLEN.
+ * \param[in] seq Chunk sequence number.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCChunkSend(ScCtx *sc, char *data, uint16_t len, uint8_t seq) {
+	uint64_t start = SCTraceNow();
+	int ret;
+
+	if (sc->replay) ret = SCTraceSend(sc->trace, SC_TRACE_CHUNK_SEND, seq,
+			data, len);
+	else ret = SCChunkSendBus(sc, data, len, seq);
+	return SCTraced(sc, SC_TRACE_CHUNK_SEND, start, ret, seq, data, len);
+}
+
+/************************************************************************//**
+ * Sends a long command payload. If the bulk phase was negotiated, payload
+ * is sent unframed using SCChunkSend() for each SC_BULK_MAXLEN bytes, with
+ * sequence numbers starting from 0. Otherwise it is sent using
+ * SCFrameSend().
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] data Data payload to send.
+ * \param[in] datalen Length of the data payload to send in bytes.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCPayloadSend(ScCtx *sc, char *data, uint16_t datalen) {
+	uint64_t start = SCTraceNow();
+	int ret;
+
+	if (sc->replay) ret = SCTraceSend(sc->trace, SC_TRACE_PAYLOAD_SEND, 0,
+			data, datalen);
+	else ret = SCPayloadSendBus(sc, data, datalen);
+	return SCTraced(sc, SC_TRACE_PAYLOAD_SEND, start, ret, 0, data,
+			datalen);
+}
+
+/************************************************************************//**
+ * Receives data through the MPSSE interface, using a tiny framing protocol.
+ * Frames already in the receive buffer are returned without accessing the
+ * bus. Received payload is copied to the caller supplied buffer, so no
+ * memory is allocated.
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where received payload will be copied.
+ * \param[in]  maxlen Maximum length of the data payload to receive.
+ *
+ * \return Number of payload bytes received, or SC_ERROR if reception
+ *         failed.
+ ****************************************************************************/
+int SCFrameRecv(ScCtx *sc, char *data, uint16_t maxlen) {
+	uint64_t start = SCTraceNow();
+	int ret;
+
+	if (sc->replay) ret = SCTraceRecv(sc->trace, SC_TRACE_FRAME_RECV,
+			maxlen, data, maxlen);
+	else ret = SCFrameRecvBus(sc, data, maxlen);
+	return SCTraced(sc, SC_TRACE_FRAME_RECV, start, ret, maxlen, data,
+			(ret > 0)?ret:0);
+}
+
+/************************************************************************//**
+ * Receives a chunk of a long reply payload, sent by the programmer using
+ * the bulk phase (see SCChunkSend()). Bulk phase must have been negotiated.
+ * Chunk data not yet buffered is read directly into the caller buffer.
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where chunk data will be stored.
+ * \param[in]  len Chunk length, up to SC_BULK_MAXLEN.
+ * \param[in]  seq Expected chunk sequence number.
+ *
+ * \return SC_OK on success, SC_CRC_ERROR if the chunk was received
+ *         completely but is damaged (so it can be requested again), or
+ *         SC_ERROR if reception failed.
+ ****************************************************************************/
+int SCChunkRecv(ScCtx *sc, char *data, uint16_t len, uint8_t seq) {
+	uint64_t start = SCTraceNow();
+	int ret;
+
+	if (sc->replay) ret = SCTraceRecv(sc->trace, SC_TRACE_CHUNK_RECV, seq,
+			data, len);
+	else ret = SCChunkRecvBus(sc, data, len, seq);
+	return SCTraced(sc, SC_TRACE_CHUNK_RECV, start, ret, seq, data,
+			(ret == SC_ERROR)?0:len);
+}
+
+/************************************************************************//**
+ * Receives a long reply payload. If the bulk phase was negotiated, payload
+ * is received unframed using SCChunkRecv() for each SC_BULK_MAXLEN bytes,
+ * with sequence numbers starting from 0. Otherwise it is received as frames
+ * of the maximum length, using SCFrameRecv().
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where received payload will be copied.
+ * \param[in]  len Length of the payload to receive.
+ *
+ * \return SC_OK on success, SC_CRC_ERROR if a chunk was damaged, SC_ERROR
+ *         if reception failed.
+ ****************************************************************************/
+int SCPayloadRecv(ScCtx *sc, char *data, uint32_t len) {
+	uint64_t start = SCTraceNow();
+	int ret;
+
+	if (sc->replay) ret = SCTraceRecv(sc->trace, SC_TRACE_PAYLOAD_RECV, 0,
+			data, len);
+	else ret = SCPayloadRecvBus(sc, data, len);
+	return SCTraced(sc, SC_TRACE_PAYLOAD_RECV, start, ret, 0, data,
+			(ret == SC_ERROR)?0:len);
+}
 
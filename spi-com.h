@@ -9,85 +9,459 @@
  * Frames are delimited by the SOF/EOF characters. Following SOF, payload
  * length in sent using 1 byte. Then data follows, and finally EOF character
  * ends transmission.
+ *
+ * Protocol v2 (negotiated with the programmer firmware) adds frames starting
+ * with SOF_V2, followed by a 16-bit big endian payload length, allowing
+ * payloads longer than SC_MAX_DATALEN. It also allows sending long payloads
+ * unframed (bulk phase): SOB, then up to SC_BULK_MAXLEN data bytes, then EOF,
+ * with the length known from the preceding command header. If CRC
+ * protection is also negotiated, SOB is followed by a chunk sequence number,
+ * and data by a CRC-16 of the sequence number and data, so damaged chunks
+ * can be detected and transferred again on their own.
+ *
+ * Received data is read in blocks as large as possible into a ring buffer,
+ * and frames are searched inside the buffer. This way several frames can be
+ * obtained using a single USB transfer.
+ *
+ * Transfers to the programmer are submitted asynchronously when the port
+ * backend supports it, using several transmit buffers, so the next transfer
+ * is built while the previous ones are still in flight. The number of
+ * transfers in flight is set with SCQueueSet().
+ *
+ * In duplex mode (SCDuplexSet()), data clocked in while sending is also
+ * read into the ring buffer, so replies sent by the programmer while it
+ * receives a transfer do not need additional bus cycles.
  * 
  * \author Jesus Alonso (doragasu)
  * \date   2016
- * \note   Uses open source mpsse library to interface FT2232 in MSPSSE mode.
+ * \note   Interfaces FT2232 in MPSSE mode through a port backend (libmpsse
+ *         or libftdi), see sc-port.h.
  ****************************************************************************/
 #ifndef _SPI_COM_H_
 #define _SPI_COM_H_
 
 #include <stdint.h>
-#include <mpsse.h>
-
-/// SPI mode for using with MPSSE library
-#define SC_SPI_MODE		SPI0
-/// Maximum CLK for atmega8515 as SPI slave, is FOSC/4=12MHz/4
-/// \todo Test if CLK can be increased by changing crystal oscillator
-/// to a 16 MHz one.
-//#define SC_SPI_CLK		400000
+/// Default SPI CLK. Maximum CLK for atmega8515 as SPI slave, is
+/// FOSC/4=12MHz/4. Faster settings can be found for each programmer
+/// using the autotune module.
 #define SC_SPI_CLK		100000
+/// Default FTDI latency timer value in milliseconds
+#define SC_LATENCY_MS	2
+/// Default USB transfer chunk size
+#define SC_USB_CHUNK	65535
+/// Maximum length of the USB serial number string, including terminator
+#define SC_SERIAL_MAXLEN	32
 
 /// Start of frame marker
 #define SC_SOF			0x7E
 /// En of frame marker
 #define SC_EOF			0x7D
+/// Start of protocol v2 frame marker (16-bit length)
+#define SC_SOF_V2		0x7C
+/// Start of bulk phase marker (protocol v2)
+#define SC_SOB			0x7B
+/// Byte sent by the programmer in duplex mode when it has no data to send
+#define SC_FILL			0xFF
 
 /// USB Vendor ID of the programmer board
 #define SC_VID			0x0403
 /// USB Device ID of the programmer board
 #define SC_PID			0x6010
-/// FT2232 interface used to communicate with the microcontroller.
-#define SC_IFACE		IFACE_B
 
 /// Maximum data payload is 32 bytes long
 #define SC_MAX_DATALEN	32
+/// Protocol feature flag: unframed bulk phase for long payloads
+#define SC_PROTO_F_BULK		0x01
+/// Protocol feature flag: sequence number and CRC-16 on bulk chunks
+#define SC_PROTO_F_CRC		0x02
+/// Protocol feature flag: programmer sends replies while receiving
+#define SC_PROTO_F_DUPLEX	0x04
+/// Protocol feature flag: programmer drives a ready line when replies are
+/// available
+#define SC_PROTO_F_READY	0x08
+
+/// Maximum data payload supported by protocol v2 frames
+#define SC_V2_MAX_DATALEN	4096
+
+/// Maximum number of USB transfers in flight
+#define SC_QUEUE_MAX		4
+/// Default number of USB transfers in flight, when supported by the port
+#define SC_QUEUE_DEFAULT	2
+
+/// Maximum payload length SCFrameSend() packs in a single USB transfer.
+/// Longer payloads are split in several transfers.
+#define SC_BULK_MAXLEN	32768
+
+/// Communications handler, obtained with SCInit().
+typedef struct ScCtx ScCtx;
+
+/// Link settings, that can be tuned for each programmer.
+typedef struct {
+	uint32_t clk;		///< SPI clock frequency in Hz
+	uint32_t chunk;		///< USB transfer chunk size in bytes
+	uint8_t latency;	///< FTDI latency timer in milliseconds
+} ScLinkCfg;
 
 /** \addtogroup ScRetVals
  *  \brief Return values for this module.
  *  \{ */
 /// OK status (0)
-#define SC_OK			MPSSE_OK
+#define SC_OK			 0
 /// Error status (-1)
-#define SC_ERROR		MPSSE_FAIL
+#define SC_ERROR		-1
+/// Damaged data chunk, that can be transferred again (-2)
+#define SC_CRC_ERROR	-2
 /** \} */
 
+/// Frame to send using SCFrameBatchSend()
+typedef struct {
+	char *data;			///< Frame payload
+	uint16_t len;		///< Frame payload length, up to SC_MAX_DATALEN
+} ScFrame;
+
+#ifndef SC_BACKEND_DEFAULT
+/// Port backend used unless SCBackendSet() selects another one
+#define SC_BACKEND_DEFAULT	"mpsse"
+#endif
+
+/************************************************************************//**
+ * Selects the port backend used by SCInit(). Available backends are
+ * "mpsse" (unless built without libmpsse support), "ftdi" and "sim" (only
+ * when built with simulation support).
+ *
+ * \param[in] name Name of the backend to use.
+ *
+ * \return SC_OK on success, SC_ERROR if the backend is not available.
+ ****************************************************************************/
+int SCBackendSet(const char *name);
+
+/************************************************************************//**
+ * Records the traffic of the interfaces opened from now on to a trace file.
+ * See sc-trace.h for the file format.
+ *
+ * \param[in] file Trace file name, or NULL to stop recording.
+ ****************************************************************************/
+void SCTraceSet(const char *file);
+
+/************************************************************************//**
+ * Replays a previously recorded trace file, instead of using a programmer,
+ * on the interfaces opened from now on. The data functions return the
+ * recorded results, and fail if the data sent is not the recorded one.
+ *
+ * \param[in] file  Trace file name, or NULL to stop replaying.
+ * \param[in] timed TRUE to make each call take the time it took when
+ *            recorded, FALSE to return immediately.
+ ****************************************************************************/
+void SCReplaySet(const char *file, int timed);
+
+/************************************************************************//**
+ * Selects whether the link settings stored for a programmer are applied
+ * when opening it. They are applied unless disabled, e.g. to find new ones.
+ *
+ * \param[in] use TRUE to apply stored link settings to the interfaces
+ *            opened from now on, FALSE to open them with the defaults.
+ ****************************************************************************/
+void SCLinkStoredSet(int use);
+
 /************************************************************************//**
  * Module initialization. Call this function to obtain the handler needed
- * to call any other function in this module.
+ * to call any other function in this module. If link settings are stored
+ * for the serial number of the opened programmer, they are applied, unless
+ * disabled with SCLinkStoredSet().
+ *
+ * \param[in] channel Channel number of the FT2232 device to open.
+ *
+ * \return The handler of the opened interface, or NULL if opening the
+ *         FT2232 MPSSE interface failed.
+ ****************************************************************************/
+ScCtx *SCInit(unsigned int channel);
+
+/************************************************************************//**
+ * Lists the USB serial numbers of the connected programmers, using the
+ * selected port backend.
+ *
+ * \param[out] serial Serial numbers of the found programmers.
+ * \param[in]  max    Maximum number of serial numbers to obtain.
+ *
+ * \return Number of programmers found, or SC_ERROR.
+ ****************************************************************************/
+int SCList(char serial[][SC_SERIAL_MAXLEN], int max);
+
+/************************************************************************//**
+ * Module initialization, opening the programmer with the specified USB
+ * serial number. Handlers of different programmers can be used
+ * concurrently from different threads, but each handler must only be used
+ * by one thread at a time.
  *
  * \param[in] channel Channel number of the FT2232 device to open.
+ * \param[in] serial  USB serial number of the programmer to open, or NULL
+ *            to open the first one found.
+ *
+ * \return The handler of the opened interface, or NULL if opening the
+ *         FT2232 MPSSE interface failed.
+ ****************************************************************************/
+ScCtx *SCInitSerial(unsigned int channel, const char *serial);
+
+/************************************************************************//**
+ * Waits until all the transfers in flight complete.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return SC_OK on success, SC_ERROR if any of the transfers failed.
+ ****************************************************************************/
+int SCTxFlush(ScCtx *sc);
+
+/************************************************************************//**
+ * Closes the interface, waiting for the transfers in flight to complete,
+ * and frees the handler.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ ****************************************************************************/
+void SCClose(ScCtx *sc);
+
+/************************************************************************//**
+ * Sets the number of USB transfers that can be in flight. While a transfer
+ * is in flight, next ones can be built and submitted. Depth 1 makes all
+ * transfers synchronous.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] depth Number of transfers that can be in flight, from 1 to
+ *            SC_QUEUE_MAX.
+ *
+ * \return SC_OK on success, SC_ERROR if depth is not supported by the
+ *         port backend.
+ ****************************************************************************/
+int SCQueueSet(ScCtx *sc, unsigned int depth);
+
+/************************************************************************//**
+ * Checks if duplex mode can be used with the port in use.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return TRUE if duplex mode is supported, FALSE otherwise.
+ ****************************************************************************/
+int SCDuplexSupported(ScCtx *sc);
+
+/************************************************************************//**
+ * Enables or disables duplex mode. In duplex mode, data clocked in while
+ * sending is also read, so replies sent by the programmer while it receives
+ * a transfer are obtained without additional bus cycles. Requires the port
+ * to support asynchronous transfers.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] enable TRUE to enable duplex mode, FALSE to disable it.
+ *
+ * \return SC_OK on success, SC_ERROR if duplex mode is not supported.
+ ****************************************************************************/
+int SCDuplexSet(ScCtx *sc, int enable);
+
+/************************************************************************//**
+ * Enables or disables waiting for the programmer ready line. When enabled,
+ * the MPSSE engine waits for the line (GPIOL1) to go high before reading
+ * the start of a reply, instead of the host polling the SPI bus. The ready
+ * line pin is configured as input.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] enable TRUE to wait for the ready line, FALSE to poll.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCReadySet(ScCtx *sc, int enable);
+
+/************************************************************************//**
+ * Obtains the USB serial number of the opened programmer.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return The serial number string, empty if it could not be obtained.
+ ****************************************************************************/
+const char *SCSerialGet(ScCtx *sc);
+
+/************************************************************************//**
+ * Obtains the link settings in use.
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] cfg Link settings in use.
+ ****************************************************************************/
+void SCLinkGet(ScCtx *sc, ScLinkCfg *cfg);
+
+/************************************************************************//**
+ * Applies the specified link settings.
  *
- * \return The handler of the opened FT2232 MPSSE interface, or NULL if
- *         opening the interface failed.
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] cfg Link settings to apply.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
  ****************************************************************************/
-struct mpsse_context *SCInit(unsigned int channel);
+int SCLinkSet(ScCtx *sc, const ScLinkCfg *cfg);
+
+/************************************************************************//**
+ * Checks if the link settings in use are the ones stored for the
+ * programmer, applied when it was opened.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return TRUE if stored link settings are in use, FALSE otherwise.
+ ****************************************************************************/
+int SCLinkStored(ScCtx *sc);
+
+/************************************************************************//**
+ * Sets the framing protocol, as negotiated with the programmer.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] frameMax Maximum frame payload length. If greater than
+ *            SC_MAX_DATALEN, protocol v2 frames (16-bit length) are used.
+ * \param[in] features Protocol features (SC_PROTO_F_*) to use. CRC
+ *            protection requires the bulk phase.
+ *
+ * \return SC_OK on success, SC_ERROR if settings are not supported.
+ ****************************************************************************/
+int SCProtoSet(ScCtx *sc, uint16_t frameMax, uint8_t features);
+
+/************************************************************************//**
+ * Obtains the maximum frame payload length in use.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ *
+ * \return Maximum frame payload length.
+ ****************************************************************************/
+uint16_t SCFrameMaxGet(ScCtx *sc);
+
+/************************************************************************//**
+ * Discards received data not read yet, and data announced with
+ * SCRecvExpect(). Call before starting a new exchange, if no replies to
+ * previous requests are pending.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ ****************************************************************************/
+void SCRxDiscard(ScCtx *sc);
 
 /************************************************************************//**
  * Sends data through the MPSSE interface, using a tiny framing protocol.
+ * If payload is longer than the maximum frame length (SC_MAX_DATALEN unless
+ * changed with SCProtoSet()), it is split in several frames.
+ * All the frames needed to send up to SC_BULK_MAXLEN bytes of payload
+ * (including the chip select toggling between them) are sent in a single
+ * USB transfer. Returns as soon as the last transfer is submitted (see
+ * SCQueueSet()), data buffer can be reused at that point.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] data Data payload to send.
+ * \param[in] datalen Length of the data payload to send in bytes.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCFrameSend(ScCtx *sc, char *data, uint16_t datalen);
+
+/************************************************************************//**
+ * Sends several short frames, using as few USB transfers as possible
+ * (usually a single one). Each frame is sent in its own chip select cycle.
+ * Returns as soon as the last transfer is submitted (see SCQueueSet()).
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] frame Frames to send.
+ * \param[in] count Number of frames to send.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCFrameBatchSend(ScCtx *sc, const ScFrame *frame, unsigned int count);
+
+/************************************************************************//**
+ * Sends a chunk of a long command payload, using the bulk phase: SOB, data
+ * and EOF, in a single chip select cycle. If CRC protection is enabled, SOB
+ * is followed by the chunk sequence number, and data by the CRC-16 of the
+ * sequence number and data. Returns as soon as the transfer is submitted
+ * (see SCQueueSet()), data buffer can be reused at that point.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] data Chunk data.
+ * \param[in] len Chunk length, up to SC_BULK_MAXLEN.
+ * \param[in] seq Chunk sequence number.
+ *
+ * \return SC_OK on success, SC_ERROR on fail.
+ ****************************************************************************/
+int SCChunkSend(ScCtx *sc, char *data, uint16_t len, uint8_t seq);
+
+/************************************************************************//**
+ * Sends a long command payload. If the bulk phase was negotiated, payload
+ * is sent unframed using SCChunkSend() for each SC_BULK_MAXLEN bytes, with
+ * sequence numbers starting from 0. Otherwise it is sent using
+ * SCFrameSend().
  *
- * \param[in] mpsse Handler of the previously opened MPSSE interface.
+ * \param[in] sc Handler of the previously opened interface.
  * \param[in] data Data payload to send.
  * \param[in] datalen Length of the data payload to send in bytes.
  *
  * \return SC_OK on success, SC_ERROR on fail.
  ****************************************************************************/
-int SCFrameSend(struct mpsse_context *mpsse, char *data, uint16_t datalen);
+int SCPayloadSend(ScCtx *sc, char *data, uint16_t datalen);
+
+/************************************************************************//**
+ * Announces the amount of long payload data the programmer is about to
+ * send. This allows reading it using as few USB transfers as possible.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] payloadLen Length of the payload to be received using
+ *            SCPayloadRecv().
+ ****************************************************************************/
+void SCRecvExpect(ScCtx *sc, uint32_t payloadLen);
+
+/************************************************************************//**
+ * Announces the number of frames the programmer is about to send, e.g.
+ * the replies to the frames sent using SCFrameBatchSend(). This allows
+ * reading them using as few USB transfers as possible.
+ *
+ * \param[in] sc Handler of the previously opened interface.
+ * \param[in] frames Number of frames to be received using SCFrameRecv().
+ * \param[in] payloadLen Minimum length of the payload of all the frames.
+ ****************************************************************************/
+void SCFrameExpect(ScCtx *sc, uint32_t frames, uint32_t payloadLen);
 
 /************************************************************************//**
  * Receives data through the MPSSE interface, using a tiny framing protocol.
+ * Frames already in the receive buffer are returned without accessing the
+ * bus. Received payload is copied to the caller supplied buffer, so no
+ * memory is allocated.
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where received payload will be copied.
+ * \param[in]  maxlen Maximum length of the data payload to receive.
  *
- * \param[in] mpsse Handler of the previously opened MPSSE interface.
- * \param[inout] maxlen Maximum length of the data payload to receive. On
- *               function return, holds the number of bytes received.
+ * \return Number of payload bytes received, or SC_ERROR if reception
+ *         failed.
+ ****************************************************************************/
+int SCFrameRecv(ScCtx *sc, char *data, uint16_t maxlen);
+
+/************************************************************************//**
+ * Receives a chunk of a long reply payload, sent by the programmer using
+ * the bulk phase (see SCChunkSend()). Bulk phase must have been negotiated.
+ * Chunk data not yet buffered is read directly into the caller buffer.
+ *
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where chunk data will be stored.
+ * \param[in]  len Chunk length, up to SC_BULK_MAXLEN.
+ * \param[in]  seq Expected chunk sequence number.
+ *
+ * \return SC_OK on success, SC_CRC_ERROR if the chunk was received
+ *         completely but is damaged (so it can be requested again), or
+ *         SC_ERROR if reception failed.
+ ****************************************************************************/
+int SCChunkRecv(ScCtx *sc, char *data, uint16_t len, uint8_t seq);
+
+/************************************************************************//**
+ * Receives a long reply payload. If the bulk phase was negotiated, payload
+ * is received unframed using SCChunkRecv() for each SC_BULK_MAXLEN bytes,
+ * with sequence numbers starting from 0. Otherwise it is received as frames
+ * of the maximum length, using SCFrameRecv().
  *
- * \return Pointer to the received data, or NULL if reception failed.
+ * \param[in]  sc Handler of the previously opened interface.
+ * \param[out] data Buffer where received payload will be copied.
+ * \param[in]  len Length of the payload to receive.
  *
- * \warning It looks like libmpsse does NOT free the received data buffer,
- *  so we have to make sure to free it ourselves when not needed!
- *  Other option is maybe using Fast functions inside fast.c
+ * \return SC_OK on success, SC_CRC_ERROR if a chunk was damaged, SC_ERROR
+ *         if reception failed.
  ****************************************************************************/
-char *SCFrameRecv(struct mpsse_context *mpsse, uint8_t *maxlen);
+int SCPayloadRecv(ScCtx *sc, char *data, uint32_t len);
 
 #endif /*_SPI_COM_H_*/
 
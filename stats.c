@@ -0,0 +1,343 @@
+/************************************************************************//**
+ * \file
+ * \brief Performance counters and latency histograms.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#include "stats.h"
+#include "sc-trace.h"
+#include "util.h"
+#include <stdio.h>
+#include <glib.h>
+
+/// Values are kept in histograms up to 2^STATS_VALUE_BITS (about 18
+/// minutes, for durations). Higher values go to the last bucket.
+#define STATS_VALUE_BITS	40
+/// Number of histogram buckets
+#define STATS_BUCKETS	((STATS_VALUE_BITS - STATS_SUB_BITS + 1) * \
+		STATS_SUB_BUCKETS)
+
+/// Statistic data.
+typedef struct {
+	uint64_t count;		///< Number of events
+	uint64_t bytes;		///< Bytes moved by the events
+	uint64_t sum;		///< Sum of the event values
+	uint64_t min;		///< Lowest event value
+	uint64_t max;		///< Highest event value
+	uint32_t hist[STATS_BUCKETS];	///< Event values histogram
+} Stat;
+
+/// Names of the statistics, except the command ones
+static const char *const statsName[STATS_CMD] = {
+	"Frame send", "Frame recv", "Batch send", "Chunk send", "Chunk recv",
+	"Payload send", "Payload recv", "SOF polls", "File read", "File write"
+};
+
+/// Names of the command opcodes, NULL for unknown ones
+static const char *const statsCmdName[STATS_CMD_OPCODES] = {
+	NULL, "FW_VER", "CHR_WRITE", "PRG_WRITE", "CHR_READ", "PRG_READ",
+	"CHR_ERASE", "PRG_ERASE", "FLASH_ID", "RAM_WRITE", "RAM_READ",
+	"MAPPER_SET", "CAPS"
+};
+
+/// Statistics data
+static Stat stats[STATS_MAX];
+/// Lock serializing statistics updates from different threads
+static GMutex statsLock;
+/// Statistics are being kept
+static int statsOn = FALSE;
+/// Timeline file, NULL if no timeline is being written
+static FILE *statsTl;
+/// Number of events written to the timeline
+static uint32_t statsTlCount;
+/// Timeline identifier of the calling thread, 0 until assigned
+static GPrivate statsTid = G_PRIVATE_INIT(NULL);
+/// Last timeline thread identifier assigned
+static gint statsTidLast;
+
+/************************************************************************//**
+ * Starts keeping statistics.
+ ****************************************************************************/
+void StatsEnable(void) {
+	statsOn = TRUE;
+}
+
+/************************************************************************//**
+ * Obtains the start time of an event, to be passed later to StatsEnd().
+ *
+ * \return Timestamp in nanoseconds, or 0 if neither statistics nor a
+ *         timeline are enabled.
+ ****************************************************************************/
+uint64_t StatsStart(void) {
+	return (statsOn || statsTl)?SCTraceNow():0;
+}
+
+/************************************************************************//**
+ * Obtains a timestamp, even if statistics are not enabled.
+ *
+ * \return Timestamp in nanoseconds.
+ ****************************************************************************/
+uint64_t StatsNow(void) {
+	return SCTraceNow();
+}
+
+/************************************************************************//**
+ * Obtains the name of a statistic.
+ *
+ * \param[in]  id   Statistic.
+ * \param[out] buf  Buffer for names that have to be built.
+ * \param[in]  size Size of buf.
+ *
+ * \return Name of the statistic.
+ ****************************************************************************/
+static const char *StatsName(StatsId id, char *buf, size_t size) {
+	if (id < STATS_CMD) return statsName[id];
+	if (statsCmdName[id - STATS_CMD]) {
+		snprintf(buf, size, "CMD %s", statsCmdName[id - STATS_CMD]);
+	} else snprintf(buf, size, "CMD 0x%02X", id - STATS_CMD);
+	return buf;
+}
+
+/************************************************************************//**
+ * Starts writing a timeline of the events and spans, in Chrome trace event
+ * format. Events are written as they end.
+ *
+ * \param[in] file Timeline file name.
+ *
+ * \return 0 on success, -1 if the file could not be created.
+ ****************************************************************************/
+int StatsTimelineOpen(const char *file) {
+	if (!(statsTl = fopen(file, "w"))) {
+		perror(file);
+		return -1;
+	}
+	fputs("[\n", statsTl);
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Obtains the timeline identifier of the calling thread, assigning one if
+ * it has none.
+ *
+ * \return Thread identifier, starting from 1.
+ ****************************************************************************/
+static int StatsTid(void) {
+	int tid = GPOINTER_TO_INT(g_private_get(&statsTid));
+
+	if (!tid) {
+		tid = g_atomic_int_add(&statsTidLast, 1) + 1;
+		g_private_set(&statsTid, GINT_TO_POINTER(tid));
+	}
+	return tid;
+}
+
+/************************************************************************//**
+ * Writes an event to the timeline. Events on a thread are shown nested,
+ * so events that can overlap with others on the same thread are written
+ * as asynchronous events, that get their own track. Must be called with
+ * the statistics lock held.
+ *
+ * \param[in] name  Event name.
+ * \param[in] cat   Event category.
+ * \param[in] start Event start time, in nanoseconds.
+ * \param[in] end   Event end time, in nanoseconds.
+ * \param[in] bytes Bytes moved by the event, added as argument if not 0.
+ * \param[in] async TRUE to write an asynchronous event.
+ ****************************************************************************/
+static void StatsTlEvent(const char *name, const char *cat, uint64_t start,
+		uint64_t end, uint64_t bytes, int async) {
+	int tid = StatsTid();
+
+	if (statsTlCount++) fputs(",\n", statsTl);
+	if (async) {
+		fprintf(statsTl, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"b\","
+				"\"id\":%u,\"ts\":%.3f,\"pid\":1,\"tid\":%d},\n", name, cat,
+				statsTlCount, start / 1e3, tid);
+		fprintf(statsTl, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"e\","
+				"\"id\":%u,\"ts\":%.3f,\"pid\":1,\"tid\":%d", name, cat,
+				statsTlCount, end / 1e3, tid);
+	} else {
+		fprintf(statsTl, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+				"\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d", name, cat,
+				start / 1e3, (end - start) / 1e3, tid);
+	}
+	if (bytes) fprintf(statsTl, ",\"args\":{\"bytes\":%llu}",
+			(unsigned long long)bytes);
+	fputc('}', statsTl);
+}
+
+/************************************************************************//**
+ * Adds a span to the timeline, if one is being written. Spans mark program
+ * phases, and are not kept in statistics.
+ *
+ * \param[in] name  Span name.
+ * \param[in] start Span start time, obtained with StatsStart() or
+ *            StatsNow().
+ * \param[in] end   Span end time, obtained with StatsNow().
+ ****************************************************************************/
+void StatsSpan(const char *name, uint64_t start, uint64_t end) {
+	if (!statsTl || !start) return;
+	g_mutex_lock(&statsLock);
+	StatsTlEvent(name, "phase", start, end, 0, FALSE);
+	g_mutex_unlock(&statsLock);
+}
+
+/************************************************************************//**
+ * Finishes writing the timeline, if one is being written.
+ ****************************************************************************/
+void StatsTimelineClose(void) {
+	if (!statsTl) return;
+	fputs("\n]\n", statsTl);
+	if (fclose(statsTl)) perror("Writing timeline");
+	statsTl = NULL;
+}
+
+/************************************************************************//**
+ * Obtains the histogram bucket holding a value. Values lower than
+ * STATS_SUB_BUCKETS get a bucket each. Then each power of two range is
+ * split in STATS_SUB_BUCKETS buckets.
+ *
+ * \param[in] value Value to find.
+ *
+ * \return Bucket index.
+ ****************************************************************************/
+static unsigned int StatsBucket(uint64_t value) {
+	unsigned int shift;
+
+	value = MIN(value, ((uint64_t)1<<STATS_VALUE_BITS) - 1);
+	if (value < STATS_SUB_BUCKETS) return value;
+	shift = 63 - __builtin_clzll(value) - STATS_SUB_BITS;
+	return (shift + 1) * STATS_SUB_BUCKETS +
+		((value>>shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+/************************************************************************//**
+ * Obtains the highest value held by a histogram bucket.
+ *
+ * \param[in] bucket Bucket index.
+ *
+ * \return Highest value in the bucket.
+ ****************************************************************************/
+static uint64_t StatsBucketMax(unsigned int bucket) {
+	unsigned int shift;
+
+	if (bucket < STATS_SUB_BUCKETS) return bucket;
+	shift = bucket / STATS_SUB_BUCKETS - 1;
+	return ((uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS + 1)
+			<<shift) - 1;
+}
+
+/************************************************************************//**
+ * Adds an event to a statistic.
+ *
+ * \param[in] id    Statistic to update.
+ * \param[in] value Event value (duration in nanoseconds for most).
+ * \param[in] bytes Bytes moved by the event.
+ ****************************************************************************/
+void StatsAdd(StatsId id, uint64_t value, uint64_t bytes) {
+	Stat *s = stats + id;
+
+	if (!statsOn || (id >= STATS_MAX)) return;
+	g_mutex_lock(&statsLock);
+	if (!s->count || (value < s->min)) s->min = value;
+	s->max = MAX(s->max, value);
+	s->count++;
+	s->bytes += bytes;
+	s->sum += value;
+	s->hist[StatsBucket(value)]++;
+	g_mutex_unlock(&statsLock);
+}
+
+/************************************************************************//**
+ * Adds an event started with StatsStart() to a statistic, using the time
+ * elapsed since then as value, and writes it to the timeline, if one is
+ * being written.
+ *
+ * \param[in] id    Statistic to update.
+ * \param[in] start Value returned by StatsStart() when the event started.
+ * \param[in] bytes Bytes moved by the event.
+ ****************************************************************************/
+void StatsEnd(StatsId id, uint64_t start, uint64_t bytes) {
+	uint64_t end;
+	char buf[16];
+
+	if (!start || (id >= STATS_MAX)) return;
+	end = SCTraceNow();
+	StatsAdd(id, end - start, bytes);
+	if (!statsTl) return;
+	// Pipelined command round trips overlap
+	g_mutex_lock(&statsLock);
+	StatsTlEvent(StatsName(id, buf, sizeof(buf)), (id < STATS_CMD)?"io":
+			"cmd", start, end, bytes, id >= STATS_CMD);
+	g_mutex_unlock(&statsLock);
+}
+
+/************************************************************************//**
+ * Obtains a percentile of the values of a statistic.
+ *
+ * \param[in] s   Statistic.
+ * \param[in] pct Percentile to obtain.
+ *
+ * \return Lowest value not exceeded by pct percent of the events.
+ ****************************************************************************/
+static uint64_t StatsPercentile(const Stat *s, unsigned int pct) {
+	uint64_t target = (s->count * pct + 99) / 100;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		if ((seen += s->hist[i]) >= target) break;
+	}
+	return MIN(StatsBucketMax(i), s->max);
+}
+
+/************************************************************************//**
+ * Prints a statistic value, in a 9 character wide column.
+ *
+ * \param[in] value Value to print.
+ * \param[in] time  TRUE if the value is a duration in nanoseconds.
+ ****************************************************************************/
+static void StatsValuePrint(uint64_t value, int time) {
+	if (!time || (value < 1000)) printf(" %7llu%s", (unsigned long long)
+			value, time?"ns":"  ");
+	else if (value < 1000000) printf(" %7.2fus", value / 1e3);
+	else if (value < 1000000000) printf(" %7.2fms", value / 1e6);
+	else printf(" %7.3fs ", value / 1e9);
+}
+
+/************************************************************************//**
+ * Prints the statistics with events to the standard output: event count,
+ * bytes moved and throughput, value total, minimum, maximum and
+ * percentiles.
+ ****************************************************************************/
+void StatsPrint(void) {
+	static const unsigned int pct[] = {50, 90, 99};
+	char buf[16];
+	const Stat *s;
+	int i, j, time;
+
+	g_mutex_lock(&statsLock);
+	printf("\n%-16s %8s %11s %8s %9s %9s %9s %9s %9s %9s\n", "Statistic",
+			"Count", "Bytes", "MB/s", "Total", "Min", "p50", "p90", "p99",
+			"Max");
+	for (i = 0; i < STATS_MAX; i++) {
+		s = stats + i;
+		if (!s->count) continue;
+		time = i != STATS_SOF_POLL;
+		printf("%-16s %8llu %11llu", StatsName(i, buf, sizeof(buf)),
+				(unsigned long long)s->count, (unsigned long long)s->bytes);
+		if (time && s->bytes && s->sum) {
+			printf(" %8.2f", s->bytes * 1e3 / s->sum);
+		} else printf(" %8s", "-");
+		StatsValuePrint(s->sum, time);
+		StatsValuePrint(s->min, time);
+		for (j = 0; j < (int)(sizeof(pct) / sizeof(pct[0])); j++)
+			StatsValuePrint(StatsPercentile(s, pct[j]), time);
+		StatsValuePrint(s->max, time);
+		putchar('\n');
+	}
+	g_mutex_unlock(&statsLock);
+}
+
@@ -0,0 +1,137 @@
+/************************************************************************//**
+ * \file
+ * \brief Performance counters and latency histograms.
+ *
+ * \defgroup stats stats
+ * \{
+ * \brief Performance counters and latency histograms.
+ *
+ * Each statistic counts events (e.g. frames sent, or command round trips),
+ * the bytes they moved, and a histogram of their values. Histograms are
+ * log-linear (as HDR histograms): each power of two range is split in
+ * STATS_SUB_BUCKETS buckets, so percentiles are obtained with a relative
+ * error under 1/STATS_SUB_BUCKETS, for any value, using a fixed amount of
+ * memory.
+ *
+ * Statistics are only kept after StatsEnable() is called, so they cost
+ * nothing otherwise. They can be updated concurrently from several
+ * threads (e.g. in gang mode).
+ *
+ * Timed events can also be written to a timeline, along with spans marking
+ * the program phases, that can be loaded in Chrome (chrome://tracing) or
+ * Perfetto trace viewers. Each thread gets its own track, where spans and
+ * events are shown nested. Command round trips can overlap (with
+ * pipelining), so they are shown in tracks of their own.
+ *
+ * \author Jesus Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+/// Number of histogram buckets for each power of two range, log2
+#define STATS_SUB_BITS		4
+/// Number of histogram buckets for each power of two range
+#define STATS_SUB_BUCKETS	(1<<STATS_SUB_BITS)
+/// Number of command opcodes with their own statistic
+#define STATS_CMD_OPCODES	16
+
+/// Available statistics. Unless stated otherwise, values are durations in
+/// nanoseconds.
+typedef enum {
+	STATS_FRAME_SEND = 0,	///< Frames sent, SCFrameSend()
+	STATS_FRAME_RECV,		///< Frames received, SCFrameRecv()
+	STATS_BATCH_SEND,		///< Frame batches sent, SCFrameBatchSend()
+	STATS_CHUNK_SEND,		///< Bulk chunks sent, SCChunkSend()
+	STATS_CHUNK_RECV,		///< Bulk chunks received, SCChunkRecv()
+	STATS_PAYLOAD_SEND,		///< Payloads sent, SCPayloadSend()
+	STATS_PAYLOAD_RECV,		///< Payloads received, SCPayloadRecv()
+	/// Reads polling for the start of each frame received (value is the
+	/// number of reads, bytes are the fill bytes skipped)
+	STATS_SOF_POLL,
+	STATS_FILE_READ,		///< Host file reads
+	STATS_FILE_WRITE,		///< Host file writes
+	/// Round trip of each command, or of each chunk of pipelined reads and
+	/// writes, one statistic for each opcode: STATS_CMD + opcode
+	STATS_CMD,
+	STATS_MAX = STATS_CMD + STATS_CMD_OPCODES	///< Number of statistics
+} StatsId;
+
+/************************************************************************//**
+ * Starts keeping statistics.
+ ****************************************************************************/
+void StatsEnable(void);
+
+/************************************************************************//**
+ * Obtains the start time of an event, to be passed later to StatsEnd().
+ *
+ * \return Timestamp in nanoseconds, or 0 if neither statistics nor a
+ *         timeline are enabled.
+ ****************************************************************************/
+uint64_t StatsStart(void);
+
+/************************************************************************//**
+ * Obtains a timestamp, even if statistics are not enabled.
+ *
+ * \return Timestamp in nanoseconds.
+ ****************************************************************************/
+uint64_t StatsNow(void);
+
+/************************************************************************//**
+ * Starts writing a timeline of the events and spans, in Chrome trace event
+ * format. Events are written as they end.
+ *
+ * \param[in] file Timeline file name.
+ *
+ * \return 0 on success, -1 if the file could not be created.
+ ****************************************************************************/
+int StatsTimelineOpen(const char *file);
+
+/************************************************************************//**
+ * Adds a span to the timeline, if one is being written. Spans mark program
+ * phases, and are not kept in statistics.
+ *
+ * \param[in] name  Span name.
+ * \param[in] start Span start time, obtained with StatsStart() or
+ *            StatsNow().
+ * \param[in] end   Span end time, obtained with StatsNow().
+ ****************************************************************************/
+void StatsSpan(const char *name, uint64_t start, uint64_t end);
+
+/************************************************************************//**
+ * Finishes writing the timeline, if one is being written.
+ ****************************************************************************/
+void StatsTimelineClose(void);
+
+/************************************************************************//**
+ * Adds an event to a statistic.
+ *
+ * \param[in] id    Statistic to update.
+ * \param[in] value Event value (duration in nanoseconds for most).
+ * \param[in] bytes Bytes moved by the event.
+ ****************************************************************************/
+void StatsAdd(StatsId id, uint64_t value, uint64_t bytes);
+
+/************************************************************************//**
+ * Adds an event started with StatsStart() to a statistic, using the time
+ * elapsed since then as value, and writes it to the timeline, if one is
+ * being written.
+ *
+ * \param[in] id    Statistic to update.
+ * \param[in] start Value returned by StatsStart() when the event started.
+ * \param[in] bytes Bytes moved by the event.
+ ****************************************************************************/
+void StatsEnd(StatsId id, uint64_t start, uint64_t bytes);
+
+/************************************************************************//**
+ * Prints the statistics with events to the standard output: event count,
+ * bytes moved and throughput, value total, minimum, maximum and
+ * percentiles.
+ ****************************************************************************/
+void StatsPrint(void);
+
+#endif /*_STATS_H_*/
+
+/** \} */